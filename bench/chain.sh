@@ -0,0 +1,11 @@
+#!/bin/sh
+# chain.sh N: one assignment whose right-hand side is N terms long, which
+# parses as a left-deep tree of Plus and Minus N deep
+awk -v n="${1:-1000000}" '
+BEGIN {
+  split("alpha beta gamma", v, " ");
+  printf "alpha := 1; beta := 2; gamma := 3;\nsum := alpha";
+  for(i = 1; i < n; i++)
+    printf "%s%s", i % 2 ? " + " : " - ", v[i % 3 + 1];
+  printf "\n";
+}' | fold -s -w 78
@@ -0,0 +1,21 @@
+#!/bin/sh
+# procs.sh N: N procedures, each with variables of its own, and a main
+# program that calls every one of them
+awk -v n="${1:-2000}" '
+function name(i,  s) {
+  s = "";
+  do { s = sprintf("%c", 97 + i % 26) s; i = int(i / 26) } while(i > 0);
+  return s;
+}
+BEGIN {
+  for(i = 0; i < n; i++) {
+    p = "p" name(i); v = "v" name(i); w = "w" name(i);
+    printf "define %s proc(n) %s := n; %s := 0;\n", p, v, w;
+    printf "  while %s do %s := %s + %s; %s := %s - 1 od;\n", v, w, w, v, v, v;
+    printf "  if %s then return := %s else return := 0 - %s fi end;\n", w, w, w;
+  }
+  printf "s := 0";
+  for(i = 0; i < n; i++)
+    printf ";\ns := s + p%s(%d)", name(i), i % 10;
+  printf "\n";
+}'
@@ -0,0 +1,81 @@
+#!/bin/sh
+# server.sh [OPTION...]: compiles ten copies of a 400-procedure program,
+# each with a different procedure edited, once from cold and once through
+# a compile server that has already seen the original, and says how long
+# a program took each way, at best over three rounds. The server has to
+# print what a cold run does.
+procs=400
+copies=10
+rounds=3
+dir=$(mktemp -d)
+trap 'kill $server 2> /dev/null; rm -rf "$dir"' EXIT
+
+# program EDIT: the program, with a constant in procedure EDIT changed
+program()
+{
+  awk -v n=$procs -v edit="$1" '
+  function name(i,  s) {
+    s = "";
+    do { s = sprintf("%c", 97 + i % 26) s; i = int(i / 26) } while(i > 0);
+    return s;
+  }
+  function random() { seed = seed * 16807 % 2147483647;
+                      return seed; }
+  BEGIN {
+    seed = 1;
+    for(i = 0; i < n; i++) {
+      printf "define p%s proc(a, b) s := a;", name(i);
+      for(j = 0; j < 12; j++)
+        printf " s := s * %d + a - %d;", random() % 9 + 1,
+               random() % 99 + 1 + (i == edit && j == 0 ? 300 : 0);
+      printf " i := b; while i do s := s + i; i := i - 1 od;";
+      printf " if s then return := s else return := 0 - s fi end;\n";
+    }
+    printf "x := p%s(0, 3)", name(0);
+    for(i = 1; i < n; i++)
+      printf " +\n  p%s(%d, 3)", name(i), i;
+    printf "\n";
+  }'
+}
+
+program -1 > "$dir/0.p"
+for k in $(seq 1 $copies); do
+  program $((k * procs / copies - 1)) > "$dir/$k.p"
+done
+
+./compiler -d "$dir/socket" > /dev/null &
+server=$!
+while [ ! -S "$dir/socket" ]; do sleep 0.1; done
+./compiler -k "$dir/socket" "$@" < "$dir/0.p" > /dev/null || exit 1
+
+# each NAME COMMAND...: runs COMMAND on every copy, keeping the output as
+# k.NAME, and prints the milliseconds it took a copy
+each()
+{
+  name=$1
+  shift
+  start=$(date +%s%N)
+  for k in $(seq 1 $copies); do
+    "$@" < "$dir/$k.p" > "$dir/$k.$name" || return 1
+  done
+  end=$(date +%s%N)
+  echo $(( (end - start) / 1000000 / copies ))
+}
+
+cold=
+warm=
+for r in $(seq 1 $rounds); do
+  t=$(each cold ./compiler "$@") || exit 1
+  [ -z "$cold" ] || [ $t -lt $cold ] && cold=$t
+  t=$(each warm ./compiler -k "$dir/socket" "$@") || exit 1
+  [ -z "$warm" ] || [ $t -lt $warm ] && warm=$t
+done
+
+for k in $(seq 1 $copies); do
+  if ! cmp -s "$dir/$k.cold" "$dir/$k.warm"; then
+    echo "server $*: copy $k came out different"
+    exit 1
+  fi
+done
+
+echo "server ${*:-without options}: cold $cold ms, warm $warm ms a program"
@@ -0,0 +1,10 @@
+#!/bin/sh
+# stmts.sh N: a main program N statements long, as one statement list
+awk -v n="${1:-10000000}" '
+BEGIN {
+  split("alpha beta gamma delta", v, " ");
+  printf "alpha := 1; beta := 2; gamma := 3; delta := 4";
+  for(i = 0; i < n - 4; i++)
+    printf ";\n%s := %s + %d", v[i % 4 + 1], v[(i + 1) % 4 + 1], i % 1000;
+  printf "\n";
+}'
@@ -0,0 +1,12 @@
+#!/bin/sh
+# time.sh LABEL COMMAND...: runs COMMAND, with this script's input and its
+# output thrown away, and says how long it took in milliseconds
+label=$1
+shift
+start=$(date +%s%N)
+if ! "$@" > /dev/null; then
+  echo "$label: failed"
+  exit 1
+fi
+end=$(date +%s%N)
+echo "$label: $(( (end - start) / 1000000 )) ms"
@@ -0,0 +1,65 @@
+#!/bin/sh
+# check.sh: runs the sample programs, and a few generated ones, every way
+# the compiler can run them, and checks that each run ends with the same
+# variables the evaluator (-e) ends with. A variable that's never assigned
+# doesn't show up under -e at all, and reads 0 in a compiled program.
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cp *.p "$dir"
+bench/procs.sh 30 > "$dir/procs.p"
+bench/chain.sh 1001 > "$dir/chain.p"
+bench/stmts.sh 1000 > "$dir/stmts.p"
+
+# The first name table in what's read; -s prints one per lane
+table()
+{
+  awk '/^Name Table$/ { on = 1; next } on && / -> / { print; next } on { exit }'
+}
+
+# agrees EXPECTED ACTUAL: every variable in EXPECTED has the same value in
+# ACTUAL, and anything else in ACTUAL is 0
+agrees()
+{
+  awk 'NR == FNR { want[$1] = $3; next }
+       { if($1 in want) { if(want[$1] != $3) exit 1; delete want[$1] }
+         else if($3 != 0) exit 1 }
+       END { for(name in want) exit 1 }' "$1" "$2"
+}
+
+runs=0
+failed=0
+
+# check PROGRAM LABEL COMMAND...: runs COMMAND on PROGRAM against -e
+check()
+{
+  program=$1
+  label=$2
+  shift 2
+  runs=$((runs + 1))
+  if ! "$@" < "$program" > "$dir/out" 2>&1 ||
+     ! table < "$dir/out" > "$dir/actual" ||
+     ! agrees "$dir/expected" "$dir/actual"; then
+    echo "FAIL $(basename "$program"): $label"
+    failed=$((failed + 1))
+  fi
+}
+
+for program in "$dir"/*.p; do
+  ./compiler -e < "$program" | table > "$dir/expected"
+
+  for run in "-r" "-j" "-s 8"; do
+    for options in "" "-x" "-x -c" "-z" "-x -c -z" "-a" "-x -c -a" "-p" \
+                   "-x -c -p"; do
+      check "$program" "$run $options" ./compiler $run $options
+    done
+  done
+
+  check "$program" "-r -f" ./compiler -r -f "$program"
+  check "$program" "-r -g" ./compiler -r -g "$dir/profile"
+  check "$program" "-r -u" ./compiler -r -u "$dir/profile"
+  check "$program" "-j -x -c -u" ./compiler -j -x -c -u "$dir/profile"
+done
+
+echo "$runs runs, $failed failed"
+[ $failed -eq 0 ]
@@ -0,0 +1,165 @@
+/*
+ * file:  compilepool.cpp
+ *
+ * Description: Compiling procedures on worker threads.
+ */
+#include <unistd.h>
+#include "programext.h"
+#include "compilepool.h"
+
+using namespace std;
+
+CompilePool::CompilePool(CompileOptions options, int threads)
+{
+  if(threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(threads <= 0)
+    threads = 1;
+
+  threads_ = threads;
+  nextWorker_ = 0;
+  stopped_ = false;
+  cancelled_ = 0;
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&finished_, NULL);
+
+  options.cache = NULL;
+  options.pool = NULL;
+  for(int i = 0; i < threads_; i++)
+  {
+    Worker *w = new Worker();
+    w->pool = this;
+    initEnv(w->e, options);
+    workers_.push_back(w);
+    pthread_create(&w->thread, NULL, work, w);
+  }
+}
+
+/* The program has copies of whatever it took; these were only ever
+ * compiled to be copied */
+CompilePool::~CompilePool()
+{
+  stop();
+
+  map<Proc*, Job*>::iterator it;
+  for(it = jobs_.begin(); it != jobs_.end(); it++)
+  {
+    delete it->second->function;
+    delete it->second;
+  }
+
+  for(int i = 0; i < threads_; i++)
+  {
+    Env &e = workers_[i]->e;
+    vector<MemoryLocation*>::iterator ct;
+    for(ct = e.constants.locations.begin(); ct != e.constants.locations.end();
+        ct++)
+      delete *ct;
+
+    delete e.fp;
+    delete e.sp;
+    delete e.scratch;
+    delete e.scratch2;
+    delete e.prev_fp;
+    delete workers_[i];
+  }
+
+  pthread_mutex_destroy(&lock_);
+  pthread_cond_destroy(&finished_);
+}
+
+/* Dealt out round robin, like RALBatch's jobs */
+void CompilePool::submit(Proc *P)
+{
+  if(stopped_ || jobs_.count(P))
+    return;
+
+  Worker *w = workers_[nextWorker_];
+  nextWorker_ = (nextWorker_ + 1) % threads_;
+
+  Job *job = new Job();
+  job->P = P;
+  job->e = &w->e;
+  job->function = NULL;
+  job->state = QUEUED;
+  jobs_[P] = job;
+
+  w->jobs.reserve() = job;
+  w->jobs.push();
+}
+
+RALFunction *CompilePool::take(Proc *P, Env &e)
+{
+  map<Proc*, Job*>::iterator it = jobs_.find(P);
+  if(it == jobs_.end())
+    return NULL;
+  Job *job = it->second;
+
+  /* Waiting behind whatever else the worker has queued would be slower
+   * than doing it here */
+  int queued = QUEUED;
+  if(__atomic_compare_exchange_n(&job->state, &queued, (int)TAKEN_BACK,
+                                 false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    return NULL;
+
+  pthread_mutex_lock(&lock_);
+  while(job->state != DONE)
+    pthread_cond_wait(&finished_, &lock_);
+  pthread_mutex_unlock(&lock_);
+
+  if(job->function == NULL)
+    return NULL;
+  return job->function->clone(*job->e, e);
+}
+
+void CompilePool::stop()
+{
+  if(stopped_)
+    return;
+  stopped_ = true;
+
+  __atomic_store_n(&cancelled_, 1, __ATOMIC_SEQ_CST);
+  for(int i = 0; i < threads_; i++)
+  {
+    workers_[i]->jobs.reserve() = NULL;
+    workers_[i]->jobs.push();
+  }
+
+  for(int i = 0; i < threads_; i++)
+    pthread_join(workers_[i]->thread, NULL);
+}
+
+/* A NULL job means there won't be any more */
+void *CompilePool::work(void *arg)
+{
+  Worker *w = (Worker*)arg;
+  CompilePool *pool = w->pool;
+
+  for(;;)
+  {
+    Job *job = w->jobs.front();
+    w->jobs.pop();
+    if(job == NULL)
+      break;
+
+    int queued = QUEUED;
+    if(__atomic_load_n(&pool->cancelled_, __ATOMIC_SEQ_CST) ||
+       !__atomic_compare_exchange_n(&job->state, &queued, (int)RUNNING,
+                                    false, __ATOMIC_SEQ_CST,
+                                    __ATOMIC_SEQ_CST))
+      continue;
+
+    pool->finish(job, job->P->compile(w->e));
+  }
+
+  return NULL;
+}
+
+void CompilePool::finish(Job *job, RALFunction *function)
+{
+  pthread_mutex_lock(&lock_);
+  job->function = function;
+  __atomic_store_n(&job->state, (int)DONE, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&finished_);
+  pthread_mutex_unlock(&lock_);
+}
@@ -0,0 +1,96 @@
+#ifndef __COMPILEPOOL_H__
+#define __COMPILEPOOL_H__
+/*
+ * file:  compilepool.h
+ *
+ * Description: Threads that compile procedures while the rest of the
+ * program is still being parsed. Each worker compiles against an Env of
+ * its own, the way ProcCache does, and Program::compile picks the results
+ * up as it reaches them and moves a copy over to the program's Env. One
+ * that no worker has started on by then it compiles itself.
+ *
+ * Which definition of a name is the one that's called, and whether
+ * anything calls it at all, isn't known until the whole program is in, so
+ * every procedure is compiled as soon as it's parsed and whatever the
+ * program turns out not to need is thrown away.
+ */
+#include <map>
+#include <vector>
+#include <pthread.h>
+#include "ralprogram.h"
+#include "spscqueue.h"
+
+using namespace std;
+
+class Proc;
+
+/* How many procedures can be waiting on one worker before the parser has
+ * to wait for it to catch up */
+const int COMPILE_QUEUE_SIZE = 1 << 10;
+
+class CompilePool
+{
+ public:
+  /* threads <= 0 means one per processor. options must not instrument,
+   * go by a profile or specialize: those compile a procedure differently
+   * depending on the rest of the program. */
+  CompilePool(CompileOptions options, int threads = 0);
+  /* Stops the workers, so nothing of the program they were compiling may
+   * be freed before this */
+  ~CompilePool();
+
+  /* Queues P on the next worker; only ever called from one thread */
+  void submit(Proc *P);
+
+  /* What P->compile(e) would give, once the worker it went to has
+   * compiled it. If the worker hasn't got to it yet it's taken back
+   * instead, and this is NULL for the caller to compile P itself, as it is
+   * if P was never submitted. Only from the thread that submits. */
+  RALFunction *take(Proc *P, Env &e);
+
+  /* Has the workers drop whatever they haven't started on and waits for
+   * them to finish; take() still works for anything already compiled */
+  void stop();
+
+  int getThreads() { return threads_; };
+
+ private:
+  enum JobState { QUEUED, RUNNING, DONE, TAKEN_BACK };
+
+  struct Job
+  {
+    Proc *P;
+    /* The worker's, which function was compiled against */
+    const Env *e;
+    RALFunction *function;
+    int state;
+  };
+
+  struct Worker
+  {
+    Worker() : jobs(COMPILE_QUEUE_SIZE) {};
+
+    CompilePool *pool;
+    pthread_t thread;
+    SPSCQueue<Job*> jobs;
+    Env e;
+  };
+
+  static void *work(void *arg);
+  void finish(Job *job, RALFunction *function);
+
+  int threads_;
+  vector<Worker*> workers_;
+  int nextWorker_;
+  bool stopped_;
+  int cancelled_;
+
+  map<Proc*, Job*> jobs_;
+
+  /* Finished jobs are announced under this; the thread that takes them
+   * only ever waits on each one once */
+  pthread_mutex_t lock_;
+  pthread_cond_t finished_;
+};
+
+#endif
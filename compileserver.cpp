@@ -0,0 +1,205 @@
+/*
+ * file:  compileserver.cpp
+ *
+ * Description: Serving compiles over a Unix domain socket.
+ */
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "compileserver.h"
+
+using namespace std;
+
+static double now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* False, with nothing changed, if path is too long for a socket address */
+static bool makeAddress(const char *path, struct sockaddr_un &address)
+{
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(address.sun_path))
+  {
+    cout << "Error:  socket path " << path << " is too long" << endl;
+    return false;
+  }
+
+  strcpy(address.sun_path, path);
+  return true;
+}
+
+/* Everything until the other end shuts down */
+static bool readAll(int fd, string &data)
+{
+  char buffer[1 << 16];
+  ssize_t n;
+  while((n = read(fd, buffer, sizeof(buffer))) != 0)
+  {
+    if(n < 0)
+      return false;
+    data.append(buffer, n);
+  }
+
+  return true;
+}
+
+static bool writeAll(int fd, const string &data)
+{
+  size_t done = 0;
+  while(done < data.size())
+  {
+    ssize_t n = write(fd, data.data() + done, data.size() - done);
+    if(n <= 0)
+      return false;
+    done += n;
+  }
+
+  return true;
+}
+
+CompileServer::CompileServer(const char *path, RequestHandler handler)
+{
+  path_ = path;
+  handler_ = handler;
+  served_ = 0;
+}
+
+bool CompileServer::run()
+{
+  struct sockaddr_un address;
+  if(!makeAddress(path_, address))
+    return false;
+
+  /* Only ever a socket is removed, never a file that happens to be there */
+  struct stat st;
+  if(lstat(path_, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path_);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(listener < 0 ||
+     bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+     listen(listener, SOMAXCONN) != 0)
+  {
+    cout << "Error:  can't listen on " << path_ << ": " << strerror(errno)
+         << endl;
+    if(listener >= 0)
+      close(listener);
+    return false;
+  }
+
+  cout << "Serving on " << path_ << endl;
+
+  for(;;)
+  {
+    int connection = accept(listener, NULL, NULL);
+    if(connection < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      cout << "Error:  accept failed: " << strerror(errno) << endl;
+      close(listener);
+      return false;
+    }
+
+    serve(connection);
+    close(connection);
+  }
+}
+
+void CompileServer::serve(int connection)
+{
+  double start = now();
+
+  string request;
+  if(!readAll(connection, request))
+    return;
+
+  size_t newline = request.find('\n');
+  if(newline == string::npos)
+    newline = request.size();
+
+  vector<string> args;
+  istringstream header(request.substr(0, newline));
+  string arg;
+  while(header >> arg)
+    args.push_back(arg);
+
+  /* The handler reads the program like it would stdin, and whatever it
+   * prints goes back instead of to ours */
+  string program = newline < request.size() ?
+    request.substr(newline + 1) : string();
+  size_t size = program.size();
+
+  /* A newline on the end changes nothing, and fmemopen won't take an
+   * empty buffer */
+  program += '\n';
+  FILE *in = fmemopen((void*)program.data(), program.size(), "r");
+  if(in == NULL)
+    return;
+
+  ostringstream out;
+  streambuf *saved = cout.rdbuf(out.rdbuf());
+  int status = handler_(args, in);
+  cout.flush();
+  cout.rdbuf(saved);
+  fclose(in);
+
+  string reply(1, (char)('0' + status));
+  reply += out.str();
+  writeAll(connection, reply);
+
+  served_++;
+  cout << "Request " << served_ << ": " << size << " bytes in, "
+       << reply.size() - 1 << " out, status " << status << ", "
+       << (now() - start) * 1000 << " ms" << endl;
+}
+
+int CompileServer::request(const char *path, const vector<string> &args,
+                           istream &in, ostream &out)
+{
+  struct sockaddr_un address;
+  if(!makeAddress(path, address))
+    return 1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+  {
+    cout << "Error:  can't reach a server on " << path << endl;
+    if(fd >= 0)
+      close(fd);
+    return 1;
+  }
+
+  string request;
+  for(int i = 0; i < args.size(); i++)
+    request += (i > 0 ? " " : "") + args[i];
+  request += '\n';
+
+  ostringstream program;
+  program << in.rdbuf();
+  request += program.str();
+
+  string reply;
+  bool ok = writeAll(fd, request) && shutdown(fd, SHUT_WR) == 0 &&
+            readAll(fd, reply) && !reply.empty();
+  close(fd);
+
+  if(!ok)
+  {
+    cout << "Error:  no reply from the server on " << path << endl;
+    return 1;
+  }
+
+  out.write(reply.data() + 1, reply.size() - 1);
+  out.flush();
+  return reply[0] - '0';
+}
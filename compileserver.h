@@ -0,0 +1,50 @@
+#ifndef __COMPILESERVER_H__
+#define __COMPILESERVER_H__
+/*
+ * file:  compileserver.h
+ *
+ * Description: A compiler that stays up between programs, serving them
+ * over a Unix domain socket one at a time, so whatever it keeps between
+ * them (parsed input aside, its ProcCache) stays warm.
+ *
+ * A request is one line of options, separated by spaces, then the
+ * program, then the client shuts its end down for writing. The reply is
+ * one byte, '0' plus the handler's status, then everything the handler
+ * printed.
+ */
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* Handles one request: compiles the program on in with the options in
+ * args, prints what the client should see and returns its exit status */
+typedef int (*RequestHandler)(const vector<string> &args, FILE *in);
+
+class CompileServer
+{
+ public:
+  CompileServer(const char *path, RequestHandler handler);
+
+  /* Serves requests until something goes wrong with the socket, which is
+   * reported; a stale socket left at path by an earlier server is
+   * replaced */
+  bool run();
+
+  /* Sends the program on in to the server at path and copies the reply to
+   * out; returns the handler's status, or 1 if the server can't be
+   * reached */
+  static int request(const char *path, const vector<string> &args,
+                     istream &in, ostream &out);
+
+ private:
+  void serve(int connection);
+
+  const char *path_;
+  RequestHandler handler_;
+  long long served_;
+};
+
+#endif
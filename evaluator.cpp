@@ -0,0 +1,159 @@
+/*
+ * file:  evaluator.cpp
+ *
+ * Description: The task and frame stacks Program::eval runs on.
+ */
+#include <cstdlib>
+#include <iostream>
+#include "evaluator.h"
+#include "programext.h"
+
+using namespace std;
+
+Evaluator::Evaluator(SymbolMap<int> &NT, SymbolMap<Proc*> &FT,
+                     int depthLimit)
+{
+  depthLimit_ = depthLimit;
+  depth_ = 0;
+
+  chunks_.push_back(new Frame[FRAME_CHUNK]);
+  frame(0).NT = &NT;
+  frame(0).FT = &FT;
+}
+
+Evaluator::~Evaluator()
+{
+  for(int i = 0; i < chunks_.size(); i++)
+  {
+    for(int j = 0; j < FRAME_CHUNK; j++)
+      delete chunks_[i][j].copied;
+    delete [] chunks_[i];
+  }
+}
+
+void Evaluator::run(const StmtList *L)
+{
+  push(L);
+
+  while(!tasks_.empty())
+  {
+    Task t = tasks_.back();
+    tasks_.pop_back();
+
+    switch(t.kind)
+    {
+      case EXPR:
+        ((const Expr*)t.node)->step(*this, t.phase);
+        break;
+      case STMT:
+        ((const Stmt*)t.node)->step(*this, t.phase);
+        break;
+      case STMTS:
+        ((const StmtList*)t.node)->step(*this, t.phase);
+        break;
+      case RETURN:
+        finishCall();
+        break;
+    }
+  }
+}
+
+void Evaluator::push(const Expr *E, int phase)
+{
+  Task t = { EXPR, E, phase };
+  tasks_.push_back(t);
+}
+
+void Evaluator::push(const Stmt *S, int phase)
+{
+  Task t = { STMT, S, phase };
+  tasks_.push_back(t);
+}
+
+void Evaluator::push(const StmtList *L, int phase)
+{
+  Task t = { STMTS, L, phase };
+  tasks_.push_back(t);
+}
+
+int Evaluator::popValue()
+{
+  int value = values_.back();
+  values_.pop_back();
+  return value;
+}
+
+void Evaluator::popValues(int n, vector<int> &values)
+{
+  values.assign(values_.end() - n, values_.end());
+  values_.resize(values_.size() - n);
+}
+
+void Evaluator::define(Symbol name, Proc *P)
+{
+  Frame &f = frame(depth_);
+
+  /* The top level's table is the program's, and is meant to change */
+  if(depth_ > 0 && f.copied == NULL)
+  {
+    f.copied = new SymbolMap<Proc*>(*f.FT);
+    f.FT = f.copied;
+  }
+
+  (*f.FT)[name] = P;
+}
+
+void Evaluator::call(Proc *P, const vector<int> &args, bool memoize)
+{
+  if(depth_ >= depthLimit_)
+  {
+    cout << "Error:  calls nested more than " << depthLimit_ << " deep"
+         << endl;
+    exit(1);
+  }
+
+  SymbolMap<Proc*> *FT = frame(depth_).FT;
+
+  depth_++;
+  if(depth_ / FRAME_CHUNK >= chunks_.size())
+    chunks_.push_back(new Frame[FRAME_CHUNK]);
+
+  Frame &f = frame(depth_);
+  f.NT = &f.locals;
+  f.FT = FT;
+  f.P = P;
+  f.memoize = memoize;
+  if(memoize)
+    f.args = args;
+
+  P->bind(f.locals, args);
+
+  Task t = { RETURN, P, 0 };
+  tasks_.push_back(t);
+  push(P->getBody());
+}
+
+/* A frame is left the way it was made, so the next call at this depth
+ * gets its tables' room back without asking for more */
+void Evaluator::finishCall()
+{
+  Frame &f = frame(depth_);
+
+  if(!f.locals.contains(RETURN_SYMBOL))
+  {
+    cout << "Error:  no return value" << endl;
+    exit(1);
+  }
+
+  int value = f.locals.get(RETURN_SYMBOL);
+  if(f.memoize)
+    FunCall::getMemoTable()->insert(f.P, f.args, value);
+
+  f.locals.clear();
+  delete f.copied;
+  f.copied = NULL;
+  f.P = NULL;
+
+  depth_--;
+  pushValue(value);
+}
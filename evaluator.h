@@ -0,0 +1,106 @@
+#ifndef __EVALUATOR_H__
+#define __EVALUATOR_H__
+/*
+ * file:  evaluator.h
+ *
+ * Description: The machine Program::eval runs on. Instead of each node
+ * evaluating its children by calling into them, which puts every level of
+ * an expression and every procedure call on the C++ stack, a node pushes
+ * what's left for it to do as tasks here and leaves its value on a stack
+ * of values. Procedure calls get frames from a stack that grows a chunk at
+ * a time and never moves, so how deep a program can recurse is up to the
+ * depth limit and the heap, not the native stack.
+ */
+#include <vector>
+#include "symbols.h"
+
+using namespace std;
+
+class Expr;
+class Stmt;
+class StmtList;
+class Proc;
+
+/* Calls nested deeper than this are an error. A frame is a little over a
+ * hundred bytes, plus a word for every name up to the last one the
+ * procedure binds. */
+const int DEFAULT_DEPTH_LIMIT = 1 << 24;
+
+/* How many frames are made at a time */
+const int FRAME_CHUNK = 1 << 10;
+
+class Evaluator
+{
+ public:
+  /* The top level runs in NT and FT, and whatever it binds stays there */
+  Evaluator(SymbolMap<int> &NT, SymbolMap<Proc*> &FT,
+            int depthLimit = DEFAULT_DEPTH_LIMIT);
+  ~Evaluator();
+
+  /* Runs L at the top level until there's nothing left to do */
+  void run(const StmtList *L);
+
+  /* Work for later, done last pushed first. What phase means is up to the
+   * node; for a list it's the statement to go on from. */
+  void push(const Expr *E, int phase = 0);
+  void push(const Stmt *S, int phase = 0);
+  void push(const StmtList *L, int phase = 0);
+
+  void pushValue(int value) { values_.push_back(value); };
+  int popValue();
+  /* Takes the top n values, the one pushed first first */
+  void popValues(int n, vector<int> &values);
+
+  /* The current frame's tables */
+  SymbolMap<int> &getNames() { return *frame(depth_).NT; };
+  const SymbolMap<Proc*> &getFunctions() { return *frame(depth_).FT; };
+
+  /* Binds name for the rest of the current call only */
+  void define(Symbol name, Proc *P);
+
+  /* Runs P on args in a frame of its own, leaving its return value on the
+   * stack once the body is done. With memoize the result goes in the
+   * memo table as well. */
+  void call(Proc *P, const vector<int> &args, bool memoize);
+
+  int getDepth() { return depth_; };
+
+ private:
+  enum TaskKind { EXPR, STMT, STMTS, RETURN };
+
+  struct Task
+  {
+    TaskKind kind;
+    const void *node;
+    int phase;
+  };
+
+  struct Frame
+  {
+    Frame() { NT = NULL; FT = NULL; copied = NULL; P = NULL; };
+
+    SymbolMap<int> *NT;
+    SymbolMap<int> locals;
+    /* The caller's function table, until the body defines something and
+     * gets a copy of its own, so a call only pays for one if it needs it */
+    SymbolMap<Proc*> *FT;
+    SymbolMap<Proc*> *copied;
+    Proc *P;
+    bool memoize;
+    vector<int> args;
+  };
+
+  /* Frames are handed out in chunks and never move, so a frame can point
+   * at its caller's tables */
+  Frame &frame(int depth)
+    { return chunks_[depth / FRAME_CHUNK][depth % FRAME_CHUNK]; };
+  void finishCall();
+
+  vector<Task> tasks_;
+  vector<int> values_;
+  vector<Frame*> chunks_;
+  int depth_;
+  int depthLimit_;
+};
+
+#endif
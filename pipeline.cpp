@@ -0,0 +1,153 @@
+/*
+ * file:  pipeline.cpp
+ *
+ * Description: The lexer and emitter threads, and what goes between the
+ * stages.
+ */
+#include <iostream>
+#include "programext.h"
+#include "compilepool.h"
+#include "pipeline.h"
+
+using namespace std;
+
+Pipeline::Pipeline(Scanner *source, CompilePool *pool)
+  : blocks_(LEXEME_QUEUE_SIZE)
+{
+  source_ = source;
+  abandoned_ = 0;
+  block_ = NULL;
+  at_ = 0;
+  ended_ = false;
+  pool_ = pool;
+  emitting_ = false;
+  print_ = NULL;
+  image_ = false;
+
+  pthread_create(&lexer_, NULL, lexAll, this);
+  lexing_ = true;
+}
+
+Pipeline::~Pipeline()
+{
+  finishLexing();
+  finishCompiling();
+  finishEmitting();
+  delete pool_;
+}
+
+/* The block is filled in where it sits in the queue, and the last one
+ * ends with END_OF_INPUT */
+void *Pipeline::lexAll(void *arg)
+{
+  Pipeline *p = (Pipeline*)arg;
+
+  bool ended = false;
+  while(!ended)
+  {
+    LexemeBlock &block = p->blocks_.reserve();
+    block.count = 0;
+
+    if(__atomic_load_n(&p->abandoned_, __ATOMIC_ACQUIRE))
+    {
+      block.lexemes[block.count].kind = Token::END_OF_INPUT;
+      block.lexemes[block.count++].value = 0;
+      ended = true;
+    }
+
+    while(!ended && block.count < LEXEME_BLOCK)
+    {
+      Lexeme l = p->source_->lex();
+      block.lexemes[block.count++] = l;
+      ended = l.kind == Token::END_OF_INPUT;
+    }
+
+    p->blocks_.push();
+  }
+
+  return NULL;
+}
+
+Lexeme Pipeline::lex()
+{
+  if(ended_)
+  {
+    Lexeme end = { Token::END_OF_INPUT, 0 };
+    return end;
+  }
+
+  if(block_ == NULL || at_ == block_->count)
+  {
+    if(block_ != NULL)
+      blocks_.pop();
+    block_ = &blocks_.front();
+    at_ = 0;
+  }
+
+  Lexeme l = block_->lexemes[at_++];
+  if(l.kind == Token::END_OF_INPUT)
+  {
+    ended_ = true;
+    blocks_.pop();
+    block_ = NULL;
+  }
+
+  return l;
+}
+
+void Pipeline::parsed(const Stmt *S)
+{
+  if(pool_ == NULL)
+    return;
+
+  vector<Definition> defines;
+  S->collectDefines(defines);
+  for(int i = 0; i < defines.size(); i++)
+    pool_->submit(defines[i].second);
+}
+
+/* The lexer can only stop at the end of a block, so whatever it's already
+ * queued is read and dropped until it gets there */
+void Pipeline::finishLexing()
+{
+  if(!lexing_)
+    return;
+
+  __atomic_store_n(&abandoned_, 1, __ATOMIC_RELEASE);
+  while(lex().kind != Token::END_OF_INPUT)
+    ;
+
+  pthread_join(lexer_, NULL);
+  lexing_ = false;
+}
+
+void Pipeline::finishCompiling()
+{
+  if(pool_ != NULL)
+    pool_->stop();
+}
+
+void *Pipeline::emit(void *arg)
+{
+  Pipeline *p = (Pipeline*)arg;
+  p->print_(p->image_);
+  cout.flush();
+  return NULL;
+}
+
+void Pipeline::startEmitting(void (*print)(bool), bool image)
+{
+  print_ = print;
+  image_ = image;
+  pthread_create(&emitter_, NULL, emit, this);
+  emitting_ = true;
+}
+
+void Pipeline::finishEmitting()
+{
+  if(!emitting_)
+    return;
+
+  pthread_join(emitter_, NULL);
+  emitting_ = false;
+}
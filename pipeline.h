@@ -0,0 +1,88 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+/*
+ * file:  pipeline.h
+ *
+ * Description: The compiler's stages run side by side instead of one after
+ * another, so that a large program takes about as long as its slowest
+ * stage rather than all of them added up:
+ *   - the lexer runs on a thread of its own and hands the parser blocks of
+ *     lexemes
+ *   - each of the program's top-level statements is handed over as soon
+ *     as it's parsed, and every procedure defined in it goes off to the
+ *     workers of a CompilePool, for Program::compile to pick up
+ *   - the emitter prints the compiled program on a thread of its own while
+ *     the syntax tree, which nothing needs any more, is freed
+ * Every hand-off from one thread to the next goes through an SPSCQueue.
+ */
+#include <pthread.h>
+#include "scanner.h"
+#include "spscqueue.h"
+
+using namespace std;
+
+class Stmt;
+class CompilePool;
+
+/* Lexemes go over to the parser this many at a time, and this many blocks
+ * can be waiting */
+const int LEXEME_BLOCK = 1 << 10;
+const int LEXEME_QUEUE_SIZE = 1 << 4;
+
+class Pipeline
+{
+ public:
+  /* Starts lexing source, which has to outlive the pipeline. The pipeline
+   * owns pool, which may be NULL for nothing to be compiled ahead. */
+  Pipeline(Scanner *source, CompilePool *pool);
+  ~Pipeline();
+
+  /* The parser's end of the lexer */
+  Lexeme lex();
+
+  /* S, one of the program's own statements, has just been parsed */
+  void parsed(const Stmt *S);
+
+  CompilePool *getPool() { return pool_; };
+
+  /* Once the parser is done, whether or not it got to the end: whatever
+   * the lexer is still doing is abandoned */
+  void finishLexing();
+  /* Once the program has been compiled, or won't be: nothing the workers
+   * haven't got to is compiled, and after this the syntax tree is free to
+   * go */
+  void finishCompiling();
+
+  /* Runs print(image) on the emitter until finishEmitting() */
+  void startEmitting(void (*print)(bool), bool image);
+  void finishEmitting();
+
+ private:
+  struct LexemeBlock
+  {
+    int count;
+    Lexeme lexemes[LEXEME_BLOCK];
+  };
+
+  static void *lexAll(void *arg);
+  static void *emit(void *arg);
+
+  Scanner *source_;
+  SPSCQueue<LexemeBlock> blocks_;
+  pthread_t lexer_;
+  bool lexing_;
+  int abandoned_;
+  /* The block the parser is part way through */
+  LexemeBlock *block_;
+  int at_;
+  bool ended_;
+
+  CompilePool *pool_;
+
+  pthread_t emitter_;
+  bool emitting_;
+  void (*print_)(bool);
+  bool image_;
+};
+
+#endif
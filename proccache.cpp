@@ -0,0 +1,74 @@
+/*
+ * file:  proccache.cpp
+ *
+ * Description: Reusing compiled procedures across programs.
+ */
+#include "programext.h"
+#include "proccache.h"
+
+using namespace std;
+
+ProcCache::ProcCache(int capacity)
+{
+  capacity_ = capacity;
+  hits_ = 0;
+  misses_ = 0;
+  initEnv(e_, CompileOptions());
+}
+
+ProcCache::~ProcCache()
+{
+  flush();
+
+  delete e_.fp;
+  delete e_.sp;
+  delete e_.scratch;
+  delete e_.scratch2;
+  delete e_.prev_fp;
+}
+
+/* The constants go with the functions that use them */
+void ProcCache::flush()
+{
+  map<unsigned long long, RALFunction*>::iterator it;
+  for(it = functions_.begin(); it != functions_.end(); it++)
+    delete it->second;
+  functions_.clear();
+
+  vector<MemoryLocation*>::iterator ct;
+  for(ct = e_.constants.locations.begin();
+      ct != e_.constants.locations.end(); ct++)
+    delete *ct;
+  e_.constants = ConstantPool();
+}
+
+RALFunction *ProcCache::compile(Proc *P, Env &e)
+{
+  if(e.options.instrument || e.options.profile != NULL ||
+     e.specializer != NULL)
+    return P->compile(e);
+
+  /* Outlining happens once the whole program is linked, so it doesn't
+   * change what a procedure compiles to */
+  Hash h;
+  h.add(e.options.extendedISA);
+  h.add(e.options.nativeCalls);
+  P->hash(h);
+
+  map<unsigned long long, RALFunction*>::iterator it =
+    functions_.find(h.getValue());
+  if(it == functions_.end())
+  {
+    misses_++;
+    if(functions_.size() >= capacity_)
+      flush();
+
+    e_.options = e.options;
+    e_.options.cache = NULL;
+    it = functions_.insert(make_pair(h.getValue(), P->compile(e_))).first;
+  }
+  else
+    hits_++;
+
+  return it->second->clone(e_, e);
+}
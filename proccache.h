@@ -0,0 +1,44 @@
+#ifndef __PROCCACHE_H__
+#define __PROCCACHE_H__
+/*
+ * file:  proccache.h
+ *
+ * Description: Compiled procedures kept from one compile to the next, for
+ * a compiler that stays up between programs. A procedure compiles to the
+ * same code wherever it turns up, so each one is keyed by a hash of its
+ * syntax tree and the options it was compiled with, and compiled once
+ * against an Env of the cache's own; a program gets a copy moved over to
+ * its Env instead of compiling it again.
+ */
+#include <map>
+#include "ralprogram.h"
+
+using namespace std;
+
+class Proc;
+
+class ProcCache
+{
+ public:
+  /* Once more than capacity procedures are kept, everything goes */
+  ProcCache(int capacity);
+  ~ProcCache();
+
+  /* What P->compile(e) would give. Instrumented, profiled or specialized
+   * compiles depend on more than the procedure, and aren't cached. */
+  RALFunction *compile(Proc *P, Env &e);
+
+  long long getHits() { return hits_; };
+  long long getMisses() { return misses_; };
+
+ private:
+  void flush();
+
+  int capacity_;
+  Env e_;
+  map<unsigned long long, RALFunction*> functions_;
+  long long hits_;
+  long long misses_;
+};
+
+#endif
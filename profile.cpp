@@ -0,0 +1,80 @@
+/*
+ * file:  profile.cpp
+ *
+ * Description: Reading and writing call profiles. The file is plain text,
+ * one call site to a line: the site number, how many calls it made and
+ * the name it called.
+ */
+#include <iostream>
+#include <fstream>
+#include "profile.h"
+
+using namespace std;
+
+bool Profile::load(const char *file)
+{
+  ifstream in(file);
+  if(!in)
+  {
+    cout << "Error:  can't read profile " << file << endl;
+    return false;
+  }
+
+  int site;
+  long long count;
+  string callee;
+  while(in >> site >> count >> callee)
+    addCalls(site, intern(callee.c_str()), count);
+
+  if(!in.eof())
+  {
+    cout << "Error:  profile " << file << " is malformed" << endl;
+    return false;
+  }
+
+  return true;
+}
+
+bool Profile::save(const char *file) const
+{
+  ofstream out(file);
+
+  map<int, Count>::const_iterator it;
+  for(it = sites_.begin(); it != sites_.end(); it++)
+    out << it->first << " " << it->second.second << " "
+        << symbolName(it->second.first) << endl;
+
+  if(!out)
+  {
+    cout << "Error:  can't write profile " << file << endl;
+    return false;
+  }
+
+  return true;
+}
+
+/* A site that turns up twice was compiled twice, and the counts add up */
+void Profile::addCalls(int site, Symbol callee, long long count)
+{
+  Count &c = sites_[site];
+  c.first = callee;
+  c.second += count;
+
+  entries_[callee] += count;
+  total_ += count;
+}
+
+long long Profile::getCalls(int site, Symbol callee) const
+{
+  map<int, Count>::const_iterator it = sites_.find(site);
+  if(it == sites_.end() || it->second.first != callee)
+    return 0;
+
+  return it->second.second;
+}
+
+long long Profile::getEntries(Symbol callee) const
+{
+  map<Symbol, long long>::const_iterator it = entries_.find(callee);
+  return it == entries_.end() ? 0 : it->second;
+}
@@ -0,0 +1,44 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+/*
+ * file:  profile.h
+ *
+ * Description: Call counts from an instrumented run of a compiled program,
+ * for a later compile of the same program to go by. Call sites are
+ * numbered in the order the parser made them, so the numbers only mean
+ * anything for the source they were recorded from; each one notes the name
+ * it called as well, and a site that now calls something else is taken to
+ * have no count at all.
+ */
+#include <map>
+#include <string>
+#include "symbols.h"
+
+using namespace std;
+
+class Profile
+{
+ public:
+  Profile() { total_ = 0; };
+
+  /* Both print an error and return false if the file can't be used */
+  bool load(const char *file);
+  bool save(const char *file) const;
+
+  void addCalls(int site, Symbol callee, long long count);
+
+  /* How many times site called callee */
+  long long getCalls(int site, Symbol callee) const;
+  /* How many times callee was called from anywhere */
+  long long getEntries(Symbol callee) const;
+  long long getTotalCalls() const { return total_; };
+
+ private:
+  typedef pair<Symbol, long long> Count;
+
+  map<int, Count> sites_;
+  map<Symbol, long long> entries_;
+  long long total_;
+};
+
+#endif
@@ -11,126 +11,724 @@
 
 #include <cstdlib>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <map>
 #include <list>
 #include "programext.h"
 #include "ralprogram.h"
+#include "proccache.h"
+#include "compilepool.h"
 
 using namespace std;
 
-void fillIn(FunctionGap *g, RALFunction *func, Env &e)
+MemoryLocation *getConstant(ConstantPool &constants, int value)
 {
-  /* Fill in the function gap with the appropriate things in the function.
-   * Pretty simple, ja? */
-
-  int ARsize = func->getActivationRecord().size();
-  g->ADDwithActivationRecordSize->setArgument(
-      (void *) getConstant(e.constants, ARsize)
-      );
-
-  g->LDOwithReturnValueOffset->setOffset(func->ret_value, e.constants);
-
-  g->LDOwithPrevFPOffset->setOffset(func->prev_fp, e.constants);
-
-  g->STOwithReturnAddressOffset->setOffset(func->ret_addr, e.constants);
-
-  g->STOwithPrevFPOffset->setOffset(func->prev_fp, e.constants);
-
-  g->JMPtoFunction->setArgument((void *) func->getFirstLabel());
-
-  list<STO*>::iterator sto_it;
-  list<MemoryLocation*>::iterator memloc_it;
-  for(sto_it = g->params.begin(), memloc_it = func->parameters.begin();
-      sto_it != g->params.end(),  memloc_it != func->parameters.end();
-      sto_it++, memloc_it++)
-  {
-    (*sto_it)->setOffset(*memloc_it, e.constants);
-  }
-}
-
-MemoryLocation *getConstant(vector<MemoryLocation *> &constants, int value)
-{
-  vector<MemoryLocation*>::iterator it;
-  for(it = constants.begin(); it != constants.end(); it++)
-    if((*it)->type == CONST && (*it)->value == value)
-      return *it;
+  map<int, MemoryLocation*>::iterator it = constants.values.find(value);
+  if(it != constants.values.end())
+    return it->second;
 
   MemoryLocation *r = new MemoryLocation();
   r->value = value;
   r->type = CONST;
-  constants.push_back(r);
+  constants.locations.push_back(r);
+  constants.values[value] = r;
 
   return r;
 }
 
-MemoryLocation *getConstant(vector<MemoryLocation *> &constants, Label *value)
+MemoryLocation *getConstant(ConstantPool &constants, Label *value)
 {
-  vector<MemoryLocation*>::iterator it;
-  for(it = constants.begin(); it != constants.end(); it++)
-    if((*it)->type == RETURN_ADDRESS && (*it)->label == value)
-      return *it;
+  map<Label*, MemoryLocation*>::iterator it = constants.labels.find(value);
+  if(it != constants.labels.end())
+    return it->second;
   
   MemoryLocation *r = new MemoryLocation();
   r->label = value;
   r->type = RETURN_ADDRESS;
-  constants.push_back(r);
+  constants.locations.push_back(r);
+  constants.labels[value] = r;
 
   return r;
 }
 
-MemoryLocation *getConstant(vector<MemoryLocation*> &constants, 
-    MemoryLocation *value)
+MemoryLocation *getConstant(ConstantPool &constants, MemoryLocation *value)
 {
-  vector<MemoryLocation*>::iterator it;
-  for(it = constants.begin(); it != constants.end(); it++)
-    if((*it)->type == POINTER && (*it)->location == value)
-      return *it;
+  map<MemoryLocation*, MemoryLocation*>::iterator it =
+    constants.pointers.find(value);
+  if(it != constants.pointers.end())
+    return it->second;
 
   MemoryLocation *r = new MemoryLocation();
   r->location = value;
   r->type = POINTER;
-  constants.push_back(r);
+  constants.locations.push_back(r);
+  constants.pointers[value] = r;
 
   return r;
 }
 
+void Hash::add(long long x)
+{
+  for(int i = 0; i < 8; i++, x >>= 8)
+  {
+    value_ ^= (unsigned char)x;
+    value_ *= 1099511628211ULL;
+  }
+}
+
+/* The length goes in first, so "ab" "c" and "a" "bc" come out different */
+void Hash::add(const string &s)
+{
+  add((long long)s.size());
+  for(int i = 0; i < s.size(); i++)
+  {
+    value_ ^= (unsigned char)s[i];
+    value_ *= 1099511628211ULL;
+  }
+}
+
+/* Each kind of node adds its own tag first, so differently shaped trees
+ * can't add up to the same thing */
+enum HashTag
+{
+  NUMBER_TAG, IDENT_TAG, TIMES_TAG, PLUS_TAG, MINUS_TAG, FUNCALL_TAG,
+  ASSIGN_TAG, DEFINE_TAG, IF_TAG, WHILE_TAG, LIST_TAG, PROC_TAG
+};
+
+MemoryLocation *getTemporary(vector<MemoryLocation*> &temps, int depth)
+{
+  while(temps.size() <= depth)
+  {
+    MemoryLocation *t = new MemoryLocation();
+    t->type = TEMPORARY;
+    temps.push_back(t);
+  }
+
+  return temps[depth];
+}
+
+void deleteExpr(Expr *E)
+{
+  if(E == NULL || E->isLeaf())
+  {
+    delete E;
+    return;
+  }
+
+  vector<Expr*> work(1, E);
+  while(!work.empty())
+  {
+    Expr *next = work.back();
+    work.pop_back();
+
+    next->releaseOperands(work);
+    delete next;
+  }
+}
+
+/* A node of an expression to visit, and how many operands it has, or -1
+ * if they haven't been looked at yet */
+struct Visit
+{
+  const Expr *node;
+  int operands;
+};
+
+/* Every node under E, each one after all of its operands, so that whatever
+ * the operands work out can be kept on a stack of its own; operands[i] is
+ * how many nodes[i] has */
+static void postorder(const Expr *E, vector<const Expr*> &nodes,
+                      vector<int> &operands)
+{
+  vector<Visit> work;
+  vector<Expr*> these;
+  Visit v = { E, -1 };
+  work.push_back(v);
+
+  while(!work.empty())
+  {
+    v = work.back();
+    work.pop_back();
+
+    if(v.operands >= 0)
+    {
+      nodes.push_back(v.node);
+      operands.push_back(v.operands);
+      continue;
+    }
+
+    these.clear();
+    v.node->getOperands(these);
+    v.operands = these.size();
+    work.push_back(v);
+
+    for(int i = these.size() - 1; i >= 0; i--)
+    {
+      Visit u = { these[i], -1 };
+      work.push_back(u);
+    }
+  }
+}
+
+Interval Analysis::getTest(const Stmt *S) const
+{
+  map<const Stmt*, Interval>::const_iterator it = tests.find(S);
+  return it == tests.end() ? Interval::empty() : it->second;
+}
+
+void Analysis::addTest(const Stmt *S, const Interval &test)
+{
+  tests[S] = join(getTest(S), test);
+}
+
+int Analysis::getTrips(const WhileStmt *S, long long &start) const
+{
+  map<const WhileStmt*, pair<int, long long> >::const_iterator it =
+    trips.find(S);
+  if(it == trips.end())
+    return -1;
+
+  start = it->second.second;
+  return it->second.first;
+}
+
+/* Once a loop has been reached with two different trip counts it doesn't
+ * have one */
+void Analysis::setTrips(const WhileStmt *S, int n, long long start)
+{
+  map<const WhileStmt*, pair<int, long long> >::iterator it = trips.find(S);
+  if(it == trips.end())
+    trips[S] = make_pair(n, start);
+  else if(it->second != make_pair(n, start))
+    it->second.first = -1;
+}
+
+Interval Analysis::getArgument(const FunCall *F, int i) const
+{
+  map<const FunCall*, vector<Interval> >::const_iterator it =
+    arguments.find(F);
+  return it == arguments.end() ? Interval::empty() : it->second[i];
+}
+
+void Analysis::addArguments(const FunCall *F, const Interval *ranges, int n)
+{
+  vector<Interval> &args = arguments[F];
+  args.resize(n, Interval::empty());
+
+  for(int i = 0; i < n; i++)
+    args[i] = join(args[i], ranges[i]);
+}
+
+/* The ranges of the operands finished so far go on a stack of their own,
+ * and each node takes its operands' off the top */
+Interval Expr::range(const Ranges &R, Analysis &A) const
+{
+  if(isLeaf())
+    return nodeRange(R, NULL, A);
+
+  /* Most expressions are one operation on leaves, which needs no stack */
+  RALInstruction instruction;
+  Expr *op1, *op2;
+  if(getBinary(instruction, op1, op2) && op1->isLeaf() && op2->isLeaf())
+  {
+    Interval operands[2] = { op1->nodeRange(R, NULL, A),
+                             op2->nodeRange(R, NULL, A) };
+    return nodeRange(R, operands, A);
+  }
+
+  vector<Visit> work;
+  vector<Interval> ranges;
+  vector<Expr*> these;
+  work.reserve(16);
+  ranges.reserve(16);
+
+  Visit v = { this, -1 };
+  work.push_back(v);
+
+  while(!work.empty())
+  {
+    v = work.back();
+    work.pop_back();
+
+    if(v.node->isLeaf())
+    {
+      ranges.push_back(v.node->nodeRange(R, NULL, A));
+      continue;
+    }
+
+    if(v.operands >= 0)
+    {
+      int n = v.operands;
+      Interval r = v.node->nodeRange(R, &ranges[ranges.size() - n], A);
+      ranges.resize(ranges.size() - n);
+      ranges.push_back(r);
+      continue;
+    }
+
+    these.clear();
+    v.node->getOperands(these);
+    v.operands = these.size();
+    work.push_back(v);
+
+    for(int i = these.size() - 1; i >= 0; i--)
+    {
+      Visit u = { these[i], -1 };
+      work.push_back(u);
+    }
+  }
+
+  return ranges.back();
+}
+
+bool Expr::getLinear(Symbol &var, int &coefficient, long long &constant) const
+{
+  const Expr *E = this;
+  Expr *inner;
+  int sign;
+  long long offset;
+
+  coefficient = 1;
+  constant = 0;
+  while(E->getLinearStep(inner, sign, offset))
+  {
+    constant += coefficient * offset;
+    coefficient *= sign;
+    E = inner;
+  }
+
+  return E->getName(var);
+}
+
+/* Operands go first, as they would have recursing, so a procedure is
+ * looked at in the same order */
+bool Expr::isPure(const SymbolMap<Proc*> &FT, set<Proc*> &visiting) const
+{
+  if(isLeaf())
+    return true;
+
+  vector<const Expr*> nodes;
+  vector<int> operands;
+  postorder(this, nodes, operands);
+
+  for(int i = 0; i < nodes.size(); i++)
+    if(!nodes[i]->isNodePure(FT, visiting))
+      return false;
+
+  return true;
+}
+
+/* Operands first and each node's tag after them, which is as good as a
+ * prefix order since every tag says how many operands it takes */
+void Expr::hash(Hash &h) const
+{
+  if(isLeaf())
+  {
+    nodeHash(h);
+    return;
+  }
+
+  vector<const Expr*> nodes;
+  vector<int> operands;
+  postorder(this, nodes, operands);
+
+  for(int i = 0; i < nodes.size(); i++)
+    nodes[i]->nodeHash(h);
+}
+
+/* The copies go on a stack of their own as they're made, and each node
+ * takes its operands' off the top */
+Expr *Expr::specialize(const SymbolMap<int> &constants) const
+{
+  if(isLeaf())
+    return nodeSpecialize(constants, NULL);
+
+  vector<const Expr*> nodes;
+  vector<int> operands;
+  postorder(this, nodes, operands);
+
+  vector<Expr*> copies;
+  for(int i = 0; i < nodes.size(); i++)
+  {
+    int n = operands[i];
+    Expr *copy = nodes[i]->nodeSpecialize(constants,
+        n > 0 ? &copies[copies.size() - n] : NULL);
+    copies.resize(copies.size() - n);
+    copies.push_back(copy);
+  }
+
+  return copies.back();
+}
+
+/* Sethi-Ullman, with the accumulator as the one register and temporaries
+ * to spill to: a leaf operand is folded straight into the other side, and
+ * otherwise whichever side needs more goes first, so the other one only
+ * costs one extra temporary if they need the same */
+static int binaryNeed(Expr *op1, Expr *op2)
+{
+  if(op1 == NULL || op2 == NULL)
+    return 0;
+
+  if(op1->isLeaf())
+    return op2->getNeed();
+  if(op2->isLeaf())
+    return op1->getNeed();
+
+  if(op1->getNeed() == op2->getNeed())
+    return op1->getNeed() + 1;
+
+  return max(op1->getNeed(), op2->getNeed());
+}
+
+/* Where compileBinary() is up to with one operation */
+enum BinaryPhase { START, FIRST_DONE, SECOND_DONE, OTHER_DONE };
+
+struct BinaryTask
+{
+  RALInstruction instruction;
+  bool commutative;
+  Expr *op1;
+  Expr *op2;
+  BinaryPhase phase;
+  /* The order the operands are compiled in */
+  Expr *first;
+  Expr *second;
+  RALStmtList *l;
+  MemoryLocation *kept;
+};
+
+typedef struct BinaryTask BinaryTask;
+
+/* Whether E is an operation, and if so starts t on it */
+static bool startBinary(Expr *E, BinaryTask &t)
+{
+  if(!E->getBinary(t.instruction, t.op1, t.op2))
+    return false;
+
+  t.commutative = t.instruction != SUB;
+  t.phase = START;
+  return true;
+}
+
+/* Finishes t with the other side a single load away in load, from the
+ * side that was loaded */
+static void combine(BinaryTask &t, RALStmtList *load, Expr *loaded, Env &e)
+{
+  RALStmtList *l = t.l;
+
+  if(loaded == t.op1 || t.commutative)
+  {
+    /* op1 <instruction> accumulator */
+    l->append( new RALStmt(STA, e.scratch2) );
+    l->append( load );
+    l->append( new RALStmt(t.instruction, e.scratch2) );
+  }
+  else
+  {
+    /* accumulator <instruction> op2 */
+    l->append( new RALStmt(STA, e.scratch2) );
+    l->append( load );
+    l->append( new RALStmt(STA, e.scratch) );
+    l->append( new RALStmt(LDA, e.scratch2) );
+    l->append( new RALStmt(t.instruction, e.scratch) );
+  }
+}
+
+/* Compiles E, an operation, into the accumulator, in the order
+ * binaryNeed() is counting on. A number on the right (or either side, if
+ * the operation commutes) is the operand as it stands. Anything else is
+ * combined through the scratch registers, with one side in the
+ * accumulator and the other a single load away - either because it's a
+ * leaf, or because it was worked out first and put by in a temporary.
+ *
+ * Operands that are operations themselves go on a stack of tasks rather
+ * than being compiled by recursing, so an operation on leaves, which is
+ * most of them, needs no stack at all. done holds the code for whichever
+ * operation or operand was finished last. */
+static RALStmtList *compileBinary(Expr *E, Env &e,
+    SparseSymbolMap<MemoryLocation*> &variables, vector<MemoryLocation*> &temps)
+{
+  BinaryTask root;
+  startBinary(E, root);
+  vector<BinaryTask> nested;
+  RALStmtList *done = NULL;
+
+  for(;;)
+  {
+    BinaryTask &t = nested.empty() ? root : nested.back();
+    Expr *next = NULL;
+
+    if(t.phase == START &&
+       (t.op2->isNumber() || (t.commutative && t.op1->isNumber())))
+    {
+      t.second = t.op2->isNumber() ? t.op2 : t.op1;
+      next = t.op2->isNumber() ? t.op1 : t.op2;
+      t.phase = OTHER_DONE;
+    }
+    else if(t.phase == START)
+    {
+      /* A leaf goes second, so it can be loaded straight over the other
+       * side; otherwise the heavier side goes first and gets put by. A tie
+       * goes whichever way leaves op1 to be loaded, which is the cheaper
+       * way round for a subtraction. */
+      bool leftFirst;
+      if(t.op1->isLeaf() != t.op2->isLeaf())
+        leftFirst = t.op2->isLeaf();
+      else if(t.op1->getNeed() != t.op2->getNeed())
+        leftFirst = t.op1->getNeed() > t.op2->getNeed();
+      else
+        leftFirst = !t.op1->isLeaf();
+
+      t.first = leftFirst ? t.op1 : t.op2;
+      t.second = leftFirst ? t.op2 : t.op1;
+      next = t.first;
+      t.phase = FIRST_DONE;
+    }
+    else if(t.phase == OTHER_DONE)
+    {
+      done->append( new RALStmt(t.instruction,
+            getConstant(e.constants, t.second->getValue())) );
+    }
+    else if(t.phase == FIRST_DONE && t.second->isLeaf())
+    {
+      t.l = done;
+      combine(t, t.second->compile(e, variables, temps), t.second, e);
+    }
+    else if(t.phase == FIRST_DONE)
+    {
+      t.l = done;
+      t.kept = getTemporary(temps, e.temp_depth);
+      t.l->append( new STO(e.fp, t.kept, e) );
+
+      e.temp_depth++;
+      next = t.second;
+      t.phase = SECOND_DONE;
+    }
+    else
+    {
+      e.temp_depth--;
+      t.l->append( done );
+      combine(t, new LDO(e.fp, t.kept, e), t.first, e);
+      done = t.l;
+    }
+
+    /* Nothing next means t is done */
+    if(next == NULL && nested.empty())
+      return done;
+    if(next == NULL)
+    {
+      nested.pop_back();
+      continue;
+    }
+
+    /* t may move once this is pushed */
+    BinaryTask operand;
+    if(startBinary(next, operand))
+      nested.push_back(operand);
+    else
+      done = next->compile(e, variables, temps);
+  }
+}
+
 Program::Program(StmtList *SL)
 {
 NameTable_.clear();
 FunctionTable_.clear();
 SL_ = SL;
+main_ = new Proc(new list<Symbol>, SL_);
+memo_ = NULL;
+depthLimit_ = DEFAULT_DEPTH_LIMIT;
+}
+
+void Program::enableMemo(int capacity)
+{
+  delete memo_;
+  memo_ = new MemoTable(capacity);
 }
 
 void Program::dump() 
 {
-  map<string,int>::iterator p; map<string,Proc*>::iterator f;
+  vector<Symbol> names = NameTable_.keys();
+  vector<Symbol> functions = FunctionTable_.keys();
+  vector<Symbol>::iterator p;
 
   cout << "Dump of Symbol Table" << endl;
   cout << "Name Table" << endl;
-  for (p = NameTable_.begin();p != NameTable_.end();p++)
-    cout << p->first << " -> " << p->second << endl;
+  for (p = names.begin();p != names.end();p++)
+    cout << symbolName(*p) << " -> " << NameTable_.get(*p) << endl;
   cout << "Function Table" << endl;
-  for (f = FunctionTable_.begin();f != FunctionTable_.end();f++) 
-    cout << f->first << endl;
+  for (p = functions.begin();p != functions.end();p++) 
+    cout << symbolName(*p) << endl;
+
+  if (memo_ != NULL)
+    memo_->dump();
 }
 
 void Program::eval() 
 {
-	SL_->eval(NameTable_, FunctionTable_);
+	FunCall::setMemoTable(memo_);
+	Evaluator ev(NameTable_, FunctionTable_, depthLimit_);
+	ev.run(SL_);
+	FunCall::setMemoTable(NULL);
 }
 
-RALProgram *Program::compile()
+MemoTable::MemoTable(int capacity)
 {
-  Env e;
+  capacity_ = capacity;
+  hits_ = 0;
+  misses_ = 0;
+}
+
+bool MemoTable::isPure(Proc *P, const SymbolMap<Proc*> &FT)
+{
+  map<Proc*,bool>::iterator it = purity_.find(P);
+  if(it != purity_.end())
+    return it->second;
+
+  /* Only the answer for P itself is cached: anything decided further down
+   * may have leaned on P being pure */
+  set<Proc*> visiting;
+  bool pure = P->isPure(FT, visiting);
+  purity_[P] = pure;
+
+  return pure;
+}
+
+bool MemoTable::lookup(Proc *P, const vector<int> &args, int &value)
+{
+  map<Key,int>::iterator it = table_.find(Key(P, args));
+  if(it == table_.end())
+  {
+    misses_++;
+    return false;
+  }
+
+  hits_++;
+  value = it->second;
+  return true;
+}
+
+void MemoTable::insert(Proc *P, const vector<int> &args, int value)
+{
+  if(capacity_ <= 0)
+    return;
+
+  Key key(P, args);
+  if(table_.find(key) != table_.end())
+    return;
+
+  while(table_.size() >= capacity_)
+  {
+    table_.erase(order_.front());
+    order_.pop_front();
+  }
+
+  table_[key] = value;
+  order_.push_back(key);
+}
+
+void MemoTable::invalidate()
+{
+  table_.clear();
+  order_.clear();
+  purity_.clear();
+}
+
+void MemoTable::dump()
+{
+  cout << "Memo Table" << endl;
+  cout << "hits -> " << hits_ << endl;
+  cout << "misses -> " << misses_ << endl;
+  cout << "entries -> " << table_.size() << endl;
+}
+
+/* Past this many statements of copies in all, or copies of any one
+ * procedure, calls with constant arguments go to the procedure itself */
+const int SPECIALIZATION_BUDGET = 1 << 12;
+const int MAX_SPECIALIZATIONS = 8;
+
+Specializer::Specializer(int budget)
+{
+  budget_ = budget;
+}
+
+Specializer::~Specializer()
+{
+  for(int i = 0; i < copies_.size(); i++)
+    delete copies_[i];
+}
+
+Symbol Specializer::get(Symbol name, Proc *P, const vector<bool> &known,
+                        const vector<int> &values, SymbolMap<Proc*> &procs)
+{
+  /* The name says which arguments were what, as name(5,_); the brackets
+   * keep it from ever being an identifier */
+  ostringstream signature;
+  signature << symbolName(name) << "(";
+  for(int i = 0; i < known.size(); i++)
+  {
+    if(i > 0)
+      signature << ",";
+    if(known[i])
+      signature << values[i];
+    else
+      signature << "_";
+  }
+  signature << ")";
+
+  Key key(P, signature.str());
+  map<Key, Symbol>::iterator it = made_.find(key);
+  if(it != made_.end())
+    return it->second;
+
+  /* Whatever doesn't get a copy now never will, since there's only ever
+   * less room left. A copy is never more than the body and an assignment
+   * for each parameter, so one that can't fit isn't made to find out. */
+  Symbol s = name;
+  if(counts_[P] < MAX_SPECIALIZATIONS &&
+     P->getBody()->countStatements() + (int)known.size() <= budget_)
+  {
+    Proc *copy = P->specialize(known, values);
+    int size = copy->getBody()->countStatements();
+
+    /* Folding away a branch can take the only assignment to return with
+     * it, and the linker won't have a procedure like that */
+    if(size <= budget_ && copy->returns())
+    {
+      s = intern(key.second.c_str());
+      procs[s] = copy;
+      copies_.push_back(copy);
+      names_.push_back(s);
+      counts_[P]++;
+      budget_ -= size;
+    }
+    else
+      delete copy;
+  }
+
+  made_[key] = s;
+  return s;
+}
 
-  e.fp = new MemoryLocation;
+void Specializer::unbind(SymbolMap<Proc*> &procs)
+{
+  for(int i = 0; i < names_.size(); i++)
+    procs.erase(names_[i]);
+}
+
+void initEnv(Env &e, CompileOptions options)
+{
+  e.options = options;
+  if(e.options.nativeCalls)
+    e.options.extendedISA = true;
+
+  e.fp = new MemoryLocation();
   e.fp->type = POINTER;
   
-  e.sp = new MemoryLocation;
+  e.sp = new MemoryLocation();
   e.sp->type = POINTER;
 
-  e.scratch = new MemoryLocation;
+  e.scratch = new MemoryLocation();
   e.scratch->type = POINTER;
   
   e.scratch2 = new MemoryLocation();
@@ -138,89 +736,259 @@ RALProgram *Program::compile()
 
   e.prev_fp = new MemoryLocation();
   e.prev_fp->type = POINTER;
+
+  e.temp_depth = 0;
+  e.specializer = NULL;
+  e.analysis = NULL;
+}
+
+/* From the workers or through the cache if there are any */
+static RALFunction *compileProc(Proc *P, Env &e)
+{
+  if(e.options.pool != NULL)
+  {
+    RALFunction *function = e.options.pool->take(P, e);
+    if(function != NULL)
+      return function;
+  }
+
+  if(e.options.cache != NULL)
+    return e.options.cache->compile(P, e);
+
+  return P->compile(e);
+}
+
+RALProgram *Program::compile(CompileOptions options)
+{
+  Env e;
+  initEnv(e, options);
+
+  /* Only the last definition of a name is ever called, wherever it is */
+  vector<Definition> defines;
+  main_->collectDefines(defines);
+  for(int i = 0; i < defines.size(); i++)
+    e.procs[defines[i].first] = defines[i].second;
+
+  /* The copies are made as calls to them are compiled, and bound in procs
+   * alongside everything else until they've been compiled themselves */
+  if(e.options.specialize && !e.options.instrument)
+    e.specializer = new Specializer(SPECIALIZATION_BUDGET);
   
-  list<string> *t = new list<string>;
-  Proc *main = new Proc(t, SL_);
+  /* Main goes under the blank name so it can't clash with any procedure */
+  e.functions[MAIN_SYMBOL] = compileProc(main_, e);
+
+  /* Everything else is compiled the first time something that's already
+   * been compiled calls it, so procedures nothing reaches - and the
+   * constants only they use - never make it into the program. A call to
+   * a name with no definition is left for the linker to report. */
+  vector<RALFunction*> pending(1, e.functions[MAIN_SYMBOL]);
+  while(!pending.empty())
+  {
+    RALFunction *caller = pending.back();
+    pending.pop_back();
+
+    vector<Relocation>::iterator it;
+    for(it = caller->relocations.begin(); it != caller->relocations.end();
+        it++)
+    {
+      if(e.functions.contains(it->symbol) || !e.procs.contains(it->symbol))
+        continue;
+
+      e.functions[it->symbol] = compileProc(e.procs[it->symbol], e);
+      pending.push_back(e.functions[it->symbol]);
+    }
+  }
+
+  if(e.specializer != NULL)
+  {
+    e.specializer->unbind(e.procs);
+    delete e.specializer;
+    e.specializer = NULL;
+  }
+
+  RALProgram *r = new RALProgram(e);
+  return r;
+}
+
+StmtList::~StmtList()
+{
+  vector<Stmt*>::iterator it;
+  for(it = SL_.begin(); it != SL_.end(); it++)
+    delete *it;
+}
+
+void StmtList::append(Stmt * S)
+{
+  SL_.push_back(S);
+}
+
+/* Nothing is left to come back to after the last statement, so a loop
+ * at the end of a list doesn't pile up tasks going round */
+void StmtList::step(Evaluator &ev, int phase) const
+{
+  if(phase >= SL_.size())
+    return;
+
+  if(phase + 1 < SL_.size())
+    ev.push(this, phase + 1);
+  ev.push(SL_[phase]);
+}
+
+bool StmtList::isPure(const SymbolMap<Proc*> &FT, set<Proc*> &visiting) const
+{
+  vector<Stmt*>::const_iterator it;
+  for(it = SL_.begin(); it != SL_.end(); it++)
+    if(!(*it)->isPure(FT, visiting))
+      return false;
+
+  return true;
+}
+
+void StmtList::analyze(Ranges &R, Analysis &A)
+{
+  vector<Stmt*>::iterator it;
+  for(it = SL_.begin(); it != SL_.end(); it++)
+    (*it)->analyze(R, A);
+}
+
+void StmtList::countAssignments(map<Symbol,int> &counts) const
+{
+  vector<Stmt*>::const_iterator it;
+  for(it = SL_.begin(); it != SL_.end(); it++)
+    (*it)->countAssignments(counts);
+}
 
-  /* This is blank so to ensure it's a unique identifier */
-  string mainFunction = "";
+void StmtList::collectDefines(vector<Definition> &defines) const
+{
+  vector<Stmt*>::const_iterator it;
+  for(it = SL_.begin(); it != SL_.end(); it++)
+    (*it)->collectDefines(defines);
+}
 
-  RALFunction *f = main->compile(e);
+int StmtList::countStatements() const
+{
+  int count = 0;
+  vector<Stmt*>::const_iterator it;
+  for(it = SL_.begin(); it != SL_.end(); it++)
+    count += (*it)->countStatements();
 
-  e.functions[mainFunction] = f;
+  return count;
+}
 
-  delete t;
-  delete main;
+void StmtList::hash(Hash &h) const
+{
+  h.add(LIST_TAG);
+  h.add((long long)SL_.size());
 
-  RALProgram *r = new RALProgram(e);
-  return r;
+  vector<Stmt*>::const_iterator it;
+  for(it = SL_.begin(); it != SL_.end(); it++)
+    (*it)->hash(h);
 }
 
-void StmtList::insert(Stmt * S)
+bool StmtList::getStep(Symbol name, long long &step) const
 {
-  SL_.push_front(S);
+  vector<Stmt*>::const_iterator it;
+  for(it = SL_.begin(); it != SL_.end(); it++)
+    if((*it)->getStep(name, step))
+      return true;
+
+  return false;
 }
 
-void StmtList::eval(map<string,int> &NT, map<string,Proc*> &FT) 
+void StmtList::specialize(const SymbolMap<int> &constants, StmtList *SL) const
 {
-  list<Stmt*>::iterator Sp;
-  for (Sp = SL_.begin();Sp != SL_.end();Sp++)
-	(*Sp)->eval(NT,FT);
+  vector<Stmt*>::const_iterator it;
+  for(it = SL_.begin(); it != SL_.end(); it++)
+    (*it)->specialize(constants, SL);
 }
 
 RALStmtList *StmtList::compile(Env &e,
-                               map<string, MemoryLocation*> &variables,
+                               SparseSymbolMap<MemoryLocation*> &variables,
                                vector<MemoryLocation*> &temps)
 {
   RALStmtList *l = new RALStmtList();
-  list<RALStmtList*> statements;
   
-  list<Stmt*>::iterator it;
+  vector<Stmt*>::iterator it;
   for(it = SL_.begin(); it != SL_.end(); it++)
   {
     RALStmtList *s = (*it)->compile(e, variables, temps);
     if(s != NULL)
     {
+      /* Jumps out of the end of the statement before this one land at the
+       * start of this one; only that statement's can still be unpatched */
+      l->replaceNULLsWith(s->getFirstLabel());
       l->append(s);
-      statements.push_back(s);
-    }
-  }
-
-  list<RALStmtList*>::iterator jt;
-  for(jt = statements.begin(); jt != statements.end(); jt++)
-  {
-    if(++jt != statements.end())
-    {
-      Label *label = (*jt)->getFirstLabel();
-      --jt;
-      (*jt)->replaceNULLsWith(label);
-    }
-    else
-    {
-      --jt;
     }
   }
 
   return l;
 }
 
-AssignStmt::AssignStmt(string name, Expr *E)
+AssignStmt::AssignStmt(Symbol name, Expr *E)
 {
   name_ = name;
   E_ = E;
 }
 
-void AssignStmt::eval(map<string,int> &NT, map<string,Proc*> &FT) const
+void AssignStmt::step(Evaluator &ev, int phase) const
+{
+  if(phase == 0)
+  {
+    ev.push(this, 1);
+    ev.push(E_);
+    return;
+  }
+
+  ev.getNames()[name_] = ev.popValue();
+}
+
+/* Assignments only ever write the local name table, so they're as pure
+ * as the expression */
+bool AssignStmt::isPure(const SymbolMap<Proc*> &FT, set<Proc*> &visiting) const
+{
+  return E_->isPure(FT, visiting);
+}
+
+void AssignStmt::analyze(Ranges &R, Analysis &A)
+{
+  if(R.reachable)
+    R.set(name_, E_->range(R, A));
+}
+
+void AssignStmt::hash(Hash &h) const
+{
+  h.add(ASSIGN_TAG);
+  h.add(symbolName(name_));
+  E_->hash(h);
+}
+
+bool AssignStmt::getUpdate(Symbol &name, RALInstruction &op,
+                           Expr *&operand) const
+{
+  name = name_;
+  return E_->getUpdate(name_, op, operand);
+}
+
+void AssignStmt::specialize(const SymbolMap<int> &constants,
+                            StmtList *SL) const
+{
+  SL->append( new AssignStmt(name_, E_->specialize(constants)) );
+}
+
+bool AssignStmt::getStep(Symbol name, long long &step) const
 {
-	NT[name_] = E_->eval(NT,FT);
+  Symbol var;
+  int coefficient;
+
+  return name == name_ && E_->getLinear(var, coefficient, step) &&
+         var == name_ && coefficient == 1;
 }
 
 RALStmtList *AssignStmt::compile(Env &e,
-                                 map<string, MemoryLocation*> &variables,
+                                 SparseSymbolMap<MemoryLocation*> &variables,
                                  vector<MemoryLocation*> &temps)
 {
   RALStmtList *l = E_->compile(e, variables, temps);
-  MemoryLocation *load_from = e.last_written_to;
   MemoryLocation *store_to = variables[name_];
 
   if(store_to == NULL)
@@ -230,9 +998,7 @@ RALStmtList *AssignStmt::compile(Env &e,
     store_to->type = VARIABLE;
   }
 
-  l->append( new LDO(e.fp, load_from, e) );
   l->append( new STO(e.fp, store_to, e) );
-  e.last_written_to = store_to;
 
   return l;
 }
@@ -242,31 +1008,47 @@ DefineStmt::~DefineStmt()
   delete P_; 
 }
 
-DefineStmt::DefineStmt(string name, Proc *P)
+DefineStmt::DefineStmt(Symbol name, Proc *P)
 {
   name_ = name;
   P_ = P;
 }
 
-void DefineStmt::eval(map<string,int> &NT, map<string,Proc*> &FT) const
+void DefineStmt::step(Evaluator &ev, int phase) const
+{
+	ev.define(name_, P_);
+
+	if (FunCall::getMemoTable() != NULL)
+		FunCall::getMemoTable()->invalidate();
+}
+
+/* Defining a procedure changes the function table everyone shares */
+bool DefineStmt::isPure(const SymbolMap<Proc*> &FT, set<Proc*> &visiting) const
+{
+  return false;
+}
+
+/* A define compiles to nothing where it is */
+void DefineStmt::hash(Hash &h) const
+{
+  h.add(DEFINE_TAG);
+}
+
+/* Nested defines go first, so this one wins over any of the same name
+ * inside it */
+void DefineStmt::collectDefines(vector<Definition> &defines) const
 {
-	FT[name_] = P_;
+  P_->collectDefines(defines);
+  defines.push_back(Definition(name_, P_));
 }
 
 RALStmtList *DefineStmt::compile(Env &e,
-                                 map<string, MemoryLocation*> &variables,
+                                 SparseSymbolMap<MemoryLocation*> &variables,
                                  vector<MemoryLocation*> &temps)
 {
-  /* We've got a name and a proc; We want to compile the proc, then we want
-   * to add that function to the e.functions table */
-  e.functions[name_] = P_->compile(e);
-
-  /* And now that we have a new function added to the functions table,
-   * we might have an incomplete record that we can fill in. Let's do that
-   * here */
-  list<FunctionGap*>::iterator it;
-  for(it = e.toCompile[name_].begin(); it != e.toCompile[name_].end(); it++)
-    fillIn(*it, e.functions[name_], e);
+  /* Program::compile already knows which definition each name ends up
+   * with, and compiles it once something calls it; calls to it - before or
+   * after this point - get filled in when the program is linked */
 
   /* This method is going to return null... there's nothing significant in
    * RAL about defining a function that requires statements added into the
@@ -276,6 +1058,62 @@ RALStmtList *DefineStmt::compile(Env &e,
   return NULL;
 }
 
+/* Whether e is just name, give or take adding 0 */
+static bool isJust(Expr *e, Symbol name)
+{
+  Symbol var;
+  int coefficient;
+  long long constant;
+
+  return e->getLinear(var, coefficient, constant) && var == name &&
+         coefficient == 1 && constant == 0;
+}
+
+/* What R becomes once test has come out positive (or not). If the test
+ * is a variable give or take a constant, that variable is narrowed down
+ * to match - so long as working out the test can't have wrapped around,
+ * anyway. */
+static Ranges refine(const Ranges &R, Expr *test, bool positive,
+                     Analysis &A)
+{
+  if(!R.reachable)
+    return R;
+
+  Interval outcome = positive ? Interval(1, INT_MAX) : Interval(INT_MIN, 0);
+
+  Ranges r = R;
+  if(meet(test->range(R, A), outcome).isEmpty())
+  {
+    r.reachable = false;
+    return r;
+  }
+
+  Symbol var;
+  int coefficient;
+  long long constant;
+  if(!test->getLinear(var, coefficient, constant))
+    return r;
+
+  Interval x = R.get(var);
+  if(x.lo * coefficient + constant < INT_MIN ||
+     x.lo * coefficient + constant > INT_MAX ||
+     x.hi * coefficient + constant < INT_MIN ||
+     x.hi * coefficient + constant > INT_MAX)
+    return r;
+
+  Interval solved = coefficient == 1 ?
+    Interval(outcome.lo - constant, outcome.hi - constant) :
+    Interval(constant - outcome.hi, constant - outcome.lo);
+
+  x = meet(x, solved);
+  if(x.isEmpty())
+    r.reachable = false;
+  else
+    r.set(var, x);
+
+  return r;
+}
+
 IfStmt::IfStmt(Expr *E, StmtList *S1, StmtList *S2)
 {
   E_ = E;
@@ -285,84 +1123,586 @@ IfStmt::IfStmt(Expr *E, StmtList *S1, StmtList *S2)
 
 IfStmt::~IfStmt() { delete E_; delete S1_; delete S2_; }
 
-void IfStmt::eval(map<string,int> &NT, map<string,Proc*> &FT) const
+void IfStmt::step(Evaluator &ev, int phase) const
+{
+  if(phase == 0)
+  {
+    ev.push(this, 1);
+    ev.push(E_);
+    return;
+  }
+
+  ev.push(ev.popValue() > 0 ? S1_ : S2_);
+}
+
+bool IfStmt::isPure(const SymbolMap<Proc*> &FT, set<Proc*> &visiting) const
+{
+  return E_->isPure(FT, visiting) && S1_->isPure(FT, visiting) &&
+         S2_->isPure(FT, visiting);
+}
+
+void IfStmt::analyze(Ranges &R, Analysis &A)
+{
+  if(R.reachable)
+    A.addTest(this, E_->range(R, A));
+
+  Ranges R1 = refine(R, E_, true, A), R2 = refine(R, E_, false, A);
+  S1_->analyze(R1, A);
+  S2_->analyze(R2, A);
+
+  R = join(R1, R2);
+}
+
+void IfStmt::countAssignments(map<Symbol,int> &counts) const
+{
+  S1_->countAssignments(counts);
+  S2_->countAssignments(counts);
+}
+
+void IfStmt::hash(Hash &h) const
+{
+  h.add(IF_TAG);
+  E_->hash(h);
+  S1_->hash(h);
+  S2_->hash(h);
+}
+
+void IfStmt::collectDefines(vector<Definition> &defines) const
+{
+  S1_->collectDefines(defines);
+  S2_->collectDefines(defines);
+}
+
+int IfStmt::countStatements() const
 {
-	if (E_->eval(NT,FT) > 0)
-		S1_->eval(NT,FT);
-	else
-		S2_->eval(NT,FT);
+  return 1 + S1_->countStatements() + S2_->countStatements();
+}
+
+/* A test that's come out a number has already picked the branch */
+void IfStmt::specialize(const SymbolMap<int> &constants, StmtList *SL) const
+{
+  Expr *E = E_->specialize(constants);
+  if(E->isNumber())
+  {
+    (E->getValue() > 0 ? S1_ : S2_)->specialize(constants, SL);
+    delete E;
+    return;
+  }
+
+  StmtList *S1 = new StmtList(), *S2 = new StmtList();
+  S1_->specialize(constants, S1);
+  S2_->specialize(constants, S2);
+  SL->append( new IfStmt(E, S1, S2) );
 }
 
 RALStmtList *IfStmt::compile(Env &e,
-                             map<string, MemoryLocation*> &variables,
+                             SparseSymbolMap<MemoryLocation*> &variables,
                              vector<MemoryLocation*> &temps)
 {
   RALStmtList *l = E_->compile(e, variables, temps);
-  MemoryLocation *load_from = e.last_written_to;
 
   RALStmtList *s1 = S1_->compile(e, variables, temps);
   RALStmtList *s2 = S2_->compile(e, variables, temps);
 
-  RALStmtList *ldo = new LDO(e.fp, load_from, e);
-  RALStmt *jmn = new RALStmt(JMN, s2->getFirstLabel());
-  RALStmt *jmz = new RALStmt(JMZ, s2->getFirstLabel());
   RALStmt *jmp = new RALStmt(JMP, NULL);
 
-  l->append(ldo);
-  l->append(jmn);
-  l->append(jmz);
+  /* An else with nothing in it to compile, nothing but defines say, is
+   * whatever comes after the if, which patches the jumps to it */
+  Label *otherwise = s2->empty() ? NULL : s2->getFirstLabel();
+
+  /* The test only needs both jumps if it can come out either side of
+   * zero. The branch that can't be taken is dropped again once it's
+   * linked. */
+  Interval test = e.analysis->getTest(this);
+  if(test.isEmpty() || (test.lo <= 0 && test.hi > 0))
+  {
+    if(test.isEmpty() || test.lo < 0)
+      l->append( new RALStmt(JMN, otherwise) );
+    l->append( new RALStmt(JMZ, otherwise) );
+  }
+  else if(test.hi <= 0)
+  {
+    l->append( new RALStmt(JMP, otherwise) );
+  }
 
   s1->replaceNULLsWith(jmp->getLabel());
   l->append(s1);
 
   l->append(jmp);
 
-  l->append(s2);
+  l->append(s2);
+
+  return l;
+}
+
+/* What a 32-bit word ends up holding, the same as the machine wraps it */
+static int wrap(unsigned long long x)
+{
+  return (int)(unsigned)x;
+}
+
+/* x multiplied by itself n times, wrapping */
+static unsigned power(unsigned x, unsigned long long n)
+{
+  unsigned result = 1;
+  for(; n > 0; n /= 2, x *= x)
+    if(n % 2 == 1)
+      result *= x;
+
+  return result;
+}
+
+/* The most terms of a product over a counter worked out at compile time;
+ * past this the loop stays, unless the product has already hit 0 */
+const unsigned long long MAX_PRODUCT_TERMS = 1 << 16;
+
+/* coefficient * var + constant, leaving out what doesn't need doing */
+static Expr *linear(Symbol var, long long coefficient, long long constant)
+{
+  int a = wrap(coefficient), b = wrap(constant);
+
+  Expr *e;
+  if(a == 0)
+    return new Number(b);
+  else if(a == 1)
+    e = new Ident(var);
+  else
+    e = new Times(new Number(a), new Ident(var));
+
+  return b == 0 ? e : new Plus(e, new Number(b));
+}
+
+static void declare(SparseSymbolMap<MemoryLocation*> &variables, Symbol name)
+{
+  if(variables[name] == NULL)
+  {
+    variables[name] = new MemoryLocation();
+    variables[name]->type = VARIABLE;
+  }
+}
+
+WhileStmt::WhileStmt(Expr *E, StmtList *S)
+{
+  E_ = E;
+  S_ = S;
+  assignments_ = NULL;
+  form_ = findForm(E, S);
+}
+
+WhileStmt::~WhileStmt()
+{
+  delete E_;
+  delete S_;
+  delete assignments_;
+  delete form_;
+}
+
+RALStmtList *WhileStmt::compile(Env &e,
+                                SparseSymbolMap<MemoryLocation*> &variables,
+                                vector<MemoryLocation*> &temps)
+{
+  const Analysis &A = *e.analysis;
+
+  bool guarded;
+  StmtList *closed = closedForm(A, guarded);
+  if(closed != NULL)
+  {
+    /* Everything the loop mentions gets somewhere to live, the same as
+     * if it had been compiled as it stands */
+    declare(variables, form_->counter);
+    for(int i = 0; i < form_->accumulators.size(); i++)
+    {
+      declare(variables, form_->accumulators[i].name);
+      if(form_->accumulators[i].coefficient != 0)
+        declare(variables, form_->accumulators[i].var);
+    }
+
+    RALStmtList *s = closed->compile(e, variables, temps);
+    delete closed;
+
+    /* With the trip count only known at run time, it's still only done if
+     * the loop would have gone round at all */
+    if(guarded)
+    {
+      RALStmtList *l = E_->compile(e, variables, temps);
+      appendExit(l, A.getTest(this));
+      l->append(s);
+      return l;
+    }
+
+    /* A loop that never goes round leaves nothing to do at all */
+    if(s->empty())
+    {
+      delete s;
+      return NULL;
+    }
+    return s;
+  }
+
+  RALStmtList *l = E_->compile(e, variables, temps);
+
+  RALStmtList *s = S_->compile(e, variables, temps);
+  
+  RALStmt *jmp = new RALStmt(JMP, l->getFirstLabel());
+
+  appendExit(l, A.getTest(this));
+
+  s->replaceNULLsWith(jmp->getLabel());
+  l->append(s);
+  l->append(jmp);
+
+  return l;
+}
+
+/* Same as for an if: a loop whose test is never negative only needs the
+ * JMZ to get out, which saves a branch every time round. The jumps are
+ * left for whatever comes next to patch. */
+void WhileStmt::appendExit(RALStmtList *l, const Interval &test) const
+{
+  if(test.isEmpty() || (test.lo <= 0 && test.hi > 0))
+  {
+    if(test.isEmpty() || test.lo < 0)
+      l->append( new RALStmt(JMN, NULL) );
+    l->append( new RALStmt(JMZ, NULL) );
+  }
+  else if(test.hi <= 0)
+  {
+    l->append( new RALStmt(JMP, NULL) );
+  }
+}
+
+/* Phase 0 works out the test and phase 1 acts on it, going back to 0
+ * after the body */
+void WhileStmt::step(Evaluator &ev, int phase) const
+{
+  if(phase == 0)
+  {
+    ev.push(this, 1);
+    ev.push(E_);
+    return;
+  }
+
+  if(ev.popValue() > 0)
+  {
+    ev.push(this, 0);
+    ev.push(S_);
+  }
+}
+
+bool WhileStmt::isPure(const SymbolMap<Proc*> &FT, set<Proc*> &visiting) const
+{
+  return E_->isPure(FT, visiting) && S_->isPure(FT, visiting);
+}
+
+/* How deep in loops being gone round the analysis goes round another */
+const int MAX_ITERATED_LOOPS = 3;
+
+/* Go round until what's known at the top of the loop stops changing,
+ * widening after the first few times so that it does */
+void WhileStmt::analyze(Ranges &R, Analysis &A)
+{
+  countTrips(R, A);
+
+  /* Too deep to go round: forget everything the body assigns and look at
+   * it once, which is already as far as the loop can get */
+  if(A.iteratedLoops >= MAX_ITERATED_LOOPS)
+  {
+    Ranges head = R;
+    SparseSymbolMap<Interval>::const_iterator it;
+    for(it = R.variables.begin(); it != R.variables.end(); it++)
+      if(getAssignments().count(it->first) > 0)
+        head.set(it->first, Interval());
+
+    if(head.reachable)
+      A.addTest(this, E_->range(head, A));
+
+    Ranges body = refine(head, E_, true, A);
+    S_->analyze(body, A);
+
+    R = refine(join(head, body), E_, false, A);
+    return;
+  }
+
+  A.iteratedLoops++;
+
+  Ranges head = R;
+  for(int i = 0; ; i++)
+  {
+    if(head.reachable)
+      A.addTest(this, E_->range(head, A));
+
+    Ranges body = refine(head, E_, true, A);
+    S_->analyze(body, A);
+
+    Ranges next = join(R, body);
+    if(i >= 2)
+      next = widen(head, next);
+    if(next == head)
+      break;
+
+    head = next;
+  }
+
+  A.iteratedLoops--;
+
+  R = refine(head, E_, false, A);
+}
+
+/* A loop goes round a fixed number of times if its test is a variable give
+ * or take a constant, the variable starts out known, and the body steps it
+ * towards zero by the same amount each time, at the top level so every
+ * time round, and nowhere else */
+void WhileStmt::countTrips(const Ranges &R, Analysis &A)
+{
+  if(!R.reachable)
+    return;
+
+  int trips = -1;
+
+  Symbol var;
+  int coefficient;
+  long long constant, step;
+  long long start = 0;
+
+  if(E_->getLinear(var, coefficient, constant) &&
+     getAssignments().find(var) != getAssignments().end() &&
+     getAssignments().find(var)->second == 1 &&
+     S_->getStep(var, step) && R.get(var).isConstant())
+  {
+    start = R.get(var).lo;
+    long long test = coefficient * start + constant,
+              change = coefficient * step;
+
+    if(test >= INT_MIN && test <= INT_MAX && change < 0)
+    {
+      long long n = test > 0 ? (test - change - 1) / -change : 0;
+      if(n <= INT_MAX && start + n * step >= INT_MIN &&
+         start + n * step <= INT_MAX)
+        trips = n;
+    }
+  }
+
+  A.setTrips(this, trips, start);
+}
+
+void WhileStmt::countAssignments(map<Symbol,int> &counts) const
+{
+  S_->countAssignments(counts);
+}
+
+void WhileStmt::hash(Hash &h) const
+{
+  h.add(WHILE_TAG);
+  E_->hash(h);
+  S_->hash(h);
+}
+
+void WhileStmt::collectDefines(vector<Definition> &defines) const
+{
+  S_->collectDefines(defines);
+}
+
+int WhileStmt::countStatements() const
+{
+  return 1 + S_->countStatements();
+}
+
+/* Likewise a loop that never goes round is gone */
+void WhileStmt::specialize(const SymbolMap<int> &constants,
+                           StmtList *SL) const
+{
+  Expr *E = E_->specialize(constants);
+  if(E->isNumber() && E->getValue() <= 0)
+  {
+    delete E;
+    return;
+  }
+
+  StmtList *S = new StmtList();
+  S_->specialize(constants, S);
+  SL->append( new WhileStmt(E, S) );
+}
+
+const map<Symbol,int> &WhileStmt::getAssignments()
+{
+  if(assignments_ == NULL)
+  {
+    assignments_ = new map<Symbol,int>();
+    S_->countAssignments(*assignments_);
+  }
+
+  return *assignments_;
+}
+
+/* The body has to be nothing but updates, each to a different name, with
+ * the counter stepped by a constant towards the test coming out 0 and
+ * everything else taking in the counter, constants or names that aren't
+ * assigned in the loop */
+LoopForm *WhileStmt::findForm(Expr *E, StmtList *S)
+{
+  LoopForm f;
+  if(!E->getLinear(f.counter, f.coefficient, f.constant))
+    return NULL;
+
+  const vector<Stmt*> &body = S->getStatements();
+  vector<Symbol> names(body.size());
+  vector<RALInstruction> ops(body.size());
+  vector<Expr*> operands(body.size());
+  map<Symbol,int> assigned;
+
+  for(int i = 0; i < body.size(); i++)
+    if(!body[i]->getUpdate(names[i], ops[i], operands[i]) ||
+       assigned[names[i]]++ > 0)
+      return NULL;
+
+  bool stepped = false;
+
+  for(int i = 0; i < body.size(); i++)
+  {
+    if(names[i] == f.counter)
+    {
+      if(ops[i] == MUL || !operands[i]->isNumber())
+        return NULL;
+
+      f.step = operands[i]->getValue();
+      if(ops[i] == SUB)
+        f.step = -f.step;
+      stepped = true;
+      continue;
+    }
+
+    Accumulator a;
+    a.name = names[i];
+    a.op = ops[i];
+    a.afterStep = stepped;
+
+    if(operands[i]->isNumber())
+    {
+      a.var = f.counter;
+      a.coefficient = 0;
+      a.constant = operands[i]->getValue();
+    }
+    else if(!operands[i]->getLinear(a.var, a.coefficient, a.constant) ||
+            (a.var != f.counter && assigned.count(a.var) > 0))
+      return NULL;
+
+    f.accumulators.push_back(a);
+  }
 
-  delete s1;
-  delete s2;
+  if(!stepped || f.coefficient * f.step >= 0)
+    return NULL;
 
-  return l;
+  return new LoopForm(f);
 }
 
-WhileStmt::WhileStmt(Expr *E, StmtList *S)
+/* When the analysis knows how many times round and where the counter
+ * starts, everything the loop adds or multiplies in comes out a constant.
+ * Otherwise the trip count is the test itself if it goes down one at a
+ * time, but with no way to halve anything at run time only sums of
+ * constants and unchanging names can be done. */
+StmtList *WhileStmt::closedForm(const Analysis &A, bool &guarded) const
 {
-  E_ = E;
-  S_ = S;
-}
+  guarded = false;
+  if(form_ == NULL)
+    return NULL;
 
-WhileStmt::~WhileStmt() { delete E_; delete S_; }
+  const LoopForm &f = *form_;
+  StmtList *L = new StmtList();
 
-RALStmtList *WhileStmt::compile(Env &e,
-                                map<string, MemoryLocation*> &variables,
-                                vector<MemoryLocation*> &temps)
-{
-  RALStmtList *l = E_->compile(e, variables, temps);
-  MemoryLocation *load_from = e.last_written_to;
+  long long start = 0;
+  int tripCount = A.getTrips(this, start);
+  if(tripCount >= 0)
+  {
+    unsigned long long n = tripCount;
+    if(n == 0)
+      return L;
 
-  RALStmtList *s = S_->compile(e, variables, temps);
-  
-  RALStmtList *ldo = new LDO(e.fp, load_from, e);
-  RALStmt *jmn = new RALStmt(JMN, NULL);
-  RALStmt *jmz = new RALStmt(JMZ, NULL);
-  RALStmt *jmp = new RALStmt(JMP, l->getFirstLabel());
+    for(int i = 0; i < f.accumulators.size(); i++)
+    {
+      const Accumulator &a = f.accumulators[i];
+      unsigned long long first = start + (a.afterStep ? f.step : 0);
+      Expr *term;
+
+      if(a.op != MUL)
+      {
+        if(a.coefficient == 0 || a.var != f.counter)
+          term = linear(a.var, n * a.coefficient, n * a.constant);
+        else
+          term = new Number(wrap(a.coefficient *
+                                 (n * first + f.step * (n * (n - 1) / 2)) +
+                                 n * a.constant));
+
+        L->append( new AssignStmt(a.name, a.op == ADD ?
+          (Expr*)new Plus(new Ident(a.name), term) :
+          (Expr*)new Minus(new Ident(a.name), term)) );
+        continue;
+      }
+
+      unsigned product = 1;
+      if(a.coefficient == 0)
+        product = power(a.constant, n);
+      else if(a.var == f.counter)
+      {
+        for(unsigned long long j = 0; j < n && product != 0; j++)
+        {
+          if(j == MAX_PRODUCT_TERMS)
+          {
+            delete L;
+            return NULL;
+          }
+          product *= a.coefficient * (first + j * f.step) + a.constant;
+        }
+      }
+      else
+      {
+        delete L;
+        return NULL;
+      }
+
+      L->append( new AssignStmt(a.name,
+        new Times(new Ident(a.name), new Number(wrap(product)))) );
+    }
 
-  l->append(ldo);
-  l->append(jmn);
-  l->append(jmz);
-  s->replaceNULLsWith(jmp->getLabel());
-  l->append(s);
-  l->append(jmp);
+    L->append( new AssignStmt(f.counter,
+      new Number(wrap(start + n * f.step))) );
+    return L;
+  }
 
-  delete s;
+  if(f.coefficient * f.step != -1)
+  {
+    delete L;
+    return NULL;
+  }
 
-  return l;
-}
+  for(int i = 0; i < f.accumulators.size(); i++)
+  {
+    const Accumulator &a = f.accumulators[i];
+    if(a.op == MUL || (a.coefficient != 0 && a.var == f.counter))
+    {
+      delete L;
+      return NULL;
+    }
+  }
 
-void WhileStmt::eval(map<string,int> &NT, map<string,Proc*> &FT) const
-{
-	while (E_->eval(NT,FT) > 0) 
-		S_->eval(NT,FT);
+  for(int i = 0; i < f.accumulators.size(); i++)
+  {
+    const Accumulator &a = f.accumulators[i];
+    Expr *term = new Times(linear(f.counter, f.coefficient, f.constant),
+                           linear(a.var, a.coefficient, a.constant));
+
+    L->append( new AssignStmt(a.name, a.op == ADD ?
+      (Expr*)new Plus(new Ident(a.name), term) :
+      (Expr*)new Minus(new Ident(a.name), term)) );
+  }
+
+  /* Last, since everything above works out the trip count from it */
+  Expr *trips = linear(f.counter, f.coefficient, f.constant);
+  L->append( new AssignStmt(f.counter, f.step == 1 ?
+    (Expr*)new Plus(new Ident(f.counter), trips) :
+    (Expr*)new Minus(new Ident(f.counter), trips)) );
+
+  guarded = true;
+  return L;
 }
 
 Number::Number(int value)
@@ -371,49 +1711,62 @@ Number::Number(int value)
 }
 
 RALStmtList *Number::compile(Env &e,
-                             map<string, MemoryLocation*> &variables,
+                             SparseSymbolMap<MemoryLocation*> &variables,
                              vector<MemoryLocation*> &temps)
 {
-  /* Set up two memory locations: the constant representing the number
-   * and the temporary location to store it */
-  MemoryLocation *load_from = getConstant(e.constants, value_),
-                 *store_to = new MemoryLocation();
+  RALStmtList *l = new RALStmtList();
+  l->append( new RALStmt(LDA, getConstant(e.constants, value_)) );
 
-  store_to->type = TEMPORARY;
+  return l;
+}
 
-  RALStmt *sta = new RALStmt(STA, store_to);
+void Number::nodeHash(Hash &h) const
+{
+  h.add(NUMBER_TAG);
+  h.add(value_);
+}
 
-  RALStmtList *l = new RALStmtList();
-  l->append( new RALStmt(LDA, load_from) );
-  l->append( new STO(e.fp, store_to, e) );
+Expr *Number::nodeSpecialize(const SymbolMap<int> &constants,
+                             Expr **operands) const
+{
+  return new Number(value_);
+}
 
-  temps.push_back(store_to);
-  e.last_written_to = store_to;
+void Number::step(Evaluator &ev, int phase) const
+{
+	ev.pushValue(value_);
+}
 
-  return l;
+Ident::Ident(Symbol name)
+{
+	name_ = name;
 }
 
-int Number::eval(map<string,int> NT, map<string,Proc*> FT) const
+void Ident::nodeHash(Hash &h) const
 {
-	return value_;
+  h.add(IDENT_TAG);
+  h.add(symbolName(name_));
 }
 
-Ident::Ident(string name)
+Expr *Ident::nodeSpecialize(const SymbolMap<int> &constants,
+                            Expr **operands) const
 {
-	name_ = name;
+  if(constants.contains(name_))
+    return new Number(constants.get(name_));
+
+  return new Ident(name_);
 }
 
-int Ident::eval(map<string,int> NT, map<string,Proc*> FT) const
+void Ident::step(Evaluator &ev, int phase) const
 {
-	return NT[name_];
+	ev.pushValue(ev.getNames().get(name_));
 }
 
 RALStmtList *Ident::compile(Env &e,
-                            map<string, MemoryLocation*> &variables,
+                            SparseSymbolMap<MemoryLocation*> &variables,
                             vector<MemoryLocation*> &temps)
 {
-  MemoryLocation *load_from = variables[name_],
-                 *store_to = new MemoryLocation();
+  MemoryLocation *load_from = variables[name_];
 
   if(load_from == NULL)
   {
@@ -422,14 +1775,8 @@ RALStmtList *Ident::compile(Env &e,
     load_from->type = VARIABLE;
   }
 
-  store_to->type = TEMPORARY;
-
   RALStmtList *l = new RALStmtList();
   l->append( new LDO(e.fp, load_from, e) );
-  l->append( new STO(e.fp, store_to, e) );
-
-  temps.push_back(store_to);
-  e.last_written_to = store_to;
 
   return l;
 }
@@ -438,32 +1785,39 @@ Plus::Plus(Expr* op1, Expr* op2)
 {
 	op1_ = op1;
 	op2_ = op2;
+	need_ = binaryNeed(op1, op2);
 }
 
-int Plus::eval(map<string,int> NT, map<string,Proc*> FT) const
+void Plus::step(Evaluator &ev, int phase) const
 {
-	return op1_->eval(NT,FT) + op2_->eval(NT,FT);
+  if(phase == 0)
+  {
+    ev.push(this, 1);
+    ev.push(op2_);
+    ev.push(op1_);
+    return;
+  }
+
+  int op2 = ev.popValue();
+  ev.pushValue(ev.popValue() + op2);
 }
 
 Expr *Plus::simplify()
 {
   Expr *r;
 
-  map<string, int> t;
-  map<string,Proc*> f;
-
   if(op1_->isNumber() && op2_->isNumber())
   {
-    r = new Number(op1_->eval(t, f) + op2_->eval(t, f));
+    r = new Number(op1_->getValue() + op2_->getValue());
     delete op1_;
     delete op2_;
   }
-  else if(op1_->isNumber() && op1_->eval(t, f) == 0)
+  else if(op1_->isNumber() && op1_->getValue() == 0)
   {
     delete op1_;
     r = op2_;
   }
-  else if(op2_->isNumber() && op2_->eval(t, f) == 0)
+  else if(op2_->isNumber() && op2_->getValue() == 0)
   {
     delete op2_;
     r = op1_;
@@ -473,65 +1827,107 @@ Expr *Plus::simplify()
     return this;
   }
 
-  /* C++ gods please do not smite me for this - I don't want to call the
-   * destructor, I just want to free the memory for the current expression. */
-  free(this);
+  /* Whatever of the operands survived is in r now, so don't take them
+   * down with this */
+  op1_ = op2_ = NULL;
+  delete this;
   return r;
 }
 
-RALStmtList *Plus::compile(Env &e,
-                           map<string, MemoryLocation*> &variables, 
-                           vector<MemoryLocation*> &temps)
+void Plus::getOperands(vector<Expr*> &operands) const
+{
+  operands.push_back(op1_);
+  operands.push_back(op2_);
+}
+
+void Plus::releaseOperands(vector<Expr*> &operands)
 {
-  RALStmtList *l1 = op1_->compile(e, variables, temps);
-  MemoryLocation *load_from_1 = e.last_written_to;
+  getOperands(operands);
+  op1_ = op2_ = NULL;
+}
+
+bool Plus::getBinary(RALInstruction &instruction, Expr *&op1, Expr *&op2) const
+{
+  instruction = ADD;
+  op1 = op1_;
+  op2 = op2_;
+  return true;
+}
 
-  RALStmtList *l2 = op2_->compile(e, variables, temps);
-  MemoryLocation *load_from_2 = e.last_written_to;
+void Plus::nodeHash(Hash &h) const
+{
+  h.add(PLUS_TAG);
+}
+
+Expr *Plus::nodeSpecialize(const SymbolMap<int> &constants,
+                           Expr **operands) const
+{
+  return (new Plus(operands[0], operands[1]))->simplify();
+}
 
-  MemoryLocation *store_to = new MemoryLocation();
-  store_to->type = TEMPORARY;
+Interval Plus::nodeRange(const Ranges &R, const Interval *operands,
+                       Analysis &A) const
+{
+  return operands[0] + operands[1];
+}
 
-  l1->append(l2);
-  delete l2;
+bool Plus::getLinearStep(Expr *&inner, int &sign, long long &offset) const
+{
+  if(!op1_->isNumber() && !op2_->isNumber())
+    return false;
 
-  l1->append( new LDO(e.fp, load_from_1, e) );
-  l1->append( new RALStmt(STA, e.scratch2) );
-  l1->append( new LDO(e.fp, load_from_2, e) );
-  l1->append( new RALStmt(ADD, e.scratch2) );
-  l1->append( new STO(e.fp, store_to, e) );
+  inner = op2_->isNumber() ? op1_ : op2_;
+  sign = 1;
+  offset = op2_->isNumber() ? op2_->getValue() : op1_->getValue();
+  return true;
+}
 
-  temps.push_back(store_to);
-  e.last_written_to = store_to;
+bool Plus::getUpdate(Symbol name, RALInstruction &op, Expr *&operand) const
+{
+  op = ADD;
+  operand = isJust(op1_, name) ? op2_ : isJust(op2_, name) ? op1_ : NULL;
+  return operand != NULL;
+}
 
-  return l1;
+RALStmtList *Plus::compile(Env &e,
+                           SparseSymbolMap<MemoryLocation*> &variables, 
+                           vector<MemoryLocation*> &temps)
+{
+  return compileBinary(this, e, variables, temps);
 }
 
 Minus::Minus(Expr* op1, Expr* op2)
 {
 	op1_ = op1;
 	op2_ = op2;
+	need_ = binaryNeed(op1, op2);
 }
 
-int Minus::eval(map<string,int> NT, map<string,Proc*> FT) const
+void Minus::step(Evaluator &ev, int phase) const
 {
-	return op1_->eval(NT,FT) - op2_->eval(NT,FT);
+  if(phase == 0)
+  {
+    ev.push(this, 1);
+    ev.push(op2_);
+    ev.push(op1_);
+    return;
+  }
+
+  int op2 = ev.popValue();
+  ev.pushValue(ev.popValue() - op2);
 }
 
 Expr *Minus::simplify()
 {
   Expr *r;
 
-  map<string, int> t;
-  map<string,Proc*> f;
-
   if(op1_->isNumber() && op2_->isNumber())
   {
-    r = new Number(op1_->eval(t, f) - op2_->eval(t, f));
+    r = new Number(op1_->getValue() - op2_->getValue());
     delete op1_;
     delete op2_;
   }
-  else if(op2_->isNumber() && op2_->eval(t, f) == 0)
+  else if(op2_->isNumber() && op2_->getValue() == 0)
   {
     delete op2_;
     r = op1_;
@@ -541,74 +1937,125 @@ Expr *Minus::simplify()
     return this;
   }
 
-  free(this);
+  op1_ = op2_ = NULL;
+  delete this;
   return r;
 }
 
-RALStmtList *Minus::compile(Env &e,
-                            map<string, MemoryLocation*> &variables, 
-                            vector<MemoryLocation*> &temps)
+void Minus::getOperands(vector<Expr*> &operands) const
+{
+  operands.push_back(op1_);
+  operands.push_back(op2_);
+}
+
+void Minus::releaseOperands(vector<Expr*> &operands)
+{
+  getOperands(operands);
+  op1_ = op2_ = NULL;
+}
+
+bool Minus::getBinary(RALInstruction &instruction, Expr *&op1, Expr *&op2) const
+{
+  instruction = SUB;
+  op1 = op1_;
+  op2 = op2_;
+  return true;
+}
+
+void Minus::nodeHash(Hash &h) const
 {
-  RALStmtList *l1 = op1_->compile(e, variables, temps);
-  MemoryLocation *load_from_1 = e.last_written_to;
+  h.add(MINUS_TAG);
+}
 
-  RALStmtList *l2 = op2_->compile(e, variables, temps);
-  MemoryLocation *load_from_2 = e.last_written_to;
+Expr *Minus::nodeSpecialize(const SymbolMap<int> &constants,
+                            Expr **operands) const
+{
+  return (new Minus(operands[0], operands[1]))->simplify();
+}
 
-  MemoryLocation *store_to = new MemoryLocation();
-  store_to->type = TEMPORARY;
+Interval Minus::nodeRange(const Ranges &R, const Interval *operands,
+                        Analysis &A) const
+{
+  return operands[0] - operands[1];
+}
 
-  l1->append(l2);
-  delete l2;
+bool Minus::getLinearStep(Expr *&inner, int &sign, long long &offset) const
+{
+  if(op2_->isNumber())
+  {
+    inner = op1_;
+    sign = 1;
+    offset = -op2_->getValue();
+    return true;
+  }
+  if(op1_->isNumber())
+  {
+    inner = op2_;
+    sign = -1;
+    offset = op1_->getValue();
+    return true;
+  }
 
-  l1->append( new LDO(e.fp, load_from_2, e) );
-  l1->append( new RALStmt(STA, e.scratch2) );
-  l1->append( new LDO(e.fp, load_from_1, e) );
-  l1->append( new RALStmt(SUB, e.scratch2) );
-  l1->append( new STO(e.fp, store_to, e) );
+  return false;
+}
 
-  temps.push_back(store_to);
-  e.last_written_to = store_to;
+bool Minus::getUpdate(Symbol name, RALInstruction &op, Expr *&operand) const
+{
+  op = SUB;
+  operand = isJust(op1_, name) ? op2_ : NULL;
+  return operand != NULL;
+}
 
-  return l1;
+RALStmtList *Minus::compile(Env &e,
+                            SparseSymbolMap<MemoryLocation*> &variables, 
+                            vector<MemoryLocation*> &temps)
+{
+  return compileBinary(this, e, variables, temps);
 }
 
 Times::Times(Expr* op1, Expr* op2)
 {
 	op1_ = op1;
 	op2_ = op2;
+	need_ = binaryNeed(op1, op2);
 }
 
-int Times::eval(map<string,int> NT, map<string,Proc*> FT) const
+void Times::step(Evaluator &ev, int phase) const
 {
-	return op1_->eval(NT,FT) * op2_->eval(NT,FT);
+  if(phase == 0)
+  {
+    ev.push(this, 1);
+    ev.push(op2_);
+    ev.push(op1_);
+    return;
+  }
+
+  int op2 = ev.popValue();
+  ev.pushValue(ev.popValue() * op2);
 }
 
 Expr *Times::simplify()
 {
   Expr *r;
 
-  map<string, int> t;
-  map<string,Proc*> f;
-
   if(op1_->isNumber() && op2_->isNumber())
   {
-    r = new Number(op1_->eval(t, f) * op2_->eval(t, f));
+    r = new Number(op1_->getValue() * op2_->getValue());
     delete op1_;
     delete op2_;
   }
-  else if(op1_->isNumber() && op1_->eval(t, f) == 1)
+  else if(op1_->isNumber() && op1_->getValue() == 1)
   {
     r = op2_;
     delete op1_;
   }
-  else if(op2_->isNumber() && op2_->eval(t, f) == 1)
+  else if(op2_->isNumber() && op2_->getValue() == 1)
   {
     r = op1_;
     delete op2_;
   }
-  else if(op1_->isNumber() && op1_->eval(t, f) == 0 ||
-          op2_->isNumber() && op2_->eval(t, f) == 0)
+  else if((op1_->isNumber() && op1_->getValue() == 0) ||
+          (op2_->isNumber() && op2_->getValue() == 0))
   {
     delete op1_;
     delete op2_;
@@ -619,67 +2066,168 @@ Expr *Times::simplify()
     return this;
   }
 
-  free(this);
+  op1_ = op2_ = NULL;
+  delete this;
   return r;
 }
 
-RALStmtList *Times::compile(Env &e,
-                            map<string, MemoryLocation*> &variables, 
-                            vector<MemoryLocation*> &temps)
+void Times::getOperands(vector<Expr*> &operands) const
+{
+  operands.push_back(op1_);
+  operands.push_back(op2_);
+}
+
+void Times::releaseOperands(vector<Expr*> &operands)
 {
-  RALStmtList *l1 = op1_->compile(e, variables, temps);
-  MemoryLocation *load_from_1 = e.last_written_to;
+  getOperands(operands);
+  op1_ = op2_ = NULL;
+}
 
-  RALStmtList *l2 = op2_->compile(e, variables, temps);
-  MemoryLocation *load_from_2 = e.last_written_to;
+bool Times::getBinary(RALInstruction &instruction, Expr *&op1, Expr *&op2) const
+{
+  instruction = MUL;
+  op1 = op1_;
+  op2 = op2_;
+  return true;
+}
 
-  MemoryLocation *store_to = new MemoryLocation();
-  store_to->type = TEMPORARY;
+void Times::nodeHash(Hash &h) const
+{
+  h.add(TIMES_TAG);
+}
 
-  l1->append(l2);
-  delete l2;
+Expr *Times::nodeSpecialize(const SymbolMap<int> &constants,
+                            Expr **operands) const
+{
+  return (new Times(operands[0], operands[1]))->simplify();
+}
 
-  l1->append( new LDO(e.fp, load_from_1, e) );
-  l1->append( new RALStmt(STA, e.scratch2) );
-  l1->append( new LDO(e.fp, load_from_2, e) );
-  l1->append( new RALStmt(MUL, e.scratch2) );
-  l1->append( new STO(e.fp, store_to, e) );
+Interval Times::nodeRange(const Ranges &R, const Interval *operands,
+                        Analysis &A) const
+{
+  return operands[0] * operands[1];
+}
 
-  temps.push_back(store_to);
-  e.last_written_to = store_to;
+bool Times::getUpdate(Symbol name, RALInstruction &op, Expr *&operand) const
+{
+  op = MUL;
+  operand = isJust(op1_, name) ? op2_ : isJust(op2_, name) ? op1_ : NULL;
+  return operand != NULL;
+}
 
-  return l1;
+RALStmtList *Times::compile(Env &e,
+                            SparseSymbolMap<MemoryLocation*> &variables, 
+                            vector<MemoryLocation*> &temps)
+{
+  return compileBinary(this, e, variables, temps);
 }
 
-FunCall::FunCall(string name, list<Expr*> *AL)
+FunCall::FunCall(Symbol name, list<Expr*> *AL, int site)
 {
 	name_= name;
 	AL_ = AL;
+	site_ = site >= 0 ? site : sites_++;
+
+	/* Argument i is worked out with the i before it put by */
+	need_ = AL_->size();
+	int i = 0;
+	list<Expr*>::iterator it;
+	for(it = AL_->begin(); it != AL_->end(); it++, i++)
+		need_ = max(need_, (*it)->getNeed() + i);
 }
 
 RALStmtList *FunCall::compile(Env &e,
-                              map<string, MemoryLocation *> &variables, 
+                              SparseSymbolMap<MemoryLocation*> &variables, 
                               vector<MemoryLocation *> &temps)
 {
   /* Set up the statement list we're going to return */
   RALStmtList *l = new RALStmtList();
 
-  /* We're going to make a struct of things to fill in later; we're assuming
-   * we know nothing about the function we're calling so that we can support
-   * recursion */
-  FunctionGap *g = new FunctionGap;
+  /* An instrumented call bumps a word of its own first, which is never
+   * touched otherwise and starts off 0 like the rest of memory */
+  if(e.options.instrument)
+  {
+    MemoryLocation *counter = new MemoryLocation();
+    counter->type = VARIABLE;
+    counter->value = 0;
+    e.constants.locations.push_back(counter);
+
+    ProfileCounter c = { counter, site_, name_ };
+    e.counters.push_back(c);
+
+    l->append( new RALStmt(LDA, counter) );
+    l->append( new RALStmt(ADD, getConstant(e.constants, 1)) );
+    l->append( new RALStmt(STA, counter) );
+  }
+
+  /* We're assuming we know nothing about the function we're calling so that
+   * we can support recursion and calls to procedures defined later: anything
+   * that depends on the callee is left NULL with a relocation for the
+   * linker to fill in */
 
   /* First we've got to compile each of the expressions passed as arguments
    * to the function.
-   * We're also keeping track of the memory locations they're written to in a
-   * list, so that we can write them to the activation record once we update 
-   * the FP and SP */
+   * Each one is put by in the next temporary up, so that we can write them
+   * to the activation record once we update the FP and SP. Nothing else
+   * gets compiled in between, so they're free again as soon as we're
+   * done here. */
+  /* A hot call to a small procedure is just its body, working in our
+   * frame with the arguments where they are as its parameters. Otherwise
+   * the arguments known here may have a copy of the callee of their own,
+   * which takes just the rest. */
+  Proc *callee = getInlinable(e);
+  vector<bool> known(AL_->size(), false);
+  Symbol name = callee == NULL ? getSpecialization(e, known) : name_;
+
+  int depth = e.temp_depth;
+  int i = 0;
   list<Expr*>::iterator AL_it;
   list<MemoryLocation*> arguments;
-  for(AL_it = AL_->begin(); AL_it != AL_->end(); AL_it++)
+  for(AL_it = AL_->begin(); AL_it != AL_->end(); AL_it++, i++)
   {
+    if(known[i])
+      continue;
+
     l->append( (*AL_it)->compile(e, variables, temps) );
-    arguments.push_back(e.last_written_to);
+    MemoryLocation *argument = getTemporary(temps, e.temp_depth++);
+    l->append( new STO(e.fp, argument, e) );
+    arguments.push_back(argument);
+  }
+
+  if(callee != NULL)
+  {
+    l->append( callee->compileInline(e, arguments, temps) );
+    e.temp_depth = depth;
+    return l;
+  }
+  e.temp_depth = depth;
+
+  if(e.options.nativeCalls)
+  {
+    /* CALL does all the frame juggling; we just have to drop the arguments
+     * where the new frame is going to be. Parameter i is at offset i, and
+     * the frame starts past the linkage right above the sp */
+    i = 0;
+    list<MemoryLocation*>::iterator arg_it;
+    for(arg_it = arguments.begin(); arg_it != arguments.end(); arg_it++, i++)
+    {
+      l->append( new RALStmt(LDA, e.sp) );
+      l->append( new RALStmt(ADD,
+            getConstant(e.constants, 1 + LINKAGE_SIZE + i)) );
+      l->append( new RALStmt(STA, e.scratch) );
+      l->append( new LDO(e.fp, *arg_it, e) );
+      l->append( new RALStmt(STI, e.scratch) );
+    }
+
+    RALStmt *call = new RALStmt(CALL, NULL);
+    addRelocation(e, call, name, ENTRY_LABEL, arguments.size());
+    addRelocation(e, call, name, FRAME_SIZE);
+    addRelocation(e, call, name, RETURN_VALUE_OFFSET);
+    l->append( call );
+
+    /* The return value comes back in the accumulator, which is where
+     * we want it */
+    return l;
   }
 
   /* Now we've got to update the FP and SP - this means we've got to store the
@@ -692,18 +2240,21 @@ RALStmtList *FunCall::compile(Env &e,
   l->append( new RALStmt(STA, e.fp) );
 
   l->append( new RALStmt(LDA, e.sp) );
-  g->ADDwithActivationRecordSize = new RALStmt(ADD, NULL);
-  l->append( g->ADDwithActivationRecordSize );
+  RALStmt *add = new RALStmt(ADD, NULL);
+  addRelocation(e, add, name, FRAME_SIZE);
+  l->append( add );
   l->append( new RALStmt(STA, e.sp) );
 
   /* Now let's save the previous fp to the stack so we know where
    * to go back to */
   l->append( new RALStmt(LDA, e.prev_fp) );
-  g->STOwithPrevFPOffset = new STO(e.fp, NULL, e);
-  l->append( g->STOwithPrevFPOffset );
+  STO *sto = new STO(e.fp, NULL, e);
+  addRelocation(e, sto->getStmtWithOffset(), name, PREV_FP_OFFSET);
+  l->append( sto );
 
   /* We need the label from the statement to return to */
   LDO *ret_stmt = new LDO(e.fp, NULL, e);
+  addRelocation(e, ret_stmt->getStmtWithOffset(), name, PREV_FP_OFFSET);
   
   /* So that we can create a constant to load from to store the return address
    * ... if this doesn't work we might just want to make a "call" instruction
@@ -711,39 +2262,38 @@ RALStmtList *FunCall::compile(Env &e,
   l->append( 
       new RALStmt(LDA, getConstant(e.constants, ret_stmt->getFirstLabel()))
       );
-  g->STOwithReturnAddressOffset = new STO(e.fp, NULL, e);
-  l->append( g->STOwithReturnAddressOffset );
+  sto = new STO(e.fp, NULL, e);
+  addRelocation(e, sto->getStmtWithOffset(), name, RETURN_ADDRESS_OFFSET);
+  l->append( sto );
 
   /* Iterate through the arguments list and store them in the new
    * activation record */
+  i = 0;
   list<MemoryLocation*>::iterator arg_it;
-  for(arg_it = arguments.begin(); arg_it != arguments.end(); arg_it++)
+  for(arg_it = arguments.begin(); arg_it != arguments.end(); arg_it++, i++)
   {
     l->append( new LDO(e.prev_fp, *arg_it, e) );
-    g->params.push_back(new STO(e.fp, NULL, e));
-    l->append( g->params.back() );
+    sto = new STO(e.fp, NULL, e);
+    addRelocation(e, sto->getStmtWithOffset(), name, PARAMETER_OFFSET, i);
+    l->append( sto );
   }
 
-  /* Make the jump statement and add it to the incomplete record struct */
-  g->JMPtoFunction = new RALStmt(JMP, NULL);
-  l->append( g->JMPtoFunction );
+  /* Make the jump statement */
+  RALStmt *jmp = new RALStmt(JMP, NULL);
+  addRelocation(e, jmp, name, ENTRY_LABEL, arguments.size());
+  l->append( jmp );
 
   /* And add the statement we've already made: Get the prev_fp from the stack,
    * then store it in e.prev_fp */
-  g->LDOwithPrevFPOffset = ret_stmt;
-  l->append( g->LDOwithPrevFPOffset ); 
+  l->append( ret_stmt ); 
   l->append( new RALStmt(STA, e.prev_fp) );
 
-  /* Set up a MemoryLocation (this is still and Expr so we need to store
-   * its result) */
-  MemoryLocation *store_to = new MemoryLocation;
-  store_to->type = TEMPORARY;
-  temps.push_back(store_to);
-
-  /* Fetch the return value and store it to the memory location we just made */
-  g->LDOwithReturnValueOffset = new LDO(e.fp, NULL, e);
-  l->append( g->LDOwithReturnValueOffset );
-  l->append( new STO(e.prev_fp, store_to, e) );
+  /* Fetch the return value and hold on to it in scratch2, which nothing
+   * below touches */
+  LDO *ldo = new LDO(e.fp, NULL, e);
+  addRelocation(e, ldo->getStmtWithOffset(), name, RETURN_VALUE_OFFSET);
+  l->append( ldo );
+  l->append( new RALStmt(STA, e.scratch2) );
 
   /* Move the sp back */
   l->append( new RALStmt(LDA, e.fp) );
@@ -754,58 +2304,306 @@ RALStmtList *FunCall::compile(Env &e,
   l->append( new RALStmt(LDA, e.prev_fp) );
   l->append( new RALStmt(STA, e.fp) );
 
-  /* Mark store_to as the last memory location we've written,
-   * add our gap to the list of incomplete records or fill it in,
-   * and return the statement list we made */
-  e.last_written_to = store_to;
-  
-  if(e.functions[name_] != NULL)
-    fillIn(g, e.functions[name_], e);
-  else
-    e.toCompile[name_].push_back(g);
+  /* And leave the value where an expression's value goes */
+  l->append( new RALStmt(LDA, e.scratch2) );
 
   return l;
 }
 
-FunCall::~FunCall() { delete AL_; }
+FunCall::~FunCall()
+{
+  list<Expr*>::iterator it;
+  for(it = AL_->begin(); it != AL_->end(); it++)
+    deleteExpr(*it);
+  delete AL_;
+}
+
+MemoTable *FunCall::memo_ = NULL;
+int FunCall::sites_ = 0;
+
+/* A call is hot if it made at least one in every HOT_CALL_SHARE calls in
+ * the profiled run; inlining stops MAX_INLINE_DEPTH procedures deep */
+const long long HOT_CALL_SHARE = 100;
+const int MAX_INLINE_DEPTH = 3;
+
+Proc *FunCall::getInlinable(Env &e)
+{
+  const Profile *profile = e.options.profile;
+  if(profile == NULL || e.options.instrument)
+    return NULL;
+
+  long long calls = profile->getCalls(site_, name_);
+  if(calls == 0 || calls * HOT_CALL_SHARE < profile->getTotalCalls())
+    return NULL;
+
+  /* A procedure can't be inlined into itself, however far down */
+  Proc *callee = e.procs.get(name_);
+  if(callee == NULL || callee->countParameters() != AL_->size() ||
+     e.inlining.count(callee) || e.inlining.size() >= MAX_INLINE_DEPTH ||
+     !callee->isInlinable())
+    return NULL;
+
+  return callee;
+}
+
+Symbol FunCall::getSpecialization(Env &e, vector<bool> &known)
+{
+  if(e.specializer == NULL)
+    return name_;
+
+  /* A call that doesn't match what it calls is left for the linker to
+   * complain about */
+  Proc *callee = e.procs.get(name_);
+  if(callee == NULL || callee->countParameters() != AL_->size())
+    return name_;
+
+  /* Only names and numbers are left out: anything more could have a call
+   * in it, which has to be made even though its value is known */
+  vector<int> values(AL_->size(), 0);
+  bool any = false;
+  int i = 0;
+  list<Expr*>::iterator it;
+  for(it = AL_->begin(); it != AL_->end(); it++, i++)
+  {
+    Interval arg = e.analysis->getArgument(this, i);
+    if((*it)->isLeaf() && arg.isConstant())
+    {
+      known[i] = true;
+      values[i] = arg.lo;
+      any = true;
+    }
+  }
+
+  if(!any)
+    return name_;
+
+  Symbol name = e.specializer->get(name_, callee, known, values, e.procs);
+  if(name == name_)
+    known.assign(AL_->size(), false);
+
+  return name;
+}
+
+/* Phase 0 pushes the arguments, first one on top, and phase 1 makes the
+ * call with them. The arguments can't define anything where the call is,
+ * so the name means the same thing in both. */
+void FunCall::step(Evaluator &ev, int phase) const
+{
+	Proc *P = ev.getFunctions().get(name_);
+
+	if (phase == 0) {
+		if (P == NULL) {
+			cout << "Error:  no procedure " << symbolName(name_) << endl;
+			exit(1);
+		}
+		if (P->countParameters() != AL_->size()) {
+			cout << "Param count does not match" << endl;
+			exit(1);
+		}
+
+		ev.push(this, 1);
+		list<Expr*>::reverse_iterator e;
+		for( e = AL_->rbegin(); e != AL_->rend(); e++ )
+			ev.push(*e);
+		return;
+	}
+
+	vector<int> args;
+	ev.popValues(AL_->size(), args);
+
+	bool memoize = memo_ != NULL && memo_->isPure(P, ev.getFunctions());
+
+	int value;
+	if (memoize && memo_->lookup(P, args, value)) {
+		ev.pushValue(value);
+		return;
+	}
+
+	ev.call(P, args, memoize);
+}
+
+void FunCall::getOperands(vector<Expr*> &operands) const
+{
+  operands.insert(operands.end(), AL_->begin(), AL_->end());
+}
+
+void FunCall::releaseOperands(vector<Expr*> &operands)
+{
+  getOperands(operands);
+  AL_->clear();
+}
+
+bool FunCall::isNodePure(const SymbolMap<Proc*> &FT,
+                         set<Proc*> &visiting) const
+{
+  /* Calling something that isn't defined (yet) is an error we'd rather
+   * not cache our way around */
+  Proc *f = FT.get(name_);
+  if(f == NULL)
+    return false;
+
+  return f->isPure(FT, visiting);
+}
+
+void FunCall::nodeHash(Hash &h) const
+{
+  h.add(FUNCALL_TAG);
+  h.add(symbolName(name_));
+  h.add((long long)AL_->size());
+}
+
+Expr *FunCall::nodeSpecialize(const SymbolMap<int> &constants,
+                              Expr **operands) const
+{
+  list<Expr*> *AL = new list<Expr*>(operands, operands + AL_->size());
+  return new FunCall(name_, AL, site_);
+}
 
-int FunCall::eval(map<string,int> NT, map<string,Proc*> FT) const
+/* Nothing's known about what comes back */
+Interval FunCall::nodeRange(const Ranges &R, const Interval *operands,
+                          Analysis &A) const
 {
-	return FT[name_]->apply(NT, FT, AL_);
+  A.addArguments(this, operands, AL_->size());
+  return Interval();
 }
 
-Proc::Proc(list<string> *PL, StmtList *SL)
+Proc::Proc(list<Symbol> *PL, StmtList *SL)
 {
 	SL_ = SL;
 	PL_ = PL;
 	NumParam_ = PL->size();
 }
 
-int Proc::apply(map<string,int> &NT, map<string,Proc*> &FT, list<Expr*> *EL) 
+void Proc::bind(SymbolMap<int> &NT, const vector<int> &args) const
+{
+	list<Symbol>::iterator p;
+	vector<int>::const_iterator a;
+	for( p = PL_->begin(), a = args.begin(); p != PL_->end(); p++, a++ ) 
+		NT[*p] = *a;
+}
+
+bool Proc::isPure(const SymbolMap<Proc*> &FT, set<Proc*> &visiting)
 {
-	map<string,int> NNT;
-	NNT.clear();
+  /* Optimistically assume a procedure we're already looking at is pure, so
+   * that recursive procedures can be pure too */
+  if(visiting.find(this) != visiting.end())
+    return true;
 
-	// bind parameters in new name table
+  visiting.insert(this);
+  bool pure = SL_->isPure(FT, visiting);
+  visiting.erase(this);
 
-	list<string>::iterator p;
-	list<Expr*>::iterator e;
-	if (NumParam_ != EL->size()) {
-		cout << "Param count does not match" << endl;
-		exit(1);
-	}
-	for( p = PL_->begin(), e = EL->begin(); p != PL_->end(); p++, e++ ) 
-		NNT[*p] = (*e)->eval(NT,FT);
+  return pure;
+}
+
+void Proc::hash(Hash &h) const
+{
+  h.add(PROC_TAG);
+  h.add((long long)PL_->size());
 
-	// evaluate function body using new name table and old function table
+  list<Symbol>::iterator it;
+  for(it = PL_->begin(); it != PL_->end(); it++)
+    h.add(symbolName(*it));
 
-	SL_->eval(NNT,FT);
-	if ( NNT.find("return") != NNT.end() )
-		return NNT["return"];
-	else {
-		cout << "Error:  no return value" << endl;
-		exit(1);
-	}
+  SL_->hash(h);
+}
+
+void Proc::collectDefines(vector<Definition> &defines) const
+{
+  SL_->collectDefines(defines);
+}
+
+/* Past this many statements a call costs little next to the body */
+const int MAX_INLINE_STATEMENTS = 20;
+
+bool Proc::returns() const
+{
+  map<Symbol,int> assignments;
+  SL_->countAssignments(assignments);
+
+  return assignments.count(RETURN_SYMBOL) > 0;
+}
+
+bool Proc::isInlinable() const
+{
+  /* One that never returns anything is left for the linker to complain
+   * about */
+  return returns() && SL_->countStatements() <= MAX_INLINE_STATEMENTS;
+}
+
+/* A parameter the body never assigns is read as its value wherever it
+ * turns up; one that it does starts out assigned it instead */
+Proc *Proc::specialize(const vector<bool> &known,
+                       const vector<int> &values) const
+{
+  map<Symbol,int> assignments;
+  SL_->countAssignments(assignments);
+
+  list<Symbol> *PL = new list<Symbol>;
+  StmtList *SL = new StmtList();
+  SymbolMap<int> constants;
+
+  int i = 0;
+  list<Symbol>::iterator it;
+  for(it = PL_->begin(); it != PL_->end(); it++, i++)
+    if(!known[i])
+      PL->push_back(*it);
+    else if(assignments.count(*it))
+      SL->append( new AssignStmt(*it, new Number(values[i])) );
+    else
+      constants[*it] = values[i];
+
+  SL_->specialize(constants, SL);
+  return new Proc(PL, SL);
+}
+
+RALStmtList *Proc::compileInline(Env &e,
+                                 const list<MemoryLocation*> &arguments,
+                                 vector<MemoryLocation*> &temps)
+{
+  SparseSymbolMap<MemoryLocation*> variables;
+
+  list<Symbol>::iterator it;
+  list<MemoryLocation*>::const_iterator at;
+  for(it = PL_->begin(), at = arguments.begin(); it != PL_->end(); it++, at++)
+    variables[(*it)] = *at;
+
+  /* The arguments are still in use, so the body's temporaries go above */
+  int outer_depth = e.temp_depth;
+  e.temp_depth = outer_depth + arguments.size();
+
+  /* Nothing's known about the parameters here either, so this comes out
+   * the same as it does for the procedure itself */
+  Ranges ranges;
+  Analysis analysis;
+  SL_->analyze(ranges, analysis);
+
+  Analysis *outer_analysis = e.analysis;
+  e.analysis = &analysis;
+
+  e.inlining.insert(this);
+  RALStmtList *statements = SL_->compile(e, variables, temps);
+  e.inlining.erase(this);
+
+  e.temp_depth = outer_depth;
+  e.analysis = outer_analysis;
+
+  /* The arguments are temporaries already; anything else goes in the
+   * caller's activation record along with its own variables */
+  vector<Symbol> names = variables.keys();
+  vector<Symbol>::iterator jt;
+  for(jt = names.begin(); jt != names.end(); jt++)
+    if(variables[*jt]->type == VARIABLE)
+      e.inlined.push_back(variables[*jt]);
+
+  /* Returning is just picking up the return value */
+  RALStmtList *return_value = new RALStmtList();
+  return_value->append( new LDO(e.fp, variables[RETURN_SYMBOL], e) );
+
+  statements->replaceNULLsWith(return_value->getFirstLabel());
+  statements->append(return_value);
+
+  return statements;
 }
 
 RALFunction *Proc::compile(Env &e) 
@@ -813,28 +2611,68 @@ RALFunction *Proc::compile(Env &e)
   /* variables contains the function variables and temps contains all
    * the temporaries. Later we'll merge both of these into temp and call
    * that the activation record */
-  map<string, MemoryLocation*> variables = map<string,MemoryLocation*>();
+  SparseSymbolMap<MemoryLocation*> variables;
   vector<MemoryLocation*> temps = vector<MemoryLocation*>();
 
-  MemoryLocation *prev_fp = new MemoryLocation;
-  prev_fp->type = POINTER;
+  /* With native calls the saved fp and return line live in the linkage
+   * CALL pushes, not in the activation record */
+  MemoryLocation *prev_fp = NULL, *ret_addr = NULL;
+  if(!e.options.nativeCalls)
+  {
+    prev_fp = new MemoryLocation;
+    prev_fp->type = POINTER;
 
-  MemoryLocation *ret_addr = new MemoryLocation;
-  ret_addr->type = RETURN_ADDRESS;
+    ret_addr = new MemoryLocation;
+    ret_addr->type = RETURN_ADDRESS;
+  }
 
-  list<string>::iterator it;
+  list<Symbol>::iterator it;
   for(it = PL_->begin(); it != PL_->end(); it++)
   {
     variables[(*it)] = new MemoryLocation;
     variables[(*it)]->type = PARAMETER;
   }
+
+  /* Our relocations are our own - a procedure compiled while some other
+   * function is still being compiled shouldn't pick up any of that
+   * function's */
+  vector<Relocation> outer_relocations;
+  outer_relocations.swap(e.relocations);
+
+  /* Likewise the variables of whatever gets inlined */
+  vector<MemoryLocation*> outer_inlined;
+  outer_inlined.swap(e.inlined);
+
+  int outer_depth = e.temp_depth;
+  e.temp_depth = 0;
+
+  /* Nothing is known about the parameters, or about any other variable
+   * until it's assigned */
+  Ranges ranges;
+  Analysis analysis;
+  SL_->analyze(ranges, analysis);
+
+  Analysis *outer_analysis = e.analysis;
+  e.analysis = &analysis;
   
   RALStmtList *statements = SL_->compile(e, variables, temps);
 
+  e.analysis = outer_analysis;
+
   RALStmtList *return_from_function = new RALStmtList();
-  return_from_function->append( new LDO(e.fp, ret_addr, e) );
-  return_from_function->append( new RALStmt(STA, e.scratch) );
-  return_from_function->append( new RALStmt(JA, e.scratch) );
+  if(e.options.nativeCalls)
+  {
+    /* The return value goes back in the accumulator */
+    if(variables.contains(RETURN_SYMBOL))
+      return_from_function->append( new LDO(e.fp, variables[RETURN_SYMBOL], e) );
+    return_from_function->append( new RALStmt(RET) );
+  }
+  else
+  {
+    return_from_function->append( new LDO(e.fp, ret_addr, e) );
+    return_from_function->append( new RALStmt(STA, e.scratch) );
+    return_from_function->append( new RALStmt(JA, e.scratch) );
+  }
 
   statements->replaceNULLsWith(return_from_function->getFirstLabel());
   statements->append(return_from_function);
@@ -842,26 +2680,50 @@ RALFunction *Proc::compile(Env &e)
   RALFunction *function = new RALFunction();
   function->setStatementList(statements);
 
+  function->relocations.swap(e.relocations);
+  e.relocations.swap(outer_relocations);
+  e.temp_depth = outer_depth;
+
+  vector<MemoryLocation*> inlined;
+  inlined.swap(e.inlined);
+  e.inlined.swap(outer_inlined);
+
   function->prev_fp = prev_fp;
   function->ret_addr = ret_addr;
 
-  if(variables.find("return") != variables.end())
+  if(variables.contains(RETURN_SYMBOL))
   {
-    function->ret_value = variables["return"];
+    function->ret_value = variables[RETURN_SYMBOL];
     function->ret_value->type = RETURN_VALUE;
   }
 
   for(it = PL_->begin(); it != PL_->end(); it++)
     function->parameters.push_back(variables[(*it)]);
 
-  map<string, MemoryLocation*>::iterator jt;
-  for(jt = variables.begin(); jt != variables.end(); jt++)
+  function->variables = variables;
+
+  /* Parameters go in first and in order, so that parameter i always sits
+   * at offset i and a caller can store arguments without knowing anything
+   * else about the callee's frame */
+  list<MemoryLocation*>::iterator pt;
+  for(pt = function->parameters.begin(); pt != function->parameters.end(); pt++)
+    if((*pt)->type == PARAMETER)
+      temps.push_back(*pt);
+
+  vector<Symbol> names = variables.keys();
+  vector<Symbol>::iterator jt;
+  for(jt = names.begin(); jt != names.end(); jt++)
   {
-    temps.push_back(jt->second);
+    if(variables[*jt]->type != PARAMETER)
+      temps.push_back(variables[*jt]);
   }
 
-  temps.push_back(prev_fp);
-  temps.push_back(ret_addr);
+  temps.insert(temps.end(), inlined.begin(), inlined.end());
+
+  if(prev_fp != NULL)
+    temps.push_back(prev_fp);
+  if(ret_addr != NULL)
+    temps.push_back(ret_addr);
 
   function->setActivationRecord(temps);
   function->link();
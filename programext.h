@@ -14,17 +14,47 @@
 #include <string>
 #include <map>
 #include <list>
+#include <set>
+#include <vector>
 
+#include "symbols.h"
+#include "ranges.h"
 #include "ralprogram.h"
+#include "evaluator.h"
 
 using namespace std;
 
-void fillIn(FunctionGap *g, RALFunction *func, Env &e);
+MemoryLocation *getConstant(ConstantPool &constants, int value);
+MemoryLocation *getConstant(ConstantPool &constants, Label *value);
+MemoryLocation *getConstant(ConstantPool &constants, MemoryLocation *value);
 
-MemoryLocation *getConstant(vector<MemoryLocation *> &constants, int value);
-MemoryLocation *getConstant(vector<MemoryLocation *> &constants, Label *value);
-MemoryLocation *getConstant(vector<MemoryLocation *> &constants,
-    MemoryLocation *value);
+/* Fresh registers, no constants, and options with what they imply */
+void initEnv(Env &e, CompileOptions options);
+
+/* The temporary at depth in the current function, made the first time
+ * that depth is reached */
+MemoryLocation *getTemporary(vector<MemoryLocation*> &temps, int depth);
+
+class Expr;
+
+/* Deletes E and everything under it off a worklist, so that a tree as
+ * deep as the input doesn't take as deep a stack */
+void deleteExpr(Expr *E);
+
+/* FNV-1a over whatever is added to it, for keying caches on what a piece
+ * of the syntax tree says */
+class Hash
+{
+ public:
+  Hash() { value_ = 14695981039346656037ULL; };
+
+  void add(long long x);
+  void add(const string &s);
+  unsigned long long getValue() const { return value_; };
+
+ private:
+  unsigned long long value_;
+};
 
 // forward declarations 
 // StmtList used by IfStmt and WhileStmt which are Stmt
@@ -32,38 +62,231 @@ MemoryLocation *getConstant(vector<MemoryLocation *> &constants,
 class StmtList;
 class Proc;
 
+/* A name and the procedure a define binds it to */
+typedef pair<Symbol, Proc*> Definition;
+
+class Stmt;
+class WhileStmt;
+class FunCall;
+
+/* What the range analysis found out about one procedure, for compiling it
+ * by. It's kept apart from the syntax tree, which can be analyzed more
+ * than once - inlined somewhere else, say, or compiled again for another
+ * program - and mustn't carry over what any other analysis found. */
+struct Analysis
+{
+  Analysis() { iteratedLoops = 0; };
+
+  /* Every value the test of an if or a while was found to take; empty if
+   * it was never reached */
+  Interval getTest(const Stmt *S) const;
+  void addTest(const Stmt *S, const Interval &test);
+
+  /* How many times a loop's body runs, and where its counter starts, or -1
+   * unless that's the same every time the loop is reached and the analysis
+   * could tell what it is */
+  int getTrips(const WhileStmt *S, long long &start) const;
+  void setTrips(const WhileStmt *S, int trips, long long start);
+
+  /* Every value argument i of a call was found to take */
+  Interval getArgument(const FunCall *F, int i) const;
+  void addArguments(const FunCall *F, const Interval *arguments, int n);
+
+  map<const Stmt*, Interval> tests;
+  map<const WhileStmt*, pair<int, long long> > trips;
+  map<const FunCall*, vector<Interval> > arguments;
+
+  /* How many loops the analysis is going round inside of right now. Each
+   * of them goes over its body a few times, so past MAX_ITERATED_LOOPS
+   * deep the cost would grow exponentially with the nesting. */
+  int iteratedLoops;
+};
+
+typedef struct Analysis Analysis;
+
+/* A bounded table of results of pure procedure calls, keyed by the Proc
+ * and its evaluated arguments. A procedure is pure if its body only assigns
+ * locals and return and only calls other pure procedures - in particular it
+ * may not contain a define, since that changes the shared function table.
+ * Once full, the oldest entries are evicted first. */
+class MemoTable
+{
+ public:
+	MemoTable( int capacity );
+
+	bool isPure( Proc *P, const SymbolMap<Proc*> &FT );
+	bool lookup( Proc *P, const vector<int> &args, int &value );
+	void insert( Proc *P, const vector<int> &args, int value );
+
+	/* Any define can rebind a name a pure procedure calls, so everything
+	 * we know goes stale */
+	void invalidate();
+
+	long long getHits() { return hits_; };
+	long long getMisses() { return misses_; };
+	void dump();
+
+ private:
+	typedef pair<Proc*, vector<int> > Key;
+
+	int capacity_;
+	map<Key,int> table_;
+	list<Key> order_;
+	map<Proc*,bool> purity_;
+	long long hits_;
+	long long misses_;
+};
+
+/* Copies of procedures for calls that pass some of their arguments as
+ * constants, with those parameters folded into the body, keyed by the
+ * procedure and which arguments were what. Each copy is bound in the
+ * compile's procs under a name of its own, which no identifier can clash
+ * with, so it's compiled and linked like any other procedure. Copying
+ * stops once the copies add up to budget statements, or a procedure has
+ * MAX_SPECIALIZATIONS of them, so that recursing on a constant can't go
+ * on making copies forever. */
+class Specializer
+{
+ public:
+  Specializer(int budget);
+  /* The copies go with it */
+  ~Specializer();
+
+  /* The name to call P, bound to name, by instead, where argument i is
+   * values[i] if known[i]; name itself if there isn't to be a copy */
+  Symbol get(Symbol name, Proc *P, const vector<bool> &known,
+             const vector<int> &values, SymbolMap<Proc*> &procs);
+
+  /* Takes the copies back out of procs, before they're deleted */
+  void unbind(SymbolMap<Proc*> &procs);
+
+ private:
+  typedef pair<Proc*, string> Key;
+
+  int budget_;
+  map<Key, Symbol> made_;
+  map<Proc*, int> counts_;
+  vector<Proc*> copies_;
+  vector<Symbol> names_;
+};
+
+/* The syntax tree is a tree as far as memory goes: every node owns the
+ * nodes and lists it was built from and deletes them with itself, a
+ * DefineStmt owns its Proc, and a Program owns the whole lot. The function
+ * tables used by eval only ever borrow Procs.
+ *
+ * A long a + b + c + ... is a left-deep tree as deep as the chain is long,
+ * deeper than anything the parser's own stack lets through elsewhere, so
+ * whatever walks whole expressions does it off a worklist rather than by
+ * recursing. */
 class Expr
 {
  public:
-	Expr() {};
+	Expr() { need_ = 0; };
 	virtual ~Expr() {};  
-	virtual int eval( map<string,int> NT, map<string,Proc*> FT ) const = 0;  
+	/* Does phase of evaluating the expression: pushes whatever has to be
+	 * done first onto ev, or pops what that left and pushes the value */
+	virtual void step( Evaluator &ev, int phase ) const = 0;
 	
-	/* Postcondition: the last element in temps should be the (MemoryLocation*)
-   * where the value of the expression is stored */
+	/* Postcondition: the value of the expression is in the accumulator.
+   * Values that have to be kept while something else is worked out go in
+   * temps, one per depth, from e.temp_depth up; the code clobbers both
+   * scratch registers but none of the temporaries below that depth. */
   virtual RALStmtList *compile(Env &e, 
-                               map<string, MemoryLocation*> &variables, 
+                               SparseSymbolMap<MemoryLocation*> &variables, 
                                vector<MemoryLocation*> &temps){};
 
   virtual bool isNumber() { return false; };
-
+  /* Only asked of expressions isNumber() says are numbers */
+  virtual int getValue() const { return 0; };
+
+  /* Numbers and identifiers: one load, which leaves scratch2 alone */
+  virtual bool isLeaf() const { return false; };
+
+  /* The Sethi-Ullman label: how many temporaries compile() needs. It's
+   * worked out as the tree is built, bottom up. */
+  int getNeed() const { return need_; };
+
+  /* The expressions this one is made of, in order */
+  virtual void getOperands(vector<Expr*> &operands) const {};
+  /* Hands them over to operands, leaving this one with none to delete */
+  virtual void releaseOperands(vector<Expr*> &operands) {};
+
+  /* Whether this is op1 instruction op2, for instruction ADD, SUB or MUL */
+  virtual bool getBinary(RALInstruction &instruction, Expr *&op1,
+                         Expr *&op2) const { return false; };
+
+  /* Every value the expression can take given what R knows */
+  Interval range(const Ranges &R, Analysis &A) const;
+  /* The same for this node alone, given the ranges of its operands */
+  virtual Interval nodeRange(const Ranges &R, const Interval *operands,
+                             Analysis &A) const
+    { return Interval(); };
+
+  /* Whether the expression is coefficient * var + constant, with the
+   * coefficient 1 or -1 */
+  bool getLinear(Symbol &var, int &coefficient, long long &constant) const;
+  /* One step of that: whether this is sign * inner + offset, with sign 1
+   * or -1 and offset a number */
+  virtual bool getLinearStep(Expr *&inner, int &sign,
+                             long long &offset) const { return false; };
+  /* Whether this is an identifier, and which */
+  virtual bool getName(Symbol &name) const { return false; };
+
+  /* Whether the expression is name op operand, or operand op name for the
+   * operators that commute, with op one of ADD, SUB and MUL */
+  virtual bool getUpdate(Symbol name, RALInstruction &op,
+                         Expr *&operand) const { return false; };
+
+  /* Returns the simplified expression, which may be a new one or one of
+   * this one's operands, in which case this one has been deleted */
   virtual Expr *simplify() { return this; };
 
- private:
+  /* A copy of the expression with every name constants binds read as its
+   * number, simplified as it's put together */
+  Expr *specialize(const SymbolMap<int> &constants) const;
+  /* A copy of this node alone over operands, copies of its own */
+  virtual Expr *nodeSpecialize(const SymbolMap<int> &constants,
+                               Expr **operands) const = 0;
+
+  /* visiting holds the procedures whose purity is being decided further up;
+   * they're assumed pure so that recursion doesn't loop forever */
+  bool isPure(const SymbolMap<Proc*> &FT, set<Proc*> &visiting) const;
+  /* Whether this node alone is pure, its operands aside */
+  virtual bool isNodePure(const SymbolMap<Proc*> &FT,
+                          set<Proc*> &visiting) const { return true; };
+
+  /* Adds everything compile() goes by to h */
+  void hash(Hash &h) const;
+  /* Adds this node alone to h; the operands come first */
+  virtual void nodeHash(Hash &h) const = 0;
+
+ protected:
+	int need_;
 };
 
 class Number : public Expr
 {
  public:
 	Number( int value = 0 );
-	int eval( map<string,int> NT, map<string,Proc*> FT ) const;
+	void step( Evaluator &ev, int phase ) const;
 	
 	RALStmtList *compile(Env &e, 
-                       map<string, MemoryLocation*> &variables, 
+                       SparseSymbolMap<MemoryLocation*> &variables, 
                        vector<MemoryLocation*> &temps);
 
   bool isNumber() { return true; };
+  int getValue() const { return value_; };
+  bool isLeaf() const { return true; };
+
+  Interval nodeRange(const Ranges &R, const Interval *operands,
+                     Analysis &A) const
+    { return Interval(value_, value_); };
   
+  void nodeHash(Hash &h) const;
+  Expr *nodeSpecialize(const SymbolMap<int> &constants,
+                       Expr **operands) const;
+
  private:
 	int value_;
 };
@@ -72,29 +295,49 @@ class Number : public Expr
 class Ident : public Expr
 {
  public:
-	Ident( string name = "" );
-	int eval( map<string,int> NT, map<string,Proc*> FT ) const;
+	Ident( Symbol name = MAIN_SYMBOL );
+	void step( Evaluator &ev, int phase ) const;
 	
 	RALStmtList *compile(Env &e, 
-                       map<string, MemoryLocation*> &variables, 
+                       SparseSymbolMap<MemoryLocation*> &variables, 
                        vector<MemoryLocation*> &temps);
+
+  bool isLeaf() const { return true; };
+
+  Interval nodeRange(const Ranges &R, const Interval *operands,
+                     Analysis &A) const
+    { return R.get(name_); };
+  bool getName(Symbol &name) const { name = name_; return true; };
       
+  void nodeHash(Hash &h) const;
+  Expr *nodeSpecialize(const SymbolMap<int> &constants,
+                       Expr **operands) const;
+
  private:
-	string name_;
+	Symbol name_;
 };
 
 class Times : public Expr
 {
  public:
 	Times( Expr * op1 = NULL, Expr * op2 = NULL );
-	~Times() {delete op1_; delete op2_;};
-	int eval( map<string,int> NT, map<string,Proc*> FT ) const;
+	~Times() {deleteExpr(op1_); deleteExpr(op2_);};
+	void step( Evaluator &ev, int phase ) const;
 	
 	RALStmtList *compile(Env &e, 
-                       map<string, MemoryLocation*> &variables, 
+                       SparseSymbolMap<MemoryLocation*> &variables, 
                        vector<MemoryLocation*> &temps);
 
   Expr *simplify();
+  void getOperands(vector<Expr*> &operands) const;
+  void releaseOperands(vector<Expr*> &operands);
+  bool getBinary(RALInstruction &instruction, Expr *&op1, Expr *&op2) const;
+  void nodeHash(Hash &h) const;
+  Expr *nodeSpecialize(const SymbolMap<int> &constants,
+                       Expr **operands) const;
+  Interval nodeRange(const Ranges &R, const Interval *operands,
+                     Analysis &A) const;
+  bool getUpdate(Symbol name, RALInstruction &op, Expr *&operand) const;
 	
  private:
 	Expr* op1_;
@@ -105,14 +348,24 @@ class Plus : public Expr
 {
  public:
 	Plus( Expr* op1 = NULL, Expr* op2 = NULL );
-	~Plus() {delete op1_; delete op2_;};
-	int eval( map<string,int> NT, map<string,Proc*> FT ) const;
+	~Plus() {deleteExpr(op1_); deleteExpr(op2_);};
+	void step( Evaluator &ev, int phase ) const;
 	
 	RALStmtList *compile(Env &e, 
-                       map<string, MemoryLocation*> &variables, 
+                       SparseSymbolMap<MemoryLocation*> &variables, 
                        vector<MemoryLocation*> &temps);
 
   Expr *simplify();
+  void getOperands(vector<Expr*> &operands) const;
+  void releaseOperands(vector<Expr*> &operands);
+  bool getBinary(RALInstruction &instruction, Expr *&op1, Expr *&op2) const;
+  void nodeHash(Hash &h) const;
+  Expr *nodeSpecialize(const SymbolMap<int> &constants,
+                       Expr **operands) const;
+  Interval nodeRange(const Ranges &R, const Interval *operands,
+                     Analysis &A) const;
+  bool getLinearStep(Expr *&inner, int &sign, long long &offset) const;
+  bool getUpdate(Symbol name, RALInstruction &op, Expr *&operand) const;
 	
  private:
 	Expr* op1_;
@@ -123,14 +376,24 @@ class Minus : public Expr
 {
  public:
 	Minus( Expr* op1 = NULL, Expr* op2 = NULL );
-	~Minus() {delete op1_; delete op2_;};
-	int eval( map<string,int> NT, map<string,Proc*> FT ) const;
+	~Minus() {deleteExpr(op1_); deleteExpr(op2_);};
+	void step( Evaluator &ev, int phase ) const;
 	
 	RALStmtList *compile(Env &e, 
-                       map<string, MemoryLocation*> &variables, 
+                       SparseSymbolMap<MemoryLocation*> &variables, 
                        vector<MemoryLocation*> &temps);
 
   Expr *simplify();
+  void getOperands(vector<Expr*> &operands) const;
+  void releaseOperands(vector<Expr*> &operands);
+  bool getBinary(RALInstruction &instruction, Expr *&op1, Expr *&op2) const;
+  void nodeHash(Hash &h) const;
+  Expr *nodeSpecialize(const SymbolMap<int> &constants,
+                       Expr **operands) const;
+  Interval nodeRange(const Ranges &R, const Interval *operands,
+                     Analysis &A) const;
+  bool getLinearStep(Expr *&inner, int &sign, long long &offset) const;
+  bool getUpdate(Symbol name, RALInstruction &op, Expr *&operand) const;
   
  private:
 	Expr* op1_;
@@ -140,16 +403,46 @@ class Minus : public Expr
 class FunCall : public Expr
 {
  public:
-	FunCall( string name, list<Expr*> *AL );
+	/* site < 0 for the next call in the program, as the parser makes them;
+	 * a copy keeps the site of the call it was copied from */
+	FunCall( Symbol name, list<Expr*> *AL, int site = -1 );
 	~FunCall();
-	int eval( map<string,int> NT, map<string,Proc*> FT ) const;
+	void step( Evaluator &ev, int phase ) const;
 
 	RALStmtList *compile(Env &e, 
-                       map<string, MemoryLocation*> &variables, 
+                       SparseSymbolMap<MemoryLocation*> &variables, 
                        vector<MemoryLocation*> &temps);
+
+  void getOperands(vector<Expr*> &operands) const;
+  void releaseOperands(vector<Expr*> &operands);
+  bool isNodePure(const SymbolMap<Proc*> &FT, set<Proc*> &visiting) const;
+  void nodeHash(Hash &h) const;
+  Expr *nodeSpecialize(const SymbolMap<int> &constants,
+                       Expr **operands) const;
+  /* Notes down the arguments' ranges, for specializing */
+  Interval nodeRange(const Ranges &R, const Interval *operands,
+                     Analysis &A) const;
+
+  /* Calls to pure procedures go through this when it isn't NULL */
+  static void setMemoTable(MemoTable *memo) { memo_ = memo; };
+  static MemoTable *getMemoTable() { return memo_; };
+
  private:
-	string name_;
+	/* Whether the profile says this call is worth inlining, and it can be */
+	Proc *getInlinable(Env &e);
+	/* The name of a copy of the callee for the arguments known here, which
+	 * known says are left out of the call; name_ and none if there isn't
+	 * one */
+	Symbol getSpecialization(Env &e, vector<bool> &known);
+
+	Symbol name_;
 	list<Expr*> *AL_;
+	/* Which call this is in the program, counting in the order they were
+	 * parsed; profiles are keyed by it */
+	int site_;
+
+	static MemoTable *memo_;
+	static int sites_;
 };
 
 
@@ -158,11 +451,44 @@ class Stmt
  public:
 	Stmt() {};
 	virtual ~Stmt() {};  
-	virtual void eval( map<string,int> &NT, map<string,Proc*> &FT ) const = 0;  
+	/* As Expr::step, without a value to leave */
+	virtual void step( Evaluator &ev, int phase ) const = 0;
 
 	virtual RALStmtList *compile(Env &e, 
-                               map<string, MemoryLocation*> &variables, 
+                               SparseSymbolMap<MemoryLocation*> &variables, 
                                vector<MemoryLocation*> &temps) = 0;
+
+  virtual bool isPure(const SymbolMap<Proc*> &FT, set<Proc*> &visiting) const = 0;
+
+  /* Adds everything compile() goes by to h */
+  virtual void hash(Hash &h) const = 0;
+
+  /* Carries R from before the statement to after it, noting down in A
+   * what compile() can make use of along the way */
+  virtual void analyze(Ranges &R, Analysis &A) {};
+
+  /* Adds up how many assignments to each name there are in here, however
+   * deep */
+  virtual void countAssignments(map<Symbol,int> &counts) const {};
+
+  /* Whether this is name := name + step */
+  virtual bool getStep(Symbol name, long long &step) const { return false; };
+
+  /* Whether this is name := name op operand, as Expr::getUpdate */
+  virtual bool getUpdate(Symbol &name, RALInstruction &op,
+                         Expr *&operand) const { return false; };
+
+  /* Lists every name defined in here with its Proc, in program order, so
+   * binding them in turn leaves what a compiled call ends up calling */
+  virtual void collectDefines(vector<Definition> &defines) const {};
+
+  /* Appends a copy of the statement to SL, as Expr::specialize, leaving
+   * out whatever the constants show can never run */
+  virtual void specialize(const SymbolMap<int> &constants,
+                          StmtList *SL) const = 0;
+
+  /* How many statements there are in here, however deep */
+  virtual int countStatements() const { return 1; };
       
  private:
 };
@@ -171,32 +497,47 @@ class Stmt
 class AssignStmt: public Stmt
 {
  public:
-	AssignStmt( string name="", Expr *E=NULL );
+	AssignStmt( Symbol name=MAIN_SYMBOL, Expr *E=NULL );
 	~AssignStmt() {delete E_;}; 
-	void eval( map<string,int> &NT, map<string,Proc*> &FT ) const;
+	void step( Evaluator &ev, int phase ) const;
 	
 	RALStmtList *compile(Env &e, 
-                       map<string, MemoryLocation*> &variables, 
+                       SparseSymbolMap<MemoryLocation*> &variables, 
                        vector<MemoryLocation*> &temps);
 	
+  bool isPure(const SymbolMap<Proc*> &FT, set<Proc*> &visiting) const;
+  void hash(Hash &h) const;
+
+  void analyze(Ranges &R, Analysis &A);
+  void countAssignments(map<Symbol,int> &counts) const { counts[name_]++; };
+  bool getStep(Symbol name, long long &step) const;
+  bool getUpdate(Symbol &name, RALInstruction &op, Expr *&operand) const;
+  void specialize(const SymbolMap<int> &constants, StmtList *SL) const;
+
  private:
-	string name_;
+	Symbol name_;
 	Expr* E_;
 };
 
 class DefineStmt : public Stmt
 { 
  public:
-	DefineStmt( string name="", Proc *P=NULL );
+	DefineStmt( Symbol name=MAIN_SYMBOL, Proc *P=NULL );
 	~DefineStmt();  
-	void eval( map<string,int> &NT, map<string,Proc*> &FT ) const;
+	void step( Evaluator &ev, int phase ) const;
 	
 	RALStmtList *compile(Env &e, 
-                       map<string, MemoryLocation*> &variables, 
+                       SparseSymbolMap<MemoryLocation*> &variables, 
                        vector<MemoryLocation*> &temps);
     
+  bool isPure(const SymbolMap<Proc*> &FT, set<Proc*> &visiting) const;
+  void hash(Hash &h) const;
+
+  void collectDefines(vector<Definition> &defines) const;
+  void specialize(const SymbolMap<int> &constants, StmtList *SL) const {};
+
  private:
-	string name_;
+	Symbol name_;
 	Proc* P_;
 };
 
@@ -206,32 +547,94 @@ class IfStmt: public Stmt
  public:
 	IfStmt( Expr *E,StmtList *S1, StmtList *S2 );
 	~IfStmt();
-	void eval( map<string,int> &NT, map<string,Proc*> &FT ) const;
+	void step( Evaluator &ev, int phase ) const;
 	
 	RALStmtList *compile(Env &e, 
-                       map<string, MemoryLocation*> &variables, 
+                       SparseSymbolMap<MemoryLocation*> &variables, 
                        vector<MemoryLocation*> &temps);
 	
+  bool isPure(const SymbolMap<Proc*> &FT, set<Proc*> &visiting) const;
+  void hash(Hash &h) const;
+
+  void analyze(Ranges &R, Analysis &A);
+  void countAssignments(map<Symbol,int> &counts) const;
+  void collectDefines(vector<Definition> &defines) const;
+  int countStatements() const;
+  void specialize(const SymbolMap<int> &constants, StmtList *SL) const;
+
  private:
 	Expr* E_;
 	StmtList *S1_;
 	StmtList *S2_;
 };
 
+/* One name a loop keeps adding to, subtracting from or multiplying by
+ * coefficient * var + constant; a coefficient of 0 means just the
+ * constant */
+struct Accumulator
+{
+  Symbol name;
+  RALInstruction op;
+  Symbol var;
+  int coefficient;
+  long long constant;
+  /* Whether it comes after the counter is stepped, and so sees it stepped */
+  bool afterStep;
+};
+
+typedef struct Accumulator Accumulator;
+
+/* A loop whose test is coefficient * counter + constant, and whose body is
+ * nothing but the counter going up or down by step and accumulators taking
+ * in the counter, constants or names the loop leaves alone, each assigned
+ * once. What such a loop leaves behind can be worked out without going
+ * round it. */
+struct LoopForm
+{
+  Symbol counter;
+  int coefficient;
+  long long constant;
+  long long step;
+  vector<Accumulator> accumulators;
+};
+
+typedef struct LoopForm LoopForm;
+
 class WhileStmt: public Stmt
 {
  public:
 	WhileStmt( Expr *E,StmtList *S );
         ~WhileStmt();
-	void eval( map<string,int> &NT, map<string,Proc*> &FT ) const;
+	void step( Evaluator &ev, int phase ) const;
 	
 	RALStmtList *compile(Env &e, 
-                       map<string, MemoryLocation*> &variables, 
+                       SparseSymbolMap<MemoryLocation*> &variables, 
                        vector<MemoryLocation*> &temps);
   
+  bool isPure(const SymbolMap<Proc*> &FT, set<Proc*> &visiting) const;
+  void hash(Hash &h) const;
+
+  void analyze(Ranges &R, Analysis &A);
+  void countAssignments(map<Symbol,int> &counts) const;
+  void collectDefines(vector<Definition> &defines) const;
+  int countStatements() const;
+  void specialize(const SymbolMap<int> &constants, StmtList *SL) const;
+
  private:
+	void countTrips(const Ranges &R, Analysis &A);
+	/* What the body assigns, worked out the first time it's needed */
+	const map<Symbol,int> &getAssignments();
+
+	static LoopForm *findForm(Expr *E, StmtList *S);
+	/* The loop done without going round it, or NULL if it can't be;
+	 * guarded is set if it's only to be done when the test is positive */
+	StmtList *closedForm(const Analysis &A, bool &guarded) const;
+	void appendExit(RALStmtList *l, const Interval &test) const;
+
 	Expr* E_;
 	StmtList *S_;
+	map<Symbol,int> *assignments_;
+	LoopForm *form_;
 };
 
 
@@ -239,29 +642,72 @@ class StmtList
 {
  public:
 	StmtList() {};
-	void eval( map<string,int> &NT, map<string,Proc*> &FT );  
-	void insert( Stmt *T );  
+	~StmtList();
+	/* Runs the statements from phase on */
+	void step( Evaluator &ev, int phase ) const;
+	void append( Stmt *T );  
 
 	RALStmtList *compile(Env &e, 
-                       map<string, MemoryLocation*> &variables, 
+                       SparseSymbolMap<MemoryLocation*> &variables, 
                        vector<MemoryLocation*> &temps);
 
+  bool isPure(const SymbolMap<Proc*> &FT, set<Proc*> &visiting) const;
+  void hash(Hash &h) const;
+
+  void analyze(Ranges &R, Analysis &A);
+  void countAssignments(map<Symbol,int> &counts) const;
+  void collectDefines(vector<Definition> &defines) const;
+  int countStatements() const;
+  /* Whether one of the statements at the top level is name := name + step */
+  bool getStep(Symbol name, long long &step) const;
+  /* Copies of the statements, as Stmt::specialize */
+  void specialize(const SymbolMap<int> &constants, StmtList *SL) const;
+
+  const vector<Stmt*> &getStatements() const { return SL_; };
+
  private:
-	list<Stmt*> SL_;
+	vector<Stmt*> SL_;
 };
 
 class Proc
 {
  public:
-	Proc( list<string> *PL, StmtList *SL );
-	~Proc() {delete SL_; };  
-	int apply( map<string,int> &NT, map<string,Proc*> &FT, list<Expr*> *EL );
+	Proc( list<Symbol> *PL, StmtList *SL );
+	~Proc() {delete SL_; delete PL_; };  
+	/* Binds the parameters to args in NT, for a call to run the body in */
+	void bind( SymbolMap<int> &NT, const vector<int> &args ) const;
+	const StmtList *getBody() const { return SL_; };
 
 	RALFunction *compile(Env &e);
 
+  bool isPure(const SymbolMap<Proc*> &FT, set<Proc*> &visiting);
+
+  void collectDefines(vector<Definition> &defines) const;
+
+  /* Everything compile() goes by: the parameters and the body, but not
+   * the bodies of procedures defined in it, which compile on their own */
+  void hash(Hash &h) const;
+
+  /* Whether the body assigns return anywhere at all */
+  bool returns() const;
+  /* Small enough to inline, and sure to return something */
+  bool isInlinable() const;
+  int countParameters() const { return PL_->size(); };
+
+  /* A copy for calls where parameter i is values[i] if known[i], taking
+   * only the rest */
+  Proc *specialize(const vector<bool> &known,
+                   const vector<int> &values) const;
+
+  /* The body compiled in place of a call, in the caller's frame, with the
+   * parameters already in arguments; leaves the return value in the
+   * accumulator */
+  RALStmtList *compileInline(Env &e, const list<MemoryLocation*> &arguments,
+                             vector<MemoryLocation*> &temps);
+
  private:
 	StmtList *SL_;
-	list<string> *PL_;
+	list<Symbol> *PL_;
 	int NumParam_;
 };
 
@@ -269,16 +715,26 @@ class Program
 {
  public:
 	Program( StmtList *SL );
-	~Program() { delete SL_; };
+	~Program() { delete main_; delete memo_; };
 	void dump();
 	void eval();
+
+	/* Memoize calls to pure procedures during eval, keeping at most
+	 * capacity results */
+	void enableMemo( int capacity );
+	/* Calls nested more than depth deep during eval are an error */
+	void limitDepth( int depth ) { depthLimit_ = depth; };
 	
-	RALProgram *compile();
+	RALProgram *compile( CompileOptions options = CompileOptions() );
 
  private:
 	StmtList *SL_;
-	map<string,int> NameTable_;
-	map<string,Proc*> FunctionTable_;
+	/* The top level as a procedure of no parameters; it owns SL_ */
+	Proc *main_;
+	SymbolMap<int> NameTable_;
+	SymbolMap<Proc*> FunctionTable_;
+	MemoTable *memo_;
+	int depthLimit_;
 };
 
 #endif
@@ -1,6 +1,6 @@
 %union{
    int value; 
-   char *ident;
+   int symbol;
 }
 
 %token IDENT
@@ -23,7 +23,7 @@
 program: stmt_list {printf("program -> stmt_list\n"); }
        ;
 
-stmt_list:  stmt ';' stmt_list { printf("stmt_list -> stmt ; stmt_list\n"); }
+stmt_list:  stmt_list ';' stmt { printf("stmt_list -> stmt_list ; stmt\n"); }
         |   stmt  { printf("stmt_list -> stmt\n"); }
         ;
 
@@ -51,7 +51,7 @@ while_stmt: WHILE expr DO stmt_list OD
            { printf("while_stmt -> WHILE expr DO stmt_list OD\n"); }
            ;
 
-param_list: IDENT ',' param_list { printf("param_list -> IDENT, param_list\n"); }
+param_list: param_list ',' IDENT { printf("param_list -> param_list, IDENT\n"); }
     |      IDENT { printf("param_list -> IDENT\n"); }
 
 expr: expr '+' term   { printf("expr -> expr + term\n"); }
@@ -72,6 +72,6 @@ factor:     '(' expr ')'  { printf("factor -> ( expr ) \n"); }
 funcall:  IDENT '(' expr_list ')' 
          { printf("funcall -> identifier ( expr_list )\n"); }
 
-expr_list: expr ',' expr_list { printf("expr_list -> expr , expr_list\n"); }
+expr_list: expr_list ',' expr { printf("expr_list -> expr_list , expr\n"); }
     |      expr { printf("expr_list -> expr\n"); }
 %%
@@ -0,0 +1,252 @@
+/*
+ * file:  ralbatch.cpp
+ *
+ * Description: A work-stealing pool of interpreter threads for running
+ * lots of small, independent RAL jobs.
+ */
+#include <algorithm>
+#include <iostream>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include "ralbatch.h"
+
+using namespace std;
+
+static double now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+RALJob::RALJob(RALProgram *program, int memorySize)
+{
+  this->program = program;
+  this->memorySize = memorySize;
+  status = FAULTED;
+  steps = 0;
+  preemptions = 0;
+  latency = 0;
+  interpreter = NULL;
+}
+
+RALJob::RALJob(RALProgram *program, const vector<int> &memory)
+{
+  this->program = program;
+  this->memory = memory;
+  memorySize = memory.size();
+  status = FAULTED;
+  steps = 0;
+  preemptions = 0;
+  latency = 0;
+  interpreter = NULL;
+}
+
+RALBatch::RALBatch(int threads, long long budget)
+{
+  if(threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(threads <= 0)
+    threads = 1;
+
+  threads_ = threads;
+  budget_ = budget > 0 ? budget : -1;
+
+  /* The mutexes can't move once they're initialised, so size this once */
+  queues_.resize(threads_);
+  for(int i = 0; i < threads_; i++)
+    pthread_mutex_init(&queues_[i].lock, NULL);
+  pthread_mutex_init(&lock_, NULL);
+
+  outstanding_ = 0;
+  nextWorker_ = 0;
+  start_ = 0;
+  elapsed_ = 0;
+  totalSteps_ = 0;
+}
+
+RALBatch::~RALBatch()
+{
+  for(int i = 0; i < threads_; i++)
+    pthread_mutex_destroy(&queues_[i].lock);
+  pthread_mutex_destroy(&lock_);
+}
+
+/* Jobs are dealt out round robin; stealing evens out whatever that gets
+ * wrong */
+void RALBatch::submit(RALJob *job)
+{
+  jobs_.push_back(job);
+  queues_[nextWorker_].jobs.push_back(job);
+  nextWorker_ = (nextWorker_ + 1) % threads_;
+}
+
+struct RALWorker
+{
+  RALBatch *batch;
+  int index;
+};
+
+void RALBatch::run()
+{
+  outstanding_ = 0;
+  for(int i = 0; i < threads_; i++)
+    outstanding_ += queues_[i].jobs.size();
+
+  start_ = now();
+
+  vector<pthread_t> threads(threads_);
+  vector<RALWorker> workers(threads_);
+  for(int i = 0; i < threads_; i++)
+  {
+    workers[i].batch = this;
+    workers[i].index = i;
+    pthread_create(&threads[i], NULL, work, &workers[i]);
+  }
+
+  for(int i = 0; i < threads_; i++)
+    pthread_join(threads[i], NULL);
+
+  elapsed_ = now() - start_;
+
+  totalSteps_ = 0;
+  for(int i = 0; i < jobs_.size(); i++)
+    totalSteps_ += jobs_[i]->steps;
+}
+
+void *RALBatch::work(void *arg)
+{
+  RALBatch *batch = ((RALWorker*)arg)->batch;
+  int worker = ((RALWorker*)arg)->index;
+
+  for(;;)
+  {
+    RALJob *job = batch->take(worker);
+
+    /* Nothing to do here or to steal, but a job somebody else preempted
+     * may still turn up again */
+    if(job == NULL)
+    {
+      pthread_mutex_lock(&batch->lock_);
+      bool done = batch->outstanding_ == 0;
+      pthread_mutex_unlock(&batch->lock_);
+
+      if(done)
+        break;
+
+      sched_yield();
+      continue;
+    }
+
+    /* The memory arena for a job only exists while it's in flight */
+    if(job->interpreter == NULL && job->memory.empty())
+      job->interpreter = new RALInterpreter(job->program, job->memorySize);
+    else if(job->interpreter == NULL)
+      job->interpreter = new RALInterpreter(job->program, job->memory);
+
+    RALStatus status = job->interpreter->run(batch->budget_);
+
+    if(status == PREEMPTED)
+    {
+      job->preemptions++;
+
+      WorkQueue &q = batch->queues_[worker];
+      pthread_mutex_lock(&q.lock);
+      q.jobs.push_back(job);
+      pthread_mutex_unlock(&q.lock);
+      continue;
+    }
+
+    job->status = status;
+    batch->finish(job);
+  }
+
+  return NULL;
+}
+
+RALJob *RALBatch::take(int worker)
+{
+  RALJob *job = NULL;
+
+  WorkQueue &own = queues_[worker];
+  pthread_mutex_lock(&own.lock);
+  if(!own.jobs.empty())
+  {
+    job = own.jobs.front();
+    own.jobs.pop_front();
+  }
+  pthread_mutex_unlock(&own.lock);
+
+  for(int i = 1; job == NULL && i < threads_; i++)
+  {
+    WorkQueue &victim = queues_[(worker + i) % threads_];
+    pthread_mutex_lock(&victim.lock);
+    if(!victim.jobs.empty())
+    {
+      job = victim.jobs.back();
+      victim.jobs.pop_back();
+    }
+    pthread_mutex_unlock(&victim.lock);
+  }
+
+  return job;
+}
+
+void RALBatch::finish(RALJob *job)
+{
+  job->latency = now() - start_;
+  job->steps = job->interpreter->getSteps();
+  job->memory.swap(job->interpreter->getMemory());
+
+  delete job->interpreter;
+  job->interpreter = NULL;
+
+  pthread_mutex_lock(&lock_);
+  outstanding_--;
+  pthread_mutex_unlock(&lock_);
+}
+
+void RALBatch::report()
+{
+  int halted = 0, faulted = 0;
+  long long preemptions = 0;
+  vector<double> latencies;
+
+  for(int i = 0; i < jobs_.size(); i++)
+  {
+    RALJob *job = jobs_[i];
+
+    cout << "job " << i << " -> "
+         << (job->status == HALTED ? "halted" : "faulted") << " after "
+         << job->steps << " instructions, " << job->latency * 1000
+         << " ms" << endl;
+
+    if(job->status == HALTED)
+      halted++;
+    else
+      faulted++;
+    preemptions += job->preemptions;
+    latencies.push_back(job->latency);
+  }
+
+  sort(latencies.begin(), latencies.end());
+
+  cout << "Batch of " << jobs_.size() << " jobs on " << threads_
+       << " threads" << endl;
+  cout << "halted -> " << halted << endl;
+  cout << "faulted -> " << faulted << endl;
+  cout << "preemptions -> " << preemptions << endl;
+  if(!latencies.empty())
+  {
+    cout << "median latency -> "
+         << latencies[latencies.size() / 2] * 1000 << " ms" << endl;
+    cout << "max latency -> " << latencies.back() * 1000 << " ms" << endl;
+  }
+  cout << "elapsed -> " << elapsed_ << " s" << endl;
+  if(elapsed_ > 0)
+  {
+    cout << "throughput -> " << jobs_.size() / elapsed_ << " jobs/s, "
+         << totalSteps_ / elapsed_ << " instructions/s" << endl;
+  }
+}
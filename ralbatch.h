@@ -0,0 +1,95 @@
+#ifndef __RALBATCH_H__
+#define __RALBATCH_H__
+/*
+ * file:  ralbatch.h
+ *
+ * Description: Declarations for running a batch of independent RAL jobs
+ * on a pool of interpreter threads
+ */
+#include <deque>
+#include <vector>
+#include <pthread.h>
+#include "programext.h"
+#include "ralprogram.h"
+#include "ralinterpreter.h"
+
+using namespace std;
+
+/* Words of memory for a job that doesn't bring its own image; batch jobs
+ * are meant to be small */
+const int DEFAULT_JOB_MEMORY_SIZE = 1 << 16;
+
+/* One program to run from one initial memory image. Many jobs can share a
+ * RALProgram, since the interpreter only reads its code. The results are
+ * filled in by RALBatch::run(). */
+struct RALJob
+{
+  /* Without an image the job starts from the program's own, made when the
+   * job is first picked up */
+  RALJob(RALProgram *program, int memorySize = DEFAULT_JOB_MEMORY_SIZE);
+  RALJob(RALProgram *program, const vector<int> &memory);
+
+  RALProgram *program;
+  int memorySize;
+  vector<int> memory;
+
+  RALStatus status;
+  long long steps;
+  int preemptions;
+  /* Seconds from the start of the batch until the job finished */
+  double latency;
+
+  /* Only alive while the job is being run or waiting to be resumed */
+  RALInterpreter *interpreter;
+};
+
+typedef struct RALJob RALJob;
+
+/* Every worker has its own queue: it takes jobs off the front of it and
+ * puts preempted ones on the back, and once it's empty steals off the
+ * back of somebody else's. */
+class RALBatch
+{
+public:
+  /* threads <= 0 means one per processor; budget <= 0 means jobs run to
+   * completion once started */
+  RALBatch(int threads = 0, long long budget = 0);
+  ~RALBatch();
+
+  void submit(RALJob *job);
+
+  /* Runs everything submitted so far and waits for all of it to finish;
+   * the memory of each job is left as its run left it */
+  void run();
+
+  double getElapsed() { return elapsed_; };
+  long long getTotalSteps() { return totalSteps_; };
+  int getThreads() { return threads_; };
+  void report();
+
+private:
+  struct WorkQueue
+  {
+    pthread_mutex_t lock;
+    deque<RALJob*> jobs;
+  };
+
+  static void *work(void *arg);
+  RALJob *take(int worker);
+  void finish(RALJob *job);
+
+  int threads_;
+  long long budget_;
+  vector<RALJob*> jobs_;
+  vector<WorkQueue> queues_;
+
+  pthread_mutex_t lock_;
+  int outstanding_;
+  int nextWorker_;
+  double start_;
+
+  double elapsed_;
+  long long totalSteps_;
+};
+
+#endif
@@ -0,0 +1,190 @@
+/*
+ * file:  ralinterpreter.cpp
+ *
+ * Description: A straightforward interpreter for linked RAL programs.
+ * Memory is a flat array of words, the accumulator is a local and every
+ * address is checked, so a bad program faults instead of crashing us.
+ */
+#include "ralinterpreter.h"
+
+using namespace std;
+
+RALInterpreter::RALInterpreter(RALProgram *program, int memorySize)
+{
+  program_ = program;
+  memory_ = program->getMemoryImage();
+
+  if(memory_.size() < memorySize)
+    memory_.resize(memorySize, 0);
+
+  steps_ = 0;
+  pc_ = 1;
+  acc_ = 0;
+  checked_ = false;
+}
+
+RALInterpreter::RALInterpreter(RALProgram *program, const vector<int> &memory,
+    int pc, int acc)
+{
+  program_ = program;
+  memory_ = memory;
+  steps_ = 0;
+  pc_ = pc;
+  acc_ = acc;
+  checked_ = false;
+}
+
+/* Every direct operand has to be an address in our memory; frame offsets
+ * can only be checked when they're used */
+bool RALInterpreter::check()
+{
+  const RALCode &code = program_->getCode();
+  int n = code.size(), size = memory_.size();
+
+  for(int i = 0; i < n; i++)
+  {
+    switch(code.getInstruction(i))
+    {
+      case JMP:
+      case JMZ:
+      case JMN:
+      case HLT:
+      case RET:
+      case LDF:
+      case STF:
+      case CALL:
+        break;
+      default:
+        if(code.getOperand(i) >= size)
+          return false;
+    }
+  }
+
+  checked_ = true;
+  return true;
+}
+
+RALStatus RALInterpreter::run()
+{
+  return run(-1);
+}
+
+RALStatus RALInterpreter::run(long long budget)
+{
+  if(!checked_ && !check())
+    return FAULTED;
+
+  const RALCode &code = program_->getCode();
+  int n = code.size(), size = memory_.size();
+
+  /* Line l is at index l - 1 in the code */
+  const unsigned char *op = code.getOpcodes() - 1;
+  const unsigned *arg = code.getOperands() - 1;
+
+  int *m = &memory_[0];
+  int fp = program_->getFramePointer()->address;
+  int sp = program_->getStackPointer()->address;
+  int acc = acc_, pc = pc_, a, f;
+
+  /* A negative budget never runs out */
+  long long stop = budget < 0 ? -1 : steps_ + budget;
+
+  /* Running off the end of the program is as good as a HLT */
+  while(pc >= 1 && pc <= n)
+  {
+    if(steps_ == stop)
+    {
+      pc_ = pc;
+      acc_ = acc;
+      return PREEMPTED;
+    }
+
+    steps_++;
+    a = arg[pc];
+
+    switch(op[pc++])
+    {
+      case LDA:
+        acc = m[a];
+        break;
+      case LDI:
+        if(m[a] < 0 || m[a] >= size)
+          return FAULTED;
+        acc = m[m[a]];
+        break;
+      case STA:
+        m[a] = acc;
+        break;
+      case STI:
+        if(m[a] < 0 || m[a] >= size)
+          return FAULTED;
+        m[m[a]] = acc;
+        break;
+      /* Do the arithmetic unsigned so overflow wraps just like the JIT */
+      case ADD:
+        acc = (int)((unsigned)acc + (unsigned)m[a]);
+        break;
+      case SUB:
+        acc = (int)((unsigned)acc - (unsigned)m[a]);
+        break;
+      case MUL:
+        acc = (int)((unsigned)acc * (unsigned)m[a]);
+        break;
+      case JMP:
+        pc = a;
+        break;
+      case JMZ:
+        if(acc == 0)
+          pc = a;
+        break;
+      case JMN:
+        if(acc < 0)
+          pc = a;
+        break;
+      case JA:
+        pc = m[a];
+        if(pc < 1 || pc > n)
+          return FAULTED;
+        break;
+      case HLT:
+        return HALTED;
+      case LDF:
+        a += m[fp];
+        if(a < 0 || a >= size)
+          return FAULTED;
+        acc = m[a];
+        break;
+      case STF:
+        a += m[fp];
+        if(a < 0 || a >= size)
+          return FAULTED;
+        m[a] = acc;
+        break;
+      case CALL:
+        f = m[sp] + 1 + LINKAGE_SIZE;
+        if(m[sp] < 0 || f + code.getFrameSize(pc - 2) > size)
+          return FAULTED;
+        m[f - 2] = m[fp];
+        m[f - 1] = pc;
+        m[fp] = f;
+        m[sp] = f + code.getFrameSize(pc - 2) - 1;
+        pc = a;
+        break;
+      case RET:
+        f = m[fp];
+        if(f < LINKAGE_SIZE + 1 || f > size)
+          return FAULTED;
+        pc = m[f - 1];
+        m[fp] = m[f - 2];
+        m[sp] = f - LINKAGE_SIZE - 1;
+        if(pc < 1 || pc > n)
+          return FAULTED;
+        break;
+    }
+  }
+
+  if(pc != n + 1)
+    return FAULTED;
+
+  return HALTED;
+}
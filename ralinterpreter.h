@@ -0,0 +1,57 @@
+#ifndef __RALINTERPRETER_H__
+#define __RALINTERPRETER_H__
+/*
+ * file:  ralinterpreter.h
+ *
+ * Description: Declarations for executing linked RAL programs, either
+ * with a plain interpreter or with the x86-64 JIT in raljit.h
+ */
+#include <vector>
+#include "programext.h"
+#include "ralprogram.h"
+
+using namespace std;
+
+/* Words of RAL memory given to a running program; the stack grows up from
+ * the end of the constant pool into whatever is left of this. */
+const int DEFAULT_MEMORY_SIZE = 1 << 20;
+
+/* PREEMPTED means a run ran out of its instruction budget; calling run()
+ * again picks up where it left off */
+enum RALStatus { HALTED, FAULTED, PREEMPTED };
+
+typedef enum RALStatus RALStatus;
+
+/* The program's code is only ever read, so any number of interpreters can
+ * share one RALProgram; each has its own memory and registers. */
+class RALInterpreter
+{
+public:
+  RALInterpreter(RALProgram *program, int memorySize = DEFAULT_MEMORY_SIZE);
+  /* Start from the given memory image instead of the program's own, and
+   * optionally partway through with the given pc and accumulator */
+  RALInterpreter(RALProgram *program, const vector<int> &memory,
+                 int pc = 1, int acc = 0);
+
+  /* Run to completion, or for at most budget more instructions */
+  RALStatus run();
+  RALStatus run(long long budget);
+
+  vector<int> &getMemory() { return memory_; };
+  long long getSteps() { return steps_; };
+
+private:
+  bool check();
+
+  RALProgram *program_;
+  vector<int> memory_;
+  long long steps_;
+
+  /* Where a preempted run left off; checked_ once the operands have been
+   * vetted against our memory */
+  int pc_;
+  int acc_;
+  bool checked_;
+};
+
+#endif
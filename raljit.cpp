@@ -0,0 +1,370 @@
+/*
+ * file:  raljit.cpp
+ *
+ * Description: Translates a linked RAL program straight into x86-64
+ * machine code in an mmap'd buffer and runs it in-process.
+ *
+ * Register assignment while the generated code runs:
+ *   eax  the accumulator
+ *   rbx  base of RAL memory, so address a lives at [rbx + 4a]
+ *   r12  base of the JA jump table (one native address per line)
+ *   r13d size of RAL memory in words, for checking LDI/STI/JA targets
+ *   ecx  scratch for indirect and frame-relative addresses
+ *   edx  more scratch for CALL and RET
+ *
+ * The generated function returns 0 on HLT and 1 on a fault. Anywhere we
+ * aren't on x86-64 everything falls back on RALInterpreter.
+ */
+#include <cstring>
+#include "raljit.h"
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define RALJIT_X86_64
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+typedef int (*RALEntry)(int *memory, void **jumpTable, int memorySize);
+
+/* Where a rel32 needs to point once we know where everything is */
+struct JITPatch {
+  int at;
+  int line;
+};
+
+/* Special jump targets; everything else is a line number */
+const int HALT_TARGET = -1;
+const int FAULT_TARGET = -2;
+
+static void emit(vector<unsigned char> &c, int n, const unsigned char *bytes)
+{
+  c.insert(c.end(), bytes, bytes + n);
+}
+
+static void emit32(vector<unsigned char> &c, int value)
+{
+  for(int i = 0; i < 4; i++)
+    c.push_back((value >> (8 * i)) & 0xff);
+}
+
+/* op [rbx + 4*address] - every memory operand in RAL is a direct address */
+static void emitMemory(vector<unsigned char> &c, int n,
+    const unsigned char *opcode, int address)
+{
+  emit(c, n, opcode);
+  emit32(c, address * 4);
+}
+
+/* Emit a jump's opcode and leave its rel32 to be patched */
+static void emitJump(vector<unsigned char> &c, vector<JITPatch> &patches,
+    int n, const unsigned char *opcode, int line)
+{
+  emit(c, n, opcode);
+  JITPatch p = { (int) c.size(), line };
+  patches.push_back(p);
+  emit32(c, 0);
+}
+
+RALJIT::RALJIT(RALProgram *program, int memorySize)
+{
+  program_ = program;
+  memory_ = program->getMemoryImage();
+
+  if(memory_.size() < memorySize)
+    memory_.resize(memorySize, 0);
+
+  code_ = NULL;
+  codeSize_ = 0;
+}
+
+RALJIT::~RALJIT()
+{
+#ifdef RALJIT_X86_64
+  if(code_ != NULL)
+    munmap(code_, codeSize_);
+#endif
+}
+
+bool RALJIT::isSupported()
+{
+#ifdef RALJIT_X86_64
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool RALJIT::compile()
+{
+#ifdef RALJIT_X86_64
+  static const unsigned char prologue[] = {
+    0x53,                   /* push rbx */
+    0x41, 0x54,             /* push r12 */
+    0x41, 0x55,             /* push r13 */
+    0x48, 0x89, 0xfb,       /* mov rbx, rdi */
+    0x49, 0x89, 0xf4,       /* mov r12, rsi */
+    0x41, 0x89, 0xd5,       /* mov r13d, edx */
+    0x31, 0xc0              /* xor eax, eax */
+  };
+  static const unsigned char lda[] = { 0x8b, 0x83 };         /* mov eax, m */
+  static const unsigned char sta[] = { 0x89, 0x83 };         /* mov m, eax */
+  static const unsigned char add[] = { 0x03, 0x83 };         /* add eax, m */
+  static const unsigned char sub[] = { 0x2b, 0x83 };         /* sub eax, m */
+  static const unsigned char mul[] = { 0x0f, 0xaf, 0x83 };   /* imul eax, m */
+  static const unsigned char ldecx[] = { 0x8b, 0x8b };       /* mov ecx, m */
+  static const unsigned char cmpsize[] = { 0x44, 0x39, 0xe9 }; /* cmp ecx, r13d */
+  static const unsigned char cmpimm[] = { 0x81, 0xf9 };      /* cmp ecx, imm */
+  static const unsigned char addimm[] = { 0x81, 0xc1 };      /* add ecx, imm */
+  static const unsigned char jae[] = { 0x0f, 0x83 };
+  static const unsigned char ldi[] = { 0x8b, 0x04, 0x8b };   /* mov eax, [rbx+4rcx] */
+  static const unsigned char sti[] = { 0x89, 0x04, 0x8b };   /* mov [rbx+4rcx], eax */
+  static const unsigned char test[] = { 0x85, 0xc0 };        /* test eax, eax */
+  static const unsigned char jmp[] = { 0xe9 };
+  static const unsigned char jz[] = { 0x0f, 0x84 };
+  static const unsigned char js[] = { 0x0f, 0x88 };
+  static const unsigned char ja[] = { 0x41, 0xff, 0x24, 0xcc }; /* jmp [r12+8rcx] */
+  static const unsigned char ja_[] = { 0x0f, 0x87 };
+  static const unsigned char leaedx[] = { 0x8d, 0x91 };      /* lea edx, [rcx+d] */
+  static const unsigned char cmpedx[] = { 0x44, 0x39, 0xea }; /* cmp edx, r13d */
+  static const unsigned char stedx[] = { 0x89, 0x93 };       /* mov m, edx */
+  static const unsigned char ldedx[] = { 0x8b, 0x93 };       /* mov edx, m */
+  static const unsigned char stecx[] = { 0x89, 0x8b };       /* mov m, ecx */
+  static const unsigned char stlink[] = { 0x89, 0x54, 0x8b }; /* mov [rbx+4rcx+d], edx */
+  static const unsigned char stline[] = { 0xc7, 0x44, 0x8b }; /* mov [rbx+4rcx+d], imm */
+  static const unsigned char ldlink[] = { 0x8b, 0x54, 0x8b }; /* mov edx, [rbx+4rcx+d] */
+  static const unsigned char ldline[] = { 0x8b, 0x4c, 0x8b }; /* mov ecx, [rbx+4rcx+d] */
+  static const unsigned char halt[] = { 0x31, 0xc0 };        /* xor eax, eax */
+  static const unsigned char epilogue[] = {
+    0x41, 0x5d,             /* pop r13 */
+    0x41, 0x5c,             /* pop r12 */
+    0x5b,                   /* pop rbx */
+    0xc3                    /* ret */
+  };
+  static const unsigned char fault[] = { 0xb8, 0x01, 0x00, 0x00, 0x00 };
+
+  if(code_ != NULL)
+    return true;
+
+  const RALCode &code = program_->getCode();
+  int n = code.size(), size = memory_.size();
+  int fp = program_->getFramePointer()->address;
+  int sp = program_->getStackPointer()->address;
+
+  vector<unsigned char> c;
+  vector<JITPatch> patches;
+  vector<int> lineOffset(n + 1, 0);
+
+  emit(c, sizeof(prologue), prologue);
+
+  for(int i = 0; i < n; i++)
+  {
+    RALInstruction instruction = code.getInstruction(i);
+    int address = 0, line = 0;
+
+    lineOffset[i + 1] = c.size();
+
+    switch(instruction)
+    {
+      case JMP:
+      case JMZ:
+      case JMN:
+      case CALL:
+        line = code.getOperand(i);
+        if(line == n + 1)
+          line = HALT_TARGET;
+        else if(line < 1 || line > n)
+          line = FAULT_TARGET;
+        break;
+      case HLT:
+      case RET:
+        break;
+      case LDF:
+      case STF:
+        address = code.getOperand(i);
+        break;
+      default:
+        address = code.getOperand(i);
+        if(address < 0 || address >= size)
+          return false;
+    }
+
+    switch(instruction)
+    {
+      case LDA:
+        emitMemory(c, sizeof(lda), lda, address);
+        break;
+      case STA:
+        emitMemory(c, sizeof(sta), sta, address);
+        break;
+      case ADD:
+        emitMemory(c, sizeof(add), add, address);
+        break;
+      case SUB:
+        emitMemory(c, sizeof(sub), sub, address);
+        break;
+      case MUL:
+        emitMemory(c, sizeof(mul), mul, address);
+        break;
+      case LDI:
+        emitMemory(c, sizeof(ldecx), ldecx, address);
+        emit(c, sizeof(cmpsize), cmpsize);
+        emitJump(c, patches, sizeof(jae), jae, FAULT_TARGET);
+        emit(c, sizeof(ldi), ldi);
+        break;
+      case STI:
+        emitMemory(c, sizeof(ldecx), ldecx, address);
+        emit(c, sizeof(cmpsize), cmpsize);
+        emitJump(c, patches, sizeof(jae), jae, FAULT_TARGET);
+        emit(c, sizeof(sti), sti);
+        break;
+      case JMP:
+        emitJump(c, patches, sizeof(jmp), jmp, line);
+        break;
+      case JMZ:
+        emit(c, sizeof(test), test);
+        emitJump(c, patches, sizeof(jz), jz, line);
+        break;
+      case JMN:
+        emit(c, sizeof(test), test);
+        emitJump(c, patches, sizeof(js), js, line);
+        break;
+      case JA:
+        /* Unsigned compare, so negative lines fault too; line 0 is in the
+         * table but points at the fault stub */
+        emitMemory(c, sizeof(ldecx), ldecx, address);
+        emit(c, sizeof(cmpimm), cmpimm);
+        emit32(c, n + 1);
+        emitJump(c, patches, sizeof(jae), jae, FAULT_TARGET);
+        emit(c, sizeof(ja), ja);
+        break;
+      case HLT:
+        emitJump(c, patches, sizeof(jmp), jmp, HALT_TARGET);
+        break;
+      case LDF:
+      case STF:
+        /* ecx = M[fp] + offset, then it's just like LDI/STI */
+        emitMemory(c, sizeof(ldecx), ldecx, fp);
+        emit(c, sizeof(addimm), addimm);
+        emit32(c, address);
+        emit(c, sizeof(cmpsize), cmpsize);
+        emitJump(c, patches, sizeof(jae), jae, FAULT_TARGET);
+        if(instruction == LDF)
+          emit(c, sizeof(ldi), ldi);
+        else
+          emit(c, sizeof(sti), sti);
+        break;
+      case CALL:
+        /* ecx = sp, and the new frame's last word (the new sp) has to fit */
+        emitMemory(c, sizeof(ldecx), ldecx, sp);
+        emit(c, sizeof(cmpsize), cmpsize);
+        emitJump(c, patches, sizeof(jae), jae, FAULT_TARGET);
+        emit(c, sizeof(leaedx), leaedx);
+        emit32(c, LINKAGE_SIZE + code.getFrameSize(i));
+        emit(c, sizeof(cmpedx), cmpedx);
+        emitJump(c, patches, sizeof(jae), jae, FAULT_TARGET);
+        emitMemory(c, sizeof(stedx), stedx, sp);
+        /* Linkage: the caller's fp, then the line after this one */
+        emitMemory(c, sizeof(ldedx), ldedx, fp);
+        emit(c, sizeof(stlink), stlink);
+        c.push_back(4 * 1);
+        emit(c, sizeof(stline), stline);
+        c.push_back(4 * 2);
+        emit32(c, i + 2);
+        emit(c, sizeof(addimm), addimm);
+        emit32(c, 1 + LINKAGE_SIZE);
+        emitMemory(c, sizeof(stecx), stecx, fp);
+        emitJump(c, patches, sizeof(jmp), jmp, line);
+        break;
+      case RET:
+        /* ecx = fp, which has to have the linkage below it; sp goes back
+         * to just under the linkage */
+        emitMemory(c, sizeof(ldecx), ldecx, fp);
+        emit(c, sizeof(leaedx), leaedx);
+        emit32(c, -(1 + LINKAGE_SIZE));
+        emit(c, sizeof(cmpedx), cmpedx);
+        emitJump(c, patches, sizeof(jae), jae, FAULT_TARGET);
+        emit(c, sizeof(cmpsize), cmpsize);
+        emitJump(c, patches, sizeof(ja_), ja_, FAULT_TARGET);
+        emitMemory(c, sizeof(stedx), stedx, sp);
+        emit(c, sizeof(ldlink), ldlink);
+        c.push_back(-4 * 2);
+        emitMemory(c, sizeof(stedx), stedx, fp);
+        /* and then it's a JA to the return line */
+        emit(c, sizeof(ldline), ldline);
+        c.push_back(-4 * 1);
+        emit(c, sizeof(cmpimm), cmpimm);
+        emit32(c, n + 1);
+        emitJump(c, patches, sizeof(jae), jae, FAULT_TARGET);
+        emit(c, sizeof(ja), ja);
+        break;
+    }
+  }
+
+  /* Running off the end lands on the halt stub, same as the interpreter */
+  int haltOffset = c.size();
+  emit(c, sizeof(halt), halt);
+  int epilogueOffset = c.size();
+  emit(c, sizeof(epilogue), epilogue);
+  int faultOffset = c.size();
+  emit(c, sizeof(fault), fault);
+  emit(c, sizeof(jmp), jmp);
+  emit32(c, epilogueOffset - (int) (c.size() + 4));
+
+  vector<JITPatch>::iterator it;
+  for(it = patches.begin(); it != patches.end(); it++)
+  {
+    int target;
+    if(it->line == HALT_TARGET)
+      target = haltOffset;
+    else if(it->line == FAULT_TARGET)
+      target = faultOffset;
+    else
+      target = lineOffset[it->line];
+
+    int rel = target - (it->at + 4);
+    memcpy(&c[it->at], &rel, 4);
+  }
+
+  /* Map it writable, copy the code in, then flip it to executable */
+  codeSize_ = c.size();
+  void *buffer = mmap(NULL, codeSize_, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANON, -1, 0);
+  if(buffer == MAP_FAILED)
+    return false;
+
+  memcpy(buffer, &c[0], codeSize_);
+  if(mprotect(buffer, codeSize_, PROT_READ | PROT_EXEC) != 0)
+  {
+    munmap(buffer, codeSize_);
+    return false;
+  }
+  code_ = (unsigned char *) buffer;
+
+  jumpTable_.resize(n + 1);
+  jumpTable_[0] = code_ + faultOffset;
+  for(int i = 1; i <= n; i++)
+    jumpTable_[i] = code_ + lineOffset[i];
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+RALStatus RALJIT::run()
+{
+  if(!compile())
+  {
+    RALInterpreter interpreter(program_, memory_.size());
+    RALStatus status = interpreter.run();
+    memory_ = interpreter.getMemory();
+    return status;
+  }
+
+  RALEntry entry = (RALEntry) code_;
+  if(entry(&memory_[0], &jumpTable_[0], memory_.size()) != 0)
+    return FAULTED;
+
+  return HALTED;
+}
@@ -0,0 +1,42 @@
+#ifndef __RALJIT_H__
+#define __RALJIT_H__
+/*
+ * file:  raljit.h
+ *
+ * Description: Declarations for the in-process x86-64 JIT for linked RAL
+ * programs
+ */
+#include <vector>
+#include "programext.h"
+#include "ralprogram.h"
+#include "ralinterpreter.h"
+
+using namespace std;
+
+class RALJIT
+{
+public:
+  RALJIT(RALProgram *program, int memorySize = DEFAULT_MEMORY_SIZE);
+  ~RALJIT();
+
+  /* False when we're not on x86-64 or the program can't be translated;
+   * run() then quietly falls back on the interpreter */
+  static bool isSupported();
+  bool compile();
+
+  RALStatus run();
+
+  vector<int> &getMemory() { return memory_; };
+
+private:
+  RALProgram *program_;
+  vector<int> memory_;
+
+  /* The mmap'd code and the JA jump table: one native address per line,
+   * with line 0 pointing at the fault stub */
+  unsigned char *code_;
+  size_t codeSize_;
+  vector<void*> jumpTable_;
+};
+
+#endif
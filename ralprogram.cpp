@@ -8,23 +8,29 @@
  * Modified: 3/05/08
  * Added function support
  */
+#include <algorithm>
 #include <list>
+#include <set>
 #include "programext.h"
 #include "ralprogram.h"
 
 using namespace std;
 
-/* Every statement is going to have its own unique Label...
- * this is irrelevant and essentially unordered until we link */
+/* A statement only gets a Label once something needs to refer to it...
+ * which is irrelevant and essentially unordered until we link */
 RALStmt::RALStmt()
 {
-  label_ = new Label();
+  label_ = NULL;
+  argument_ = NULL;
+  immediate_ = 0;
 }
 
 RALStmt::RALStmt(RALInstruction instruction)
 {
-  label_ = new Label();
+  label_ = NULL;
   setInstruction(instruction);
+  argument_ = NULL;
+  immediate_ = 0;
 }
 
 /* we're using (void*) for the argument because jump statements will address
@@ -33,9 +39,10 @@ RALStmt::RALStmt(RALInstruction instruction)
  * which will it be. */
 RALStmt::RALStmt(RALInstruction instruction, void *argument)
 {
-  label_ = new Label();
+  label_ = NULL;
   setInstruction(instruction);
   setArgument(argument);
+  immediate_ = 0;
 }
 
 RALStmt::~RALStmt()
@@ -45,6 +52,9 @@ RALStmt::~RALStmt()
 
 Label *RALStmt::getLabel()
 {
+  if(label_ == NULL)
+    label_ = new Label();
+
   return label_;
 }
 
@@ -68,111 +78,640 @@ void RALStmt::setArgument(void *argument)
   argument_ = argument;
 }
 
-void RALStmt::output()
+void RALCode::append(RALInstruction instruction, unsigned operand)
+{
+  opcodes_.push_back(instruction);
+  operands_.push_back(operand);
+}
+
+int RALCode::getFrameSize(int index) const
+{
+  map<int, int>::const_iterator it = frameSizes_.find(index);
+  if(it == frameSizes_.end())
+    return 0;
+
+  return it->second;
+}
+
+void RALCode::output() const
 {
-  switch(instruction_)
+  static const char *names[] = {
+    "LDA", "LDI", "STA", "STI", "ADD", "SUB", "MUL", "JMP", "JMZ", "JMN",
+    "JA", "HLT", "LDF", "STF", "CALL", "RET"
+  };
+
+  for(int i = 0; i < size(); i++)
   {
-    case LDA:
-      cout << "LDA ";
-      cout << ((MemoryLocation*)argument_)->address;
-      break;
-    case LDI:
-      cout << "LDI ";
-      cout << ((MemoryLocation*)argument_)->address;
-      break;
-    case STA:
-      cout << "STA ";
-      cout << ((MemoryLocation*)argument_)->address;
-      break;
-    case STI:
-      cout << "STI ";
-      cout << ((MemoryLocation*)argument_)->address;
-      break;
-    case ADD:
-      cout << "ADD ";
-      cout << ((MemoryLocation*)argument_)->address;
-      break;
-    case SUB:
-      cout << "SUB ";
-      cout << ((MemoryLocation*)argument_)->address;
-      break;
-    case MUL:
-      cout << "MUL ";
-      cout << ((MemoryLocation*)argument_)->address;
-      break;
-    case JMP:
-      cout << "JMP ";
-      cout << ((Label*)argument_)->line;
-      break;
-    case JMZ:
-      cout << "JMZ ";
-      cout << ((Label*)argument_)->line;
-      break;
-    case JMN:
-      cout << "JMN ";
-      cout << ((Label*)argument_)->line;
-      break;
-    case JA:
-      cout << "JA ";
-      cout << ((MemoryLocation*)argument_)->address;
-      break;
-    case HLT:
-      cout << "HLT";
-      break;
+    RALInstruction instruction = getInstruction(i);
+    cout << names[instruction];
+
+    switch(instruction)
+    {
+      case HLT:
+      case RET:
+        break;
+      case CALL:
+        cout << " " << operands_[i] << " " << getFrameSize(i);
+        break;
+      default:
+        cout << " " << operands_[i];
+    }
+
+    cout << endl;
   }
+}
 
-  cout << endl;
+RALStmtList::~RALStmtList()
+{
+  list<RALStmt*>::iterator it;
+  for(it = SL_.begin(); it != SL_.end(); it++)
+    delete *it;
 }
 
 void RALStmtList::append(RALStmt *S)
 {
+  if(S == NULL)
+    return;
+
   SL_.push_back(S);
+
+  RALInstruction i = S->getInstruction();
+  if((i == JMP || i == JMZ || i == JMN) && S->getArgument() == NULL)
+    pending_.push_back(S);
 }
 
 void RALStmtList::append(RALStmtList *L)
 {
-  SL_.insert(SL_.end(), L->SL_.begin(), L->SL_.end());
+  if(L == NULL)
+    return;
+
+  SL_.splice(SL_.end(), L->SL_);
+  pending_.splice(pending_.end(), L->pending_);
+  delete L;
 }
 
 void RALStmtList::replaceNULLsWith(Label *label)
 {
-  vector<RALStmt*>::iterator it;
-  for(it = SL_.begin(); it != SL_.end(); it++)
-  {
+  /* A jump may have been given its target since it was appended */
+  list<RALStmt*>::iterator it;
+  for(it = pending_.begin(); it != pending_.end(); it++)
     if((*it)->getArgument() == NULL)
       (*it)->setArgument(label);
+
+  pending_.clear();
+}
+
+static bool isJump(RALStmt *stmt)
+{
+  RALInstruction i = stmt->getInstruction();
+  return i == JMP || i == JMZ || i == JMN;
+}
+
+/* Control never falls through these to the next line */
+static bool isUnconditional(RALStmt *stmt)
+{
+  RALInstruction i = stmt->getInstruction();
+  return i == JMP || i == JA || i == RET || i == HLT;
+}
+
+/* Follows a chain of JMPs from target to where it finally goes, and notes
+ * that in resolved for every label on the way, so that a label is looked up
+ * once however many jumps lead through it. A chain that runs into a cycle
+ * ends where it joins the cycle. */
+static Label *resolveJumps(Label *target,
+                           const map<Label*, RALStmt*> &owner,
+                           map<Label*, Label*> &resolved)
+{
+  vector<Label*> path;
+  set<Label*> seen;
+
+  while(true)
+  {
+    map<Label*, Label*>::iterator r = resolved.find(target);
+    if(r != resolved.end())
+    {
+      target = r->second;
+      break;
+    }
+
+    map<Label*, RALStmt*>::const_iterator o = owner.find(target);
+    if(o == owner.end() || o->second->getInstruction() != JMP ||
+        !seen.insert(target).second)
+      break;
+
+    path.push_back(target);
+    target = (Label*)o->second->getArgument();
+  }
+
+  for(int i = 0; i < path.size(); i++)
+    resolved[path[i]] = target;
+  return target;
+}
+
+/* Codegen patches the jumps at the end of an if or a while to wherever the
+ * next statement starts, which is often a JMP, or the very next line, and
+ * tests the sign of constant conditions at run time. So, until nothing
+ * changes:
+ *   - a jump to a JMP goes straight to where that one goes
+ *   - a JMN or JMZ right after a constant is loaded either always jumps,
+ *     and becomes a JMP, or never does, and goes
+ *   - lines after an unconditional jump that nothing jumps to go, which
+ *     takes any procedure that's never called with them
+ *   - a jump to the very next line goes
+ * Return addresses in the constant pool count as jumps. A line that goes
+ * hands its label on to the line after it, and nothing is deleted until
+ * the end so that a label's address stays its own. */
+void RALStmtList::simplifyJumps(ConstantPool &constants)
+{
+  vector<RALStmt*> dead;
+  list<RALStmt*>::iterator it;
+  vector<MemoryLocation*>::iterator ct;
+
+  for(bool changed = true; changed; )
+  {
+    changed = false;
+
+    map<Label*, RALStmt*> owner;
+    for(it = SL_.begin(); it != SL_.end(); it++)
+      if((*it)->hasLabel())
+        owner[(*it)->getLabel()] = *it;
+
+    map<Label*, Label*> resolved;
+    for(it = SL_.begin(); it != SL_.end(); it++)
+    {
+      if(!isJump(*it))
+        continue;
+
+      Label *target = resolveJumps((Label*)(*it)->getArgument(), owner,
+                                   resolved);
+      if(target != (*it)->getArgument())
+      {
+        (*it)->setArgument(target);
+        changed = true;
+      }
+    }
+
+    set<Label*> targets;
+    for(it = SL_.begin(); it != SL_.end(); it++)
+      if(isJump(*it) || (*it)->getInstruction() == CALL)
+        targets.insert((Label*)(*it)->getArgument());
+    for(ct = constants.locations.begin(); ct != constants.locations.end();
+        ct++)
+      if((*ct)->type == RETURN_ADDRESS)
+        targets.insert((*ct)->label);
+
+    /* What the accumulator holds, as far as straight-line code can tell,
+     * and whether each line can be reached at all */
+    set<RALStmt*> dropped;
+    bool known = false, reachable = true;
+    int value = 0;
+
+    for(it = SL_.begin(); it != SL_.end(); it++)
+    {
+      RALStmt *stmt = *it;
+      if(stmt->hasLabel() && targets.count(stmt->getLabel()))
+      {
+        known = false;
+        reachable = true;
+      }
+
+      if(!reachable)
+      {
+        dropped.insert(stmt);
+        continue;
+      }
+
+      MemoryLocation *argument = (MemoryLocation*)stmt->getArgument();
+      switch(stmt->getInstruction())
+      {
+        case LDA:
+          known = argument->type == CONST;
+          value = known ? argument->value : 0;
+          break;
+        case JMN:
+        case JMZ:
+          if(!known)
+            break;
+          if(stmt->getInstruction() == JMN ? value < 0 : value == 0)
+            stmt->setInstruction(JMP);
+          else
+            dropped.insert(stmt);
+          changed = true;
+          break;
+        case STA:
+        case STI:
+        case STF:
+        case JMP:
+          break;
+        default:
+          known = false;
+      }
+
+      if(isUnconditional(stmt))
+        reachable = false;
+    }
+
+    /* Backwards, so the next line kept is always known */
+    map<Label*, Label*> forward;
+    RALStmt *next = NULL;
+    list<RALStmt*>::iterator rt = SL_.end();
+    while(rt != SL_.begin())
+    {
+      rt--;
+      RALStmt *stmt = *rt;
+
+      bool drop = dropped.count(stmt) > 0;
+      if(!drop && isJump(stmt) && next != NULL && next->hasLabel() &&
+          stmt->getArgument() == next->getLabel())
+        drop = true;
+
+      if(!drop)
+      {
+        next = stmt;
+        continue;
+      }
+
+      /* Nothing past the end to hand a label on to */
+      if(stmt->hasLabel() && targets.count(stmt->getLabel()))
+      {
+        if(next == NULL)
+        {
+          next = stmt;
+          continue;
+        }
+        forward[stmt->getLabel()] = next->getLabel();
+      }
+
+      dead.push_back(stmt);
+      rt = SL_.erase(rt);
+      changed = true;
+    }
+
+    if(forward.empty())
+      continue;
+
+    for(it = SL_.begin(); it != SL_.end(); it++)
+    {
+      if(!isJump(*it) && (*it)->getInstruction() != CALL)
+        continue;
+
+      Label *target = (Label*)(*it)->getArgument();
+      while(forward.count(target))
+        target = forward[target];
+      (*it)->setArgument(target);
+    }
+
+    for(ct = constants.locations.begin(); ct != constants.locations.end();
+        ct++)
+      if((*ct)->type == RETURN_ADDRESS)
+        while(forward.count((*ct)->label))
+          (*ct)->label = forward[(*ct)->label];
+  }
+
+  /* The pending jumps are all patched by now */
+  pending_.clear();
+
+  for(int i = 0; i < dead.size(); i++)
+    delete dead[i];
+}
+
+/* Outlined sequences run from OUTLINE_MIN_LENGTH to OUTLINE_MAX_LENGTH
+ * lines; nothing shorter can pay for its call sites */
+const int OUTLINE_MIN_LENGTH = 5;
+const int OUTLINE_MAX_LENGTH = 32;
+/* What each call site has to save to make up for its extra jumps */
+const int OUTLINE_SAVING_PER_SITE = 1;
+
+/* A run of lines that appears more than once, at positions that don't
+ * overlap */
+struct OutlineCandidate
+{
+  int length;
+  vector<int> positions;
+  int saved;
+};
+
+typedef struct OutlineCandidate OutlineCandidate;
+
+/* Biggest saving first, then the longest */
+static bool bySaving(const OutlineCandidate &a, const OutlineCandidate &b)
+{
+  if(a.saved != b.saved)
+    return a.saved > b.saved;
+  return a.length > b.length;
+}
+
+/* Replacing n copies of length lines with a call each costs LDA/STA/JMP
+ * per site, plus the one copy left and its JA back */
+static int outlineSaving(int length, int n)
+{
+  return n * length - (3 * n + length + 1);
+}
+
+static bool isWorthOutlining(int length, int n)
+{
+  return n >= 2 && outlineSaving(length, n) >= n * OUTLINE_SAVING_PER_SITE;
+}
+
+/* Every call site loads its return address and stores it where the
+ * subroutine's JA will find it, so only a run that loads the accumulator
+ * before it reads it can be outlined */
+static bool loadsAccumulator(RALStmt *stmt)
+{
+  RALInstruction i = stmt->getInstruction();
+  return i == LDA || i == LDI || i == LDF;
+}
+
+/* Opcode and what the operand holds: two lines with the same key do the
+ * same thing. A constant is known by its value, so the same offset in two
+ * different frames looks the same; anything else is known by its address. */
+static unsigned long long outlineKey(RALStmt *stmt,
+                                     const set<MemoryLocation*> &readOnly)
+{
+  MemoryLocation *loc = (MemoryLocation*)stmt->getArgument();
+  unsigned long long kind = 0, operand = loc->address;
+
+  if(readOnly.count(loc))
+  {
+    kind = 1;
+    operand = loc->type == CONST ? loc->value : loc->location->address;
   }
+
+  return ((unsigned long long)stmt->getInstruction() << 40) |
+         (kind << 32) | (unsigned)operand;
+}
+
+/* Codegen says the same things over and over: every LDO and STO is the
+ * same few lines, and so is most of every calling sequence. With every
+ * address known, runs of straight-line code that turn up more than once
+ * are found by hashing every window of each length, and the ones that
+ * save the most are each kept once at the end of the program, as a
+ * subroutine. Each copy becomes
+ *   LDA <the line after it>; STA <the subroutine's link>; JMP <subroutine>
+ * and the subroutine ends in a JA through the link, the same way a classic
+ * call returns. Nothing is outlined unless every call site saves at least
+ * OUTLINE_SAVING_PER_SITE lines over the jumps it adds. Runs can't hold a
+ * jump or have one land in the middle, and the accumulator has to be dead
+ * at the start of one, which loading it first takes care of. */
+void RALStmtList::outline(ConstantPool &constants)
+{
+  vector<RALStmt*> lines(SL_.begin(), SL_.end());
+  int n = lines.size();
+
+  set<Label*> targets;
+  set<MemoryLocation*> readOnly;
+  vector<MemoryLocation*>::iterator ct;
+  for(ct = constants.locations.begin(); ct != constants.locations.end();
+      ct++)
+    if((*ct)->type == RETURN_ADDRESS)
+      targets.insert((*ct)->label);
+    else if((*ct)->type == CONST || (*ct)->type == POINTER)
+      readOnly.insert(*ct);
+
+  vector<bool> control(n, false);
+  for(int i = 0; i < n; i++)
+  {
+    RALInstruction instruction = lines[i]->getInstruction();
+    control[i] = isJump(lines[i]) || isUnconditional(lines[i]) ||
+                 instruction == CALL;
+    if(isJump(lines[i]) || instruction == CALL)
+      targets.insert((Label*)lines[i]->getArgument());
+  }
+
+  /* How long a run can get from each line, keeping a line after it for
+   * the call to come back to */
+  vector<unsigned long long> keys(n, 0);
+  vector<int> longest(n, 0);
+  for(int i = 0; i < n; i++)
+    if(!control[i])
+      keys[i] = outlineKey(lines[i], readOnly);
+
+  for(int i = 0; i < n; i++)
+  {
+    if(!loadsAccumulator(lines[i]))
+      continue;
+
+    int j = i;
+    while(j < n - 1 && j - i < OUTLINE_MAX_LENGTH && !control[j] &&
+          (j == i || !lines[j]->hasLabel() ||
+           !targets.count(lines[j]->getLabel())))
+      j++;
+    longest[i] = j - i;
+  }
+
+  /* hash[i] covers lines [0, i), so a window's hash comes out of two */
+  const unsigned long long BASE = 1000003;
+  vector<unsigned long long> hash(n + 1, 0), power(OUTLINE_MAX_LENGTH + 1, 1);
+  for(int i = 0; i < n; i++)
+    hash[i + 1] = hash[i] * BASE + keys[i] * 0x9e3779b97f4a7c15ULL + 1;
+  for(int l = 1; l <= OUTLINE_MAX_LENGTH; l++)
+    power[l] = power[l - 1] * BASE;
+
+  vector<OutlineCandidate> candidates;
+  for(int length = OUTLINE_MIN_LENGTH; length <= OUTLINE_MAX_LENGTH; length++)
+  {
+    map<unsigned long long, vector<int> > windows;
+    for(int i = 0; i < n; i++)
+      if(longest[i] >= length)
+        windows[hash[i + length] - hash[i] * power[length]].push_back(i);
+
+    map<unsigned long long, vector<int> >::iterator wt;
+    for(wt = windows.begin(); wt != windows.end(); wt++)
+    {
+      vector<int> &found = wt->second;
+      if(found.size() < 2)
+        continue;
+
+      /* Overlapping copies can't both go, and the hash could be lying */
+      OutlineCandidate c;
+      c.length = length;
+      int first = found[0], end = -1;
+      for(int k = 0; k < found.size(); k++)
+        if(found[k] >= end &&
+           equal(keys.begin() + first, keys.begin() + first + length,
+                 keys.begin() + found[k]))
+        {
+          c.positions.push_back(found[k]);
+          end = found[k] + length;
+        }
+
+      if(!isWorthOutlining(length, c.positions.size()))
+        continue;
+
+      c.saved = outlineSaving(length, c.positions.size());
+      candidates.push_back(c);
+    }
+  }
+
+  stable_sort(candidates.begin(), candidates.end(), bySaving);
+
+  /* Which run, if any, starts at each line; a line that's in one can't be
+   * in another */
+  vector<bool> taken(n, false);
+  vector<int> outlined(n, -1);
+  vector<OutlineCandidate> chosen;
+  for(int c = 0; c < candidates.size(); c++)
+  {
+    OutlineCandidate &candidate = candidates[c];
+
+    vector<int> positions;
+    for(int k = 0; k < candidate.positions.size(); k++)
+    {
+      int p = candidate.positions[k];
+      if(find(taken.begin() + p, taken.begin() + p + candidate.length, true) ==
+         taken.begin() + p + candidate.length)
+        positions.push_back(p);
+    }
+
+    if(!isWorthOutlining(candidate.length, positions.size()))
+      continue;
+
+    for(int k = 0; k < positions.size(); k++)
+    {
+      fill(taken.begin() + positions[k],
+           taken.begin() + positions[k] + candidate.length, true);
+      outlined[positions[k]] = chosen.size();
+    }
+
+    candidate.positions = positions;
+    chosen.push_back(candidate);
+  }
+
+  if(chosen.empty())
+    return;
+
+  /* The subroutines go at the end, where nothing falls into them */
+  vector<MemoryLocation*> links;
+  vector<RALStmt*> entries;
+  list<RALStmt*> subroutines;
+  for(int c = 0; c < chosen.size(); c++)
+  {
+    MemoryLocation *link = new MemoryLocation();
+    link->type = VARIABLE;
+    link->value = 0;
+    constants.locations.push_back(link);
+    links.push_back(link);
+
+    int first = chosen[c].positions[0];
+    for(int k = 0; k < chosen[c].length; k++)
+    {
+      RALStmt *copy = new RALStmt(lines[first + k]->getInstruction(),
+                                  lines[first + k]->getArgument());
+      if(k == 0)
+        entries.push_back(copy);
+      subroutines.push_back(copy);
+    }
+    subroutines.push_back(new RALStmt(JA, link));
+  }
+
+  /* Each copy keeps its first three lines, and with them any label
+   * something jumps to */
+  SL_.clear();
+  for(int i = 0; i < n; i++)
+  {
+    int c = outlined[i];
+    if(c < 0)
+    {
+      SL_.push_back(lines[i]);
+      continue;
+    }
+
+    int length = chosen[c].length;
+    lines[i]->setInstruction(LDA);
+    lines[i]->setArgument(getConstant(constants, lines[i + length]->getLabel()));
+    lines[i + 1]->setInstruction(STA);
+    lines[i + 1]->setArgument(links[c]);
+    lines[i + 2]->setInstruction(JMP);
+    lines[i + 2]->setArgument(entries[c]->getLabel());
+    SL_.push_back(lines[i]);
+    SL_.push_back(lines[i + 1]);
+    SL_.push_back(lines[i + 2]);
+
+    for(int k = 3; k < length; k++)
+      delete lines[i + k];
+    i += length - 1;
+  }
+
+  SL_.splice(SL_.end(), subroutines);
 }
 
 void RALStmtList::assignLineNumbers()
 {
-  int i;
-  for(i = 0; i < SL_.size(); i++)
-    /* remember it's (i+1) because lines start at 1 in RAL */
-    SL_[i]->getLabel()->line = i + 1;
+  /* remember it starts at 1 because lines start at 1 in RAL */
+  int i = 1;
+  list<RALStmt*>::iterator it;
+  for(it = SL_.begin(); it != SL_.end(); it++, i++)
+    if((*it)->hasLabel())
+      (*it)->getLabel()->line = i;
 }
 
-void RALStmtList::output()
+void RALStmtList::encode(RALCode &code, ConstantPool &constants)
 {
-  vector<RALStmt*>::iterator it;
+  list<RALStmt*>::iterator it;
   for(it = SL_.begin(); it != SL_.end(); it++)
-    (*it)->output();
+  {
+    RALInstruction instruction = (*it)->getInstruction();
+    switch(instruction)
+    {
+      case JMP:
+      case JMZ:
+      case JMN:
+        code.append(instruction, ((Label*)(*it)->getArgument())->line);
+        break;
+      case CALL:
+        code.setFrameSize(code.size(), (*it)->getImmediate());
+        code.append(instruction, ((Label*)(*it)->getArgument())->line);
+        break;
+      case HLT:
+      case RET:
+        code.append(instruction, 0);
+        break;
+      default:
+        code.append(instruction,
+            ((MemoryLocation*)(*it)->getArgument())->address);
+    }
+  }
+
+  /* The labels go with the statements, so the pool can't look them up by
+   * label any more either */
+  vector<MemoryLocation*>::iterator ct;
+  for(ct = constants.locations.begin(); ct != constants.locations.end(); ct++)
+    if((*ct)->type == RETURN_ADDRESS)
+      (*ct)->value = (*ct)->label->line;
+  constants.labels.clear();
 }
 
 void RALStmtList::peepholeOptimize()
 {
-  vector<RALStmt*>::iterator it;
-  for(it = SL_.begin() + 1; it != SL_.end(); it++)
+  if(SL_.empty())
+    return;
+
+  list<RALStmt*>::iterator it = SL_.begin(), prev = it++;
+  while(it != SL_.end())
   {
-    vector<RALStmt*>::iterator prev = it - 1;
+    /* A load somebody jumps to has to stay */
     if((*it)->getInstruction() == LDA && (*prev)->getInstruction() == STA &&
-        (*it)->getArgument() == (*prev)->getArgument())
-      SL_.erase(it);
+        (*it)->getArgument() == (*prev)->getArgument() && !(*it)->hasLabel())
+    {
+      delete *it;
+      it = SL_.erase(it);
+    }
+    else
+      prev = it++;
   }
 }
 
+/* With the extended instruction set a load off the current frame pointer
+ * is a single LDF, and the offset goes in as-is rather than as a constant */
 LDO::LDO(MemoryLocation *fp, MemoryLocation *offset, Env &e)
 {
+  if(e.options.extendedISA && fp == e.fp)
+  {
+    stmtWithOffset = new RALStmt(LDF, offset);
+    SL_.push_back(stmtWithOffset);
+    return;
+  }
+
   SL_.push_back(new RALStmt(LDA, fp));
 
   if(offset != NULL)
@@ -186,18 +725,15 @@ LDO::LDO(MemoryLocation *fp, MemoryLocation *offset, Env &e)
   SL_.push_back(new RALStmt(LDI, e.scratch));
 }
 
-void LDO::setOffset(MemoryLocation *offset, vector<MemoryLocation*> &constants)
-{
-  stmtWithOffset->setArgument(getConstant(constants, offset));
-}
-
-void STO::setOffset(MemoryLocation *offset, vector<MemoryLocation*> &constants)
-{
-  stmtWithOffset->setArgument(getConstant(constants, offset));
-}
-
 STO::STO(MemoryLocation *fp, MemoryLocation *offset, Env &e)
 {
+  if(e.options.extendedISA && fp == e.fp)
+  {
+    stmtWithOffset = new RALStmt(STF, offset);
+    SL_.push_back(stmtWithOffset);
+    return;
+  }
+
   SL_.push_back(new RALStmt(STA, e.scratch2));
   SL_.push_back(new RALStmt(LDA, fp));
 
@@ -213,44 +749,237 @@ STO::STO(MemoryLocation *fp, MemoryLocation *offset, Env &e)
   SL_.push_back(new RALStmt(STI, e.scratch));
 }
 
+void addRelocation(Env &e, RALStmt *stmt, Symbol symbol,
+    RelocationField field, int index)
+{
+  Relocation r;
+  r.stmt = stmt;
+  r.symbol = symbol;
+  r.field = field;
+  r.index = index;
+  e.relocations.push_back(r);
+}
+
+/* Most called first; main always sorts first, since it's entered once
+ * without being called */
+struct ByEntries
+{
+  ByEntries(const Profile *profile) { this->profile = profile; };
+
+  bool operator()(Symbol a, Symbol b) const
+  {
+    if(a == MAIN_SYMBOL || b == MAIN_SYMBOL)
+      return a == MAIN_SYMBOL && b != MAIN_SYMBOL;
+    return profile->getEntries(a) > profile->getEntries(b);
+  };
+
+  const Profile *profile;
+};
+
 RALProgram::RALProgram(Env e)
 {
   e_ = e;
+  e_.relocations.clear();
   SL_ = new RALStmtList();
 
-  /* Store the return address to halt the program, then
-   * Jump to the main function */
-  
+  RALFunction *main = e_.functions[MAIN_SYMBOL];
   RALStmt *hlt = new RALStmt(HLT, NULL);
 
-  SL_->append(
-      new RALStmt(LDA, getConstant(e_.constants, hlt->getLabel()))
-      );
-  STO *sto = new STO(e.fp, NULL, e);
-  SL_->append( sto );
+  if(e_.options.nativeCalls)
+  {
+    /* Push main's frame on top of the constants and call it; it returns
+     * to the HLT */
+    RALStmt *call = new RALStmt(CALL, main->getFirstLabel());
+    call->setImmediate(main->getActivationRecord().size());
+    SL_->append(call);
+  }
+  else
+  {
+    /* Store the return address to halt the program, then
+     * Jump to the main function */
+    SL_->append(
+        new RALStmt(LDA, getConstant(e_.constants, hlt->getLabel()))
+        );
+    STO *sto = new STO(e_.fp, NULL, e_);
+    addRelocation(e_, sto->getStmtWithOffset(), MAIN_SYMBOL,
+                  RETURN_ADDRESS_OFFSET);
+    SL_->append( sto );
 
-  SL_->append(
-      new RALStmt(JMP, e_.functions[""]->getFirstLabel())
-      );
+    SL_->append(
+        new RALStmt(JMP, main->getFirstLabel())
+        );
+  }
 
   SL_->append(hlt);
+  relocations_ = e_.relocations;
   
-  /* Append all the functions */
-  map<string, RALFunction*>::iterator it;
-  for(it = e_.functions.begin(); it != e_.functions.end(); it++)
+  /* Append all the functions: main first, then with a profile the rest
+   * from the most called down, so the hot ones sit together and the ones
+   * that never ran end up at the back */
+  vector<Symbol> functions = e_.functions.keys();
+  if(e_.options.profile != NULL && !e_.options.instrument)
+    stable_sort(functions.begin(), functions.end(),
+                ByEntries(e_.options.profile));
+
+  vector<Symbol>::iterator it;
+  for(it = functions.begin(); it != functions.end(); it++)
   {
-    SL_->append( it->second->getStatementList() );
+    SL_->append( e_.functions[*it]->releaseStatementList() );
   }
 
-  SL_->assignLineNumbers();
+  linked_ = resolve();
+  if(!linked_)
+    return;
 
-  sto->setOffset(e_.functions[""]->ret_addr, e_.constants);
+  SL_->simplifyJumps(e_.constants);
   link();
 
-  e_.fp->value = e_.constants.back()->address + 1;
+  /* Outlining goes by what operands hold, so it needs the addresses; the
+   * words it adds go on the end of the pool, which is laid out again */
+  if(e_.options.outline)
+  {
+    SL_->outline(e_.constants);
+    link();
+  }
+
+  SL_->assignLineNumbers();
+
+  SL_->encode(code_, e_.constants);
+  delete SL_;
+  SL_ = NULL;
+
+  /* Either way main's frame ends up right after the constants (past the
+   * linkage CALL pushes), so that's where the fp starts */
+  if(e_.options.nativeCalls)
+  {
+    e_.sp->value = end_ - 1;
+    e_.fp->value = end_ + LINKAGE_SIZE;
+  }
+  else
+  {
+    e_.fp->value = end_;
+    e_.sp->value = end_ - 1 + main->getActivationRecord().size();
+  }
+}
+
+RALProgram::~RALProgram()
+{
+  delete SL_;
+
+  vector<Symbol> functions = e_.functions.keys();
+  vector<Symbol>::iterator ft;
+  for(ft = functions.begin(); ft != functions.end(); ft++)
+    delete e_.functions[*ft];
+
+  vector<MemoryLocation*>::iterator it;
+  for(it = e_.constants.locations.begin();
+      it != e_.constants.locations.end(); it++)
+    delete *it;
 
-  e_.sp->value = e_.constants.back()->address + 
-                 e_.functions[""]->getActivationRecord().size();
+  delete e_.fp;
+  delete e_.sp;
+  delete e_.scratch;
+  delete e_.scratch2;
+  delete e_.prev_fp;
+}
+
+/* Points an offset operand at loc: LDF/STF take the offset as-is, the ADD
+ * in a classic LDO/STO takes it through a constant */
+static void setOffset(RALStmt *stmt, MemoryLocation *loc,
+    ConstantPool &constants)
+{
+  if(stmt->getInstruction() == LDF || stmt->getInstruction() == STF)
+    stmt->setArgument(loc);
+  else
+    stmt->setArgument(getConstant(constants, loc));
+}
+
+/* Fill in every operand that refers to another function, in one pass over
+ * the relocations of the program and of each function. Any reference we
+ * can't satisfy is reported, and the whole program is then unlinkable. */
+bool RALProgram::resolve()
+{
+  bool ok = true;
+
+  vector<Relocation*> all;
+  vector<Relocation>::iterator rt;
+  for(rt = relocations_.begin(); rt != relocations_.end(); rt++)
+    all.push_back(&*rt);
+
+  vector<Symbol> functions = e_.functions.keys();
+  vector<Symbol>::iterator ft;
+  for(ft = functions.begin(); ft != functions.end(); ft++)
+    for(rt = e_.functions[*ft]->relocations.begin();
+        rt != e_.functions[*ft]->relocations.end(); rt++)
+      all.push_back(&*rt);
+
+  set<Symbol> undefined;
+  vector<Relocation*>::iterator it;
+  for(it = all.begin(); it != all.end(); it++)
+  {
+    Relocation *r = *it;
+
+    RALFunction *target = e_.functions.get(r->symbol);
+    if(target == NULL)
+    {
+      if(undefined.insert(r->symbol).second)
+        cout << "Error:  undefined procedure " << symbolName(r->symbol)
+             << endl;
+      ok = false;
+      continue;
+    }
+
+    switch(r->field)
+    {
+      case ENTRY_LABEL:
+        /* index is the number of arguments at the call site */
+        if(r->index != target->parameters.size())
+        {
+          cout << "Error:  param count does not match for "
+               << symbolName(r->symbol) << endl;
+          ok = false;
+          break;
+        }
+        r->stmt->setArgument(target->getFirstLabel());
+        break;
+      case FRAME_SIZE:
+        if(r->stmt->getInstruction() == CALL)
+          r->stmt->setImmediate(target->getActivationRecord().size());
+        else
+          r->stmt->setArgument(getConstant(e_.constants,
+                target->getActivationRecord().size()));
+        break;
+      case RETURN_VALUE_OFFSET:
+        if(target->ret_value == NULL)
+        {
+          cout << "Error:  no return value in " << symbolName(r->symbol)
+               << endl;
+          ok = false;
+          break;
+        }
+        /* A native call gets its value back in the accumulator, so there
+         * is nothing to patch, just the check above */
+        if(r->stmt->getInstruction() != CALL)
+          setOffset(r->stmt, target->ret_value, e_.constants);
+        break;
+      case PREV_FP_OFFSET:
+        setOffset(r->stmt, target->prev_fp, e_.constants);
+        break;
+      case RETURN_ADDRESS_OFFSET:
+        setOffset(r->stmt, target->ret_addr, e_.constants);
+        break;
+      case PARAMETER_OFFSET:
+        if(r->index < target->parameters.size())
+        {
+          list<MemoryLocation*>::iterator p = target->parameters.begin();
+          advance(p, r->index);
+          setOffset(r->stmt, *p, e_.constants);
+        }
+        break;
+    }
+  }
+
+  return ok;
 }
 
 /* To link the program we need to have all the memory locations assigned 
@@ -265,36 +994,258 @@ void RALProgram::link()
   e_.prev_fp->address = cur_addr++;
 
   vector<MemoryLocation*>::iterator it;
-  for(it = e_.constants.begin(); it != e_.constants.end(); it++)
+  for(it = e_.constants.locations.begin();
+      it != e_.constants.locations.end(); it++)
     (*it)->address = cur_addr++;
+
+  end_ = cur_addr;
 }
 
 void RALProgram::output()
 {
-  SL_->output();
+  code_.output();
 }
 
 void RALProgram::dump()
 {
-  cout << e_.fp->address << " " << e_.fp->value << endl;
-  cout << e_.sp->address << " " << e_.sp->value << endl;
-  cout << e_.scratch->address << " " << e_.scratch->value << endl;
-  cout << e_.scratch2->address << " " << e_.scratch2->value << endl;
-  cout << e_.prev_fp->address << " " << e_.prev_fp->value << endl;
+  vector<int> memory = getMemoryImage();
+
+  for(int address = 1; address < memory.size(); address++)
+    cout << address << " " << memory[address] << endl;
+}
+
+/* The initial memory image: the registers at the bottom, then the constant
+ * pool, where each return address has held its line since encode(). Address
+ * 0 is unused since RAL addresses start at 1. */
+vector<int> RALProgram::getMemoryImage()
+{
+  vector<int> memory(end_, 0);
+
+  memory[e_.fp->address] = e_.fp->value;
+  memory[e_.sp->address] = e_.sp->value;
+  memory[e_.scratch->address] = e_.scratch->value;
+  memory[e_.scratch2->address] = e_.scratch2->value;
+  memory[e_.prev_fp->address] = e_.prev_fp->value;
 
   vector<MemoryLocation*>::iterator it;
-  for(it = e_.constants.begin(); it != e_.constants.end(); it++)
-    if((*it)->type == RETURN_ADDRESS)
-      cout << (*it)->address << " " << (*it)->label->line << endl;
-    else if((*it)->type == CONST)
-      cout << (*it)->address << " " << (*it)->value << endl;
+  for(it = e_.constants.locations.begin();
+      it != e_.constants.locations.end(); it++)
+    if((*it)->type == CONST || (*it)->type == RETURN_ADDRESS)
+      memory[(*it)->address] = (*it)->value;
     else if((*it)->type == POINTER)
-      cout << (*it)->address << " " << (*it)->location->address << endl;
+      memory[(*it)->address] = (*it)->location->address;
+
+  return memory;
+}
+
+static void writeWord(ostream &out, unsigned word)
+{
+  out.write((const char*)&word, sizeof(word));
+}
+
+void RALProgram::writeImage(ostream &out)
+{
+  vector<int> memory = getMemoryImage();
+
+  out.write("RALI", 4);
+  writeWord(out, code_.size());
+  writeWord(out, memory.size());
+
+  for(int i = 0; i < code_.size(); i++)
+  {
+    writeWord(out, code_.getInstruction(i));
+    writeWord(out, code_.getOperand(i));
+    writeWord(out, code_.getFrameSize(i));
+  }
+
+  for(int address = 0; address < memory.size(); address++)
+    writeWord(out, memory[address]);
+}
+
+/* The main function's frame sits right where the initial fp points, so
+ * once the program has halted its variables can be read straight out of
+ * memory */
+void RALProgram::dumpVariables(const vector<int> &memory)
+{
+  RALFunction *main = e_.functions[MAIN_SYMBOL];
+  int fp = e_.fp->value;
+
+  cout << "Name Table" << endl;
+  vector<Symbol> names = main->variables.keys();
+  vector<Symbol>::iterator it;
+  for(it = names.begin(); it != names.end(); it++)
+  {
+    int address = fp + main->variables[*it]->address;
+    cout << symbolName(*it) << " -> ";
+    if(address < memory.size())
+      cout << memory[address] << endl;
+    else
+      cout << "?" << endl;
+  }
+}
+
+int RALProgram::getVariableAddress(Symbol name)
+{
+  RALFunction *main = e_.functions[MAIN_SYMBOL];
+  if(!main->variables.contains(name))
+    return -1;
+
+  return e_.fp->value + main->variables[name]->address;
+}
+
+bool RALProgram::saveProfile(const vector<int> &memory, const char *file)
+{
+  Profile profile;
+
+  vector<ProfileCounter>::iterator it;
+  for(it = e_.counters.begin(); it != e_.counters.end(); it++)
+    profile.addCalls(it->site, it->callee, memory[it->location->address]);
+
+  return profile.save(file);
+}
+
+RALFunction::~RALFunction()
+{
+  delete SL_;
+
+  /* The parameters, variables, temporaries and linkage all appear here
+   * exactly once */
+  vector<MemoryLocation*>::iterator it;
+  for(it = activationRecord_.begin(); it != activationRecord_.end(); it++)
+    delete *it;
+}
+
+RALFunction *RALFunction::clone(const Env &from, Env &to)
+{
+  RALFunction *f = new RALFunction();
+
+  /* Filled in as operands turn up, constants included, so each one is
+   * only looked for in to's pool once */
+  map<MemoryLocation*, MemoryLocation*> locations;
+  locations[from.fp] = to.fp;
+  locations[from.sp] = to.sp;
+  locations[from.scratch] = to.scratch;
+  locations[from.scratch2] = to.scratch2;
+  locations[from.prev_fp] = to.prev_fp;
+
+  /* The frame's already laid out, so the copy keeps the addresses */
+  vector<MemoryLocation*> record;
+  vector<MemoryLocation*>::iterator at;
+  for(at = activationRecord_.begin(); at != activationRecord_.end(); at++)
+  {
+    MemoryLocation *copy = new MemoryLocation(**at);
+    locations[*at] = copy;
+    record.push_back(copy);
+  }
+  f->setActivationRecord(record);
+
+  /* Every statement first, so that jumps forward have a label to go to */
+  const list<RALStmt*> &lines = SL_->getStatements();
+  vector<RALStmt*> copies;
+  copies.reserve(lines.size());
+  map<Label*, Label*> labels;
+  list<RALStmt*>::const_iterator it;
+  for(it = lines.begin(); it != lines.end(); it++)
+  {
+    RALStmt *copy = new RALStmt((*it)->getInstruction());
+    copy->setImmediate((*it)->getImmediate());
+    if((*it)->hasLabel())
+      labels[(*it)->getLabel()] = copy->getLabel();
+    copies.push_back(copy);
+  }
+
+  /* Only the statements relocations point at need finding again */
+  map<RALStmt*, RALStmt*> relocated;
+  vector<Relocation>::iterator rt;
+  for(rt = relocations.begin(); rt != relocations.end(); rt++)
+    relocated[rt->stmt] = NULL;
+
+  /* A NULL operand is waiting on a relocation, and stays that way */
+  RALStmtList *SL = new RALStmtList();
+  int i = 0;
+  for(it = lines.begin(); it != lines.end(); it++, i++)
+  {
+    RALStmt *copy = copies[i];
+    void *argument = (*it)->getArgument();
+
+    switch((*it)->getInstruction())
+    {
+      case JMP:
+      case JMZ:
+      case JMN:
+      case CALL:
+        if(argument != NULL)
+          argument = labels[(Label*)argument];
+        break;
+      case HLT:
+      case RET:
+        break;
+      default:
+      {
+        MemoryLocation *loc = (MemoryLocation*)argument;
+        if(loc == NULL)
+          break;
+
+        map<MemoryLocation*, MemoryLocation*>::iterator lt =
+          locations.find(loc);
+        if(lt != locations.end())
+          argument = lt->second;
+        else
+        {
+          if(loc->type == CONST)
+            argument = getConstant(to.constants, loc->value);
+          else if(loc->type == RETURN_ADDRESS)
+            argument = getConstant(to.constants, labels[loc->label]);
+          else
+            argument = getConstant(to.constants, locations[loc->location]);
+          locations[loc] = (MemoryLocation*)argument;
+        }
+      }
+    }
+
+    copy->setArgument(argument);
+    SL->append(copy);
+
+    map<RALStmt*, RALStmt*>::iterator st = relocated.find(*it);
+    if(st != relocated.end())
+      st->second = copy;
+  }
+  f->setStatementList(SL);
+
+  for(rt = relocations.begin(); rt != relocations.end(); rt++)
+  {
+    Relocation r = *rt;
+    r.stmt = relocated[r.stmt];
+    f->relocations.push_back(r);
+  }
+
+  f->prev_fp = prev_fp == NULL ? NULL : locations[prev_fp];
+  f->ret_addr = ret_addr == NULL ? NULL : locations[ret_addr];
+  f->ret_value = ret_value == NULL ? NULL : locations[ret_value];
+
+  list<MemoryLocation*>::iterator pt;
+  for(pt = parameters.begin(); pt != parameters.end(); pt++)
+    f->parameters.push_back(locations[*pt]);
+
+  vector<Symbol> names = variables.keys();
+  vector<Symbol>::iterator nt;
+  for(nt = names.begin(); nt != names.end(); nt++)
+    f->variables[*nt] = locations[variables.get(*nt)];
+
+  return f;
 }
 
 void RALFunction::setStatementList(RALStmtList *statements)
 {
   SL_ = statements;
+  entry_ = statements->getFirstLabel();
+}
+
+RALStmtList *RALFunction::releaseStatementList()
+{
+  RALStmtList *statements = SL_;
+  SL_ = NULL;
+  return statements;
 }
 
 void RALFunction::link()
@@ -350,6 +1301,6 @@ void RALFunction::output() { };
 
 Label *RALFunction::getFirstLabel()
 {
-  return SL_->getFirstLabel();
+  return entry_;
 }
 
@@ -12,8 +12,12 @@
 #include <iostream>
 #include <string>
 #include <map>
+#include <list>
+#include <set>
 #include <vector>
+#include "symbols.h"
 #include "programext.h"
+#include "profile.h"
 
 using namespace std;
 
@@ -42,24 +46,140 @@ struct MemoryLocation {
 
 typedef struct MemoryLocation MemoryLocation;
 
-enum RALInstruction { LDA, LDI, STA, STI, ADD, SUB, MUL, JMP, JMZ, JMN, JA, HLT };
+/* LDF, STF, CALL and RET are the extended instruction set, only ever
+ * emitted when CompileOptions asks for them; classic RAL is the default.
+ *   LDF k     load M[M[fp] + k]
+ *   STF k     store the accumulator to M[M[fp] + k]
+ *   CALL L n  push a frame of n words and jump to L: the caller's fp and
+ *             the return line go in the LINKAGE_SIZE words just above sp,
+ *             fp points past them and sp at the last word of the new frame
+ *   RET       pop the current frame and jump back to the return line,
+ *             leaving the accumulator alone so it carries the return value */
+enum RALInstruction { LDA, LDI, STA, STI, ADD, SUB, MUL, JMP, JMZ, JMN, JA, HLT,
+                      LDF, STF, CALL, RET };
+
+const int LINKAGE_SIZE = 2;
 
 typedef enum RALInstruction RALInstruction;
 
-typedef struct FunctionGap FunctionGap;
+class ProcCache;
+class CompilePool;
+class Specializer;
+
+/* Knobs for Program::compile */
+struct CompileOptions {
+  CompileOptions()
+    { extendedISA = false; nativeCalls = false; instrument = false;
+      outline = false; specialize = false; profile = NULL; cache = NULL;
+      pool = NULL; };
+
+  /* LDF/STF for frame-relative loads and stores */
+  bool extendedISA;
+  /* CALL/RET instead of the open-coded calling sequence; implies
+   * extendedISA */
+  bool nativeCalls;
+  /* Count the calls each call site makes, for RALProgram::saveProfile */
+  bool instrument;
+  /* Trade a few jumps for less code by outlining repeated sequences */
+  bool outline;
+  /* Give calls that pass constants copies of their callees of their own,
+   * with the constants folded in; ignored when instrumenting */
+  bool specialize;
+  /* Counts from an instrumented run to inline hot calls and lay out
+   * procedures by; ignored when instrumenting */
+  const Profile *profile;
+  /* Procedures compiled before, to reuse rather than compile again, and
+   * to keep what's compiled now in for next time */
+  ProcCache *cache;
+  /* Workers that have been compiling the program's procedures while it
+   * was parsed, to pick those up from */
+  CompilePool *pool;
+};
+
+typedef struct CompileOptions CompileOptions;
+
+class RALStmt;
+
+/* Which part of a callee an unresolved operand is waiting for */
+enum RelocationField
+{
+  ENTRY_LABEL,           /* the target of a JMP or CALL */
+  FRAME_SIZE,            /* CALL's immediate, or an ADD of a constant */
+  RETURN_VALUE_OFFSET,   /* these offsets go into an LDF/STF as-is, or */
+  PREV_FP_OFFSET,        /* into the ADD of a classic LDO/STO through */
+  RETURN_ADDRESS_OFFSET, /* a constant */
+  PARAMETER_OFFSET       /* index says which parameter */
+};
+
+typedef enum RelocationField RelocationField;
+
+/* An operand of stmt that can't be filled in until symbol is defined;
+ * the linker resolves these once everything has been compiled */
+struct Relocation {
+  RALStmt *stmt;
+  Symbol symbol;
+  RelocationField field;
+  int index;
+};
+
+typedef struct Relocation Relocation;
+
+/* Every constant the program uses, in the order they were made, with an
+ * index by kind so getConstant() can find one again without a search */
+struct ConstantPool {
+  vector<MemoryLocation *> locations;
+  map<int, MemoryLocation *> values;
+  map<Label *, MemoryLocation *> labels;
+  map<MemoryLocation *, MemoryLocation *> pointers;
+};
+
+typedef struct ConstantPool ConstantPool;
+
+/* A word an instrumented program counts the calls from one site in */
+struct ProfileCounter {
+  MemoryLocation *location;
+  int site;
+  Symbol callee;
+};
+
+typedef struct ProfileCounter ProfileCounter;
 
 class RALFunction;
+class Proc;
+struct Analysis;
 typedef struct {
   MemoryLocation *fp;
   MemoryLocation *sp;
   MemoryLocation *scratch;
   MemoryLocation *scratch2;
   MemoryLocation *prev_fp;
-  map<string, RALFunction*> functions;
-  vector<MemoryLocation *> constants;
-
-  MemoryLocation *last_written_to;
-  map<string, list<FunctionGap*> > toCompile;
+  SymbolMap<RALFunction*> functions;
+  ConstantPool constants;
+
+  /* How many of the current function's temporaries are holding values
+   * right now; the next one free is temps[temp_depth] */
+  int temp_depth;
+  /* Relocations for the function currently being compiled */
+  vector<Relocation> relocations;
+
+  CompileOptions options;
+
+  vector<ProfileCounter> counters;
+
+  /* The definition each name ends up with, which is the only one that's
+   * compiled or that a call can be inlined from */
+  SymbolMap<Proc*> procs;
+  /* Procedures whose bodies are being inlined right now */
+  set<Proc*> inlining;
+  /* Words in the current function's frame for the variables of
+   * procedures inlined into it */
+  vector<MemoryLocation*> inlined;
+  /* The copies made for calls with constant arguments so far, when
+   * options.specialize; NULL otherwise */
+  Specializer *specializer;
+  /* What the range analysis found out about the procedure being compiled
+   * right now */
+  Analysis *analysis;
 } Env;
 
 class RALStmt 
@@ -70,7 +190,10 @@ public:
 	RALStmt(RALInstruction instruction, void *argument);
   ~RALStmt();
 
+  /* Made the first time somebody asks, since few statements are ever
+   * jumped to */
   Label *getLabel();
+  bool hasLabel() { return label_ != NULL; };
 
   RALInstruction getInstruction();
   void setInstruction(RALInstruction instruction);
@@ -78,41 +201,100 @@ public:
   void* getArgument();
   void setArgument(void *argument);
 
-  void output();
+  /* CALL's second operand, the frame size */
+  int getImmediate() { return immediate_; };
+  void setImmediate(int immediate) { immediate_ = immediate; };
 
 private:
   Label *label_;
   RALInstruction instruction_;
   void *argument_; 
+  int immediate_;
 };
 
+/* A linked program packed for running and printing: a one byte opcode and
+ * a 32-bit operand per line, the operand already resolved to an address, a
+ * frame offset or a line number according to the opcode. CALL is the only
+ * instruction with a second operand, so frame sizes are kept to one side.
+ * Line l is at index l - 1. */
+class RALCode
+{
+public:
+  RALCode() {};
+
+  void append(RALInstruction instruction, unsigned operand);
+  void setFrameSize(int index, int size) { frameSizes_[index] = size; };
+
+  int size() const { return opcodes_.size(); };
+  RALInstruction getInstruction(int index) const
+    { return (RALInstruction)opcodes_[index]; };
+  unsigned getOperand(int index) const { return operands_[index]; };
+  int getFrameSize(int index) const;
+
+  /* The raw arrays, for executors stepping through them */
+  const unsigned char *getOpcodes() const { return &opcodes_[0]; };
+  const unsigned *getOperands() const { return &operands_[0]; };
+
+  void output() const;
+
+private:
+  vector<unsigned char> opcodes_;
+  vector<unsigned> operands_;
+  map<int, int> frameSizes_;
+};
+
+/* A list owns its statements, and a statement owns its label */
 class RALStmtList 
 {
 public:
   RALStmtList() {};
+  virtual ~RALStmtList();
 
   /* These should check for NULL and appropriately do nothing - just as a
    * caution... */
   void append(RALStmt *S);  
+
+  /* Splices L's statements onto the end of this list in constant time,
+   * then deletes L */
   void append(RALStmtList *L); 
 
+  /* Only jumps are touched: any other NULL argument is an operand
+   * waiting on a relocation. The jumps appended with a NULL target are
+   * kept aside, so this only ever looks at the ones still unpatched. */
   void replaceNULLsWith(Label *label);
 
+  /* Straightens out the jumps codegen leaves behind, once every jump has
+   * its target; see the definition */
+  void simplifyJumps(ConstantPool &constants);
+
+  /* Shares repeated runs of lines as subroutines, once every operand has
+   * its address; see the definition */
+  void outline(ConstantPool &constants);
+
   void assignLineNumbers();
   Label *getFirstLabel() { return SL_.front()->getLabel(); };
+  const list<RALStmt*> &getStatements() const { return SL_; };
+  bool empty() { return SL_.empty(); };
   void peepholeOptimize();
-  void output();
+
+  /* Once every label has its line and every location its address. The
+   * return addresses in the pool are turned into the lines they name as
+   * well, after which nothing needs the statements any more. */
+  void encode(RALCode &code, ConstantPool &constants);
 
 protected:
-	vector <RALStmt*> SL_;
+	list <RALStmt*> SL_;
+	list <RALStmt*> pending_;
 };
 
+/* LDO and STO with a NULL offset leave getStmtWithOffset() for a
+ * relocation to fill in */
 class LDO : public RALStmtList
 {
 public:
   LDO(MemoryLocation *fp, MemoryLocation *offset, Env &e);
 
-  void setOffset(MemoryLocation* offset, vector<MemoryLocation*> &constants);
+  RALStmt *getStmtWithOffset() { return stmtWithOffset; };
 
 private:
   RALStmt *stmtWithOffset;
@@ -123,19 +305,34 @@ class STO : public RALStmtList
 public:
   STO(MemoryLocation *fp, MemoryLocation *offset, Env &e);
 
-  void setOffset(MemoryLocation* offset, vector<MemoryLocation*> &constants);
+  RALStmt *getStmtWithOffset() { return stmtWithOffset; };
 
 private:
   RALStmt *stmtWithOffset;
 };
 
+void addRelocation(Env &e, RALStmt *stmt, Symbol symbol,
+    RelocationField field, int index = 0);
+
+/* A function owns its statements until the program takes them, and the
+ * memory locations of its activation record for good */
 class RALFunction
 {
 public:
-  RALFunction() { };
+  RALFunction()
+    { prev_fp = ret_addr = ret_value = NULL; SL_ = NULL; entry_ = NULL; };
+  ~RALFunction();
 
   RALStmtList *getStatementList() { return SL_; };
+
+  /* A copy of a function compiled against from, for a program being built
+   * in to: its own statements and frame, from's registers swapped for
+   * to's and its constants found again in to's pool. Only good before the
+   * function is linked into a program. */
+  RALFunction *clone(const Env &from, Env &to);
   void setStatementList(RALStmtList *statements);
+  /* Hands the statements over to whoever is splicing them elsewhere */
+  RALStmtList *releaseStatementList();
   
   vector<MemoryLocation*> getActivationRecord() { return activationRecord_; };
   void setActivationRecord(vector<MemoryLocation*> activationRecord)
@@ -144,45 +341,85 @@ public:
   void link();
   void output();
 
+  /* Still good once the statements have been spliced into the program,
+   * until simplifyJumps() throws them away for never being called or the
+   * program is encoded and they all go */
   Label *getFirstLabel();
 
   /* These are part of the activation record... they're just here for
-   * convenience */
+   * convenience. prev_fp and ret_addr are NULL with native calls, and
+   * ret_value is NULL if the function never assigns return. */
   MemoryLocation *prev_fp;
   MemoryLocation *ret_addr;
   MemoryLocation *ret_value;
   list<MemoryLocation *> parameters;
+  SparseSymbolMap<MemoryLocation*> variables;
+
+  /* Operands in this function's statements that refer to other functions */
+  vector<Relocation> relocations;
 
 private:
   RALStmtList *SL_;
+  Label *entry_;
   /* All these memory locations are actually just offsets from the fp,
    * but then again, MemoryLocation pointers are abstract to begin with,
    * these just moreso. */
   vector<MemoryLocation *> activationRecord_;
 };
 
+/* The program owns everything it was linked from: the statements of every
+ * function, the functions themselves, the registers and the constants */
 class RALProgram 
 {
 public:
   RALProgram(Env e);
+  ~RALProgram();
+
+  /* False if resolve() found references to procedures that were never
+   * defined, in which case there's nothing to output or run */
+  bool isLinked() { return linked_; };
 
+  bool resolve();
   void link();
   void output();
   void dump();
 
+  /* Everything an executor (interpreter or JIT) needs to run the program:
+   * the linked statements and the initial contents of memory, indexed by
+   * address. dumpVariables() reads the main function's variables back out
+   * of a memory image after a run. */
+  const RALCode &getCode() { return code_; };
+  MemoryLocation *getFramePointer() { return e_.fp; };
+  MemoryLocation *getStackPointer() { return e_.sp; };
+  vector<int> getMemoryImage();
+  void dumpVariables(const vector<int> &memory);
+
+  /* The code and memory as 32-bit words in the host's byte order, for a
+   * loader that would rather not parse: 'RALI', the number of lines, the
+   * number of words of memory, each line's opcode, operand and CALL frame
+   * size, then the memory image */
+  void writeImage(ostream &out);
+
+  /* Where one of main's variables lives once the program starts, or -1
+   * if main has no such variable */
+  int getVariableAddress(Symbol name);
+
+  /* Reads an instrumented program's counters back out of memory after a
+   * run and writes them to file */
+  bool saveProfile(const vector<int> &memory, const char *file);
+
 private:
   Env e_;
   RALStmtList *SL_;
-};
 
-struct FunctionGap {
-  RALStmt *ADDwithActivationRecordSize;
-  LDO *LDOwithReturnValueOffset;
-  LDO *LDOwithPrevFPOffset;
-  STO *STOwithReturnAddressOffset;
-  STO *STOwithPrevFPOffset;
-  RALStmt *JMPtoFunction;
-  list<STO*> params;
+  /* SL_ encoded once it's linked; this is what gets printed and run, and
+   * SL_ itself is deleted as soon as it's made */
+  RALCode code_;
+
+  /* The first address past the registers and constants */
+  int end_;
+  bool linked_;
+  vector<Relocation> relocations_;
 };
 
 
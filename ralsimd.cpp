@@ -0,0 +1,400 @@
+/*
+ * file:  ralsimd.cpp
+ *
+ * Description: Lockstep execution of a RAL program over groups of lanes.
+ *
+ * The vector loop is written with GCC vector extensions, and on x86-64 it
+ * is compiled twice - plain and for AVX2 - with the right one picked when
+ * the program starts. LDA/STA/ADD/SUB/MUL and the JMZ/JMN tests are whole
+ * vector operations; the indirect instructions (LDI/STI/JA/LDF/STF and
+ * CALL/RET) have a different address in every lane, so they go lane by
+ * lane under the mask.
+ */
+#include <climits>
+#include <cstring>
+#include "ralsimd.h"
+
+using namespace std;
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define RALSIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define RALSIMD_CLONES
+#endif
+
+typedef int v8si __attribute__((vector_size(32)));
+typedef unsigned v8su __attribute__((vector_size(32)));
+
+const int W = RALLockstep::LANE_WIDTH;
+
+/* The pc of a lane that has halted or faulted; it's never the lowest */
+const int DONE = INT_MAX;
+
+/* Give up on a group when fewer than one in DIVERGENCE_RATIO of its live
+ * lanes did anything over the last DIVERGENCE_WINDOW steps */
+const int DIVERGENCE_WINDOW = 4096;
+const int DIVERGENCE_RATIO = 4;
+
+/* The helpers are macros rather than inline functions: a function that
+ * takes or returns a v8si is passed differently with and without AVX, and
+ * GCC warns about the ABI change even when every call gets inlined */
+#define SPLAT(x) ((v8si){} + (x))
+
+#define SELECT(mask, a, b) (((mask) & (a)) | (~(mask) & (b)))
+
+/* Row a of memory holds word a of every lane */
+#define LOAD_ROW(m, a) \
+  ({ v8si row_; memcpy(&row_, (m) + (a) * W, sizeof(row_)); row_; })
+
+#define STORE_ROW(m, a, v) \
+  do { v8si out_ = (v); memcpy((m) + (a) * W, &out_, sizeof(out_)); } \
+  while(0)
+
+/* Runs the lanes of one group until they've all stopped, and returns
+ * false if it gave up on them first because they'd diverged */
+RALSIMD_CLONES
+static bool runLanes(const RALCode &code, int *m, int size, int fp, int sp,
+    int *pcs, int *accs, RALStatus *status, long long *steps)
+{
+  int n = code.size();
+  const unsigned char *op = code.getOpcodes();
+  const unsigned *arg = code.getOperands();
+
+  v8si pc, acc, count = SPLAT(0);
+  memcpy(&pc, pcs, sizeof(pc));
+  memcpy(&acc, accs, sizeof(acc));
+
+  long long issued = 0, possible = 0;
+  bool diverged = false;
+
+  for(int iteration = 1; ; iteration++)
+  {
+    int cur = DONE, live = 0;
+    for(int l = 0; l < W; l++)
+      if(pc[l] != DONE)
+      {
+        live++;
+        if(pc[l] < cur)
+          cur = pc[l];
+      }
+
+    if(live == 0)
+      break;
+
+    v8si mask = pc == SPLAT(cur);
+
+    /* Running off the end is a halt, anywhere else out of range a fault */
+    if(cur < 1 || cur > n)
+    {
+      for(int l = 0; l < W; l++)
+        if(mask[l])
+          status[l] = cur == n + 1 ? HALTED : FAULTED;
+      pc = SELECT(mask, SPLAT(DONE), pc);
+      continue;
+    }
+
+    int issuedNow = 0;
+    for(int l = 0; l < W; l++)
+      issuedNow += mask[l] & 1;
+    issued += issuedNow;
+    possible += live;
+
+    if(iteration % DIVERGENCE_WINDOW == 0)
+    {
+      if(issued * DIVERGENCE_RATIO < possible)
+      {
+        diverged = true;
+        break;
+      }
+      issued = possible = 0;
+    }
+
+    count -= mask;
+
+    int a = arg[cur - 1], f;
+    v8si next = SPLAT(cur + 1), dead = SPLAT(0);
+
+    switch(op[cur - 1])
+    {
+      case LDA:
+        acc = SELECT(mask, LOAD_ROW(m, a), acc);
+        break;
+      case STA:
+        STORE_ROW(m, a, SELECT(mask, acc, LOAD_ROW(m, a)));
+        break;
+      /* Unsigned so that overflow wraps like everywhere else */
+      case ADD:
+        acc = SELECT(mask, (v8si)((v8su)acc + (v8su)LOAD_ROW(m, a)), acc);
+        break;
+      case SUB:
+        acc = SELECT(mask, (v8si)((v8su)acc - (v8su)LOAD_ROW(m, a)), acc);
+        break;
+      case MUL:
+        acc = SELECT(mask, (v8si)((v8su)acc * (v8su)LOAD_ROW(m, a)), acc);
+        break;
+      case JMP:
+        next = SPLAT(a);
+        break;
+      case JMZ:
+        next = SELECT(acc == SPLAT(0), SPLAT(a), next);
+        break;
+      case JMN:
+        next = SELECT(acc < SPLAT(0), SPLAT(a), next);
+        break;
+      case HLT:
+        for(int l = 0; l < W; l++)
+          if(mask[l])
+            status[l] = HALTED;
+        dead = mask;
+        break;
+      case LDI:
+        for(int l = 0; l < W; l++)
+          if(mask[l])
+          {
+            int x = m[a * W + l];
+            if(x < 0 || x >= size)
+              dead[l] = -1;
+            else
+              acc[l] = m[x * W + l];
+          }
+        break;
+      case STI:
+        for(int l = 0; l < W; l++)
+          if(mask[l])
+          {
+            int x = m[a * W + l];
+            if(x < 0 || x >= size)
+              dead[l] = -1;
+            else
+              m[x * W + l] = acc[l];
+          }
+        break;
+      case JA:
+        for(int l = 0; l < W; l++)
+          if(mask[l])
+          {
+            next[l] = m[a * W + l];
+            if(next[l] < 1 || next[l] > n)
+              dead[l] = -1;
+          }
+        break;
+      case LDF:
+        for(int l = 0; l < W; l++)
+          if(mask[l])
+          {
+            int x = a + m[fp * W + l];
+            if(x < 0 || x >= size)
+              dead[l] = -1;
+            else
+              acc[l] = m[x * W + l];
+          }
+        break;
+      case STF:
+        for(int l = 0; l < W; l++)
+          if(mask[l])
+          {
+            int x = a + m[fp * W + l];
+            if(x < 0 || x >= size)
+              dead[l] = -1;
+            else
+              m[x * W + l] = acc[l];
+          }
+        break;
+      case CALL:
+        f = code.getFrameSize(cur - 1);
+        for(int l = 0; l < W; l++)
+          if(mask[l])
+          {
+            int s = m[sp * W + l], frame = s + 1 + LINKAGE_SIZE;
+            if(s < 0 || frame + f > size)
+            {
+              dead[l] = -1;
+              continue;
+            }
+            m[(frame - 2) * W + l] = m[fp * W + l];
+            m[(frame - 1) * W + l] = cur + 1;
+            m[fp * W + l] = frame;
+            m[sp * W + l] = frame + f - 1;
+          }
+        next = SPLAT(a);
+        break;
+      case RET:
+        for(int l = 0; l < W; l++)
+          if(mask[l])
+          {
+            int frame = m[fp * W + l];
+            if(frame < LINKAGE_SIZE + 1 || frame > size)
+            {
+              dead[l] = -1;
+              continue;
+            }
+            next[l] = m[(frame - 1) * W + l];
+            m[fp * W + l] = m[(frame - 2) * W + l];
+            m[sp * W + l] = frame - LINKAGE_SIZE - 1;
+            if(next[l] < 1 || next[l] > n)
+              dead[l] = -1;
+          }
+        break;
+    }
+
+    /* Anything that died here died of a fault, apart from a HLT */
+    for(int l = 0; l < W; l++)
+      if(dead[l] && op[cur - 1] != HLT)
+        status[l] = FAULTED;
+
+    pc = SELECT(mask, SELECT(dead, SPLAT(DONE), next), pc);
+  }
+
+  memcpy(pcs, &pc, sizeof(pc));
+  memcpy(accs, &acc, sizeof(acc));
+  for(int l = 0; l < W; l++)
+    steps[l] += count[l];
+
+  return !diverged;
+}
+
+RALLockstep::RALLockstep(RALProgram *program, int lanes, int memorySize)
+{
+  program_ = program;
+  lanes_ = lanes;
+  size_ = memorySize;
+  scalarLanes_ = 0;
+
+  vector<int> image = program->getMemoryImage();
+  if(size_ < image.size())
+    size_ = image.size();
+
+  for(int first = 0; first < lanes_; first += W)
+  {
+    LaneGroup *g = new LaneGroup();
+    g->memory.assign(size_ * W, 0);
+    for(int a = 0; a < image.size(); a++)
+      for(int l = 0; l < W; l++)
+        g->memory[a * W + l] = image[a];
+
+    /* Lanes past the last one are there to make up the width, and start
+     * out already stopped */
+    for(int l = 0; l < W; l++)
+    {
+      g->pc[l] = first + l < lanes_ ? 1 : DONE;
+      g->acc[l] = 0;
+      g->status[l] = HALTED;
+      g->steps[l] = 0;
+    }
+
+    groups_.push_back(g);
+  }
+}
+
+RALLockstep::~RALLockstep()
+{
+  for(int i = 0; i < groups_.size(); i++)
+    delete groups_[i];
+}
+
+void RALLockstep::setWord(int lane, int address, int value)
+{
+  groups_[lane / W]->memory[address * W + lane % W] = value;
+}
+
+int RALLockstep::getWord(int lane, int address)
+{
+  return groups_[lane / W]->memory[address * W + lane % W];
+}
+
+RALStatus RALLockstep::getStatus(int lane)
+{
+  return groups_[lane / W]->status[lane % W];
+}
+
+long long RALLockstep::getSteps(int lane)
+{
+  return groups_[lane / W]->steps[lane % W];
+}
+
+vector<int> RALLockstep::getMemory(int lane)
+{
+  vector<int> memory(size_);
+  for(int a = 0; a < size_; a++)
+    memory[a] = getWord(lane, a);
+  return memory;
+}
+
+bool RALLockstep::isAVX2()
+{
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+void RALLockstep::run()
+{
+  const RALCode &code = program_->getCode();
+  int fp = program_->getFramePointer()->address;
+  int sp = program_->getStackPointer()->address;
+
+  /* Every direct operand has to be a word of lane memory, same as the
+   * interpreter checks */
+  bool ok = true;
+  for(int i = 0; i < code.size(); i++)
+  {
+    switch(code.getInstruction(i))
+    {
+      case JMP:
+      case JMZ:
+      case JMN:
+      case HLT:
+      case RET:
+      case LDF:
+      case STF:
+      case CALL:
+        break;
+      default:
+        if(code.getOperand(i) >= size_)
+          ok = false;
+    }
+  }
+
+  for(int i = 0; i < groups_.size(); i++)
+  {
+    LaneGroup *g = groups_[i];
+
+    if(!ok)
+    {
+      for(int l = 0; l < W; l++)
+        if(g->pc[l] != DONE)
+          g->status[l] = FAULTED;
+      continue;
+    }
+
+    if(runLanes(code, &g->memory[0], size_, fp, sp, g->pc, g->acc,
+          g->status, g->steps))
+      continue;
+
+    for(int l = 0; l < W; l++)
+      if(g->pc[l] != DONE)
+        runScalar(g, l);
+  }
+}
+
+/* Pull one lane's memory out of its group, finish it on the interpreter
+ * from wherever the vector loop left it, and put it back */
+void RALLockstep::runScalar(LaneGroup *g, int lane)
+{
+  vector<int> memory(size_);
+  for(int a = 0; a < size_; a++)
+    memory[a] = g->memory[a * W + lane];
+
+  RALInterpreter interpreter(program_, memory, g->pc[lane], g->acc[lane]);
+  g->status[lane] = interpreter.run();
+  g->steps[lane] += interpreter.getSteps();
+  g->pc[lane] = DONE;
+
+  vector<int> &result = interpreter.getMemory();
+  for(int a = 0; a < size_; a++)
+    g->memory[a * W + lane] = result[a];
+
+  scalarLanes_++;
+}
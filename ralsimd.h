@@ -0,0 +1,72 @@
+#ifndef __RALSIMD_H__
+#define __RALSIMD_H__
+/*
+ * file:  ralsimd.h
+ *
+ * Description: Declarations for running many copies of one RAL program in
+ * lockstep, one copy per SIMD lane
+ */
+#include <vector>
+#include "programext.h"
+#include "ralprogram.h"
+#include "ralinterpreter.h"
+
+using namespace std;
+
+/* Words of memory per lane; every lane gets its own copy of everything,
+ * so this is a lot smaller than a single run's */
+const int DEFAULT_LANE_MEMORY_SIZE = 1 << 12;
+
+/* Lanes are run LANE_WIDTH at a time, with the accumulator, the pcs and
+ * memory laid out lane by lane so that the same instruction in every lane
+ * of a group is one vector operation. Lanes that branch different ways
+ * are masked off: each step runs the lowest pc of any lane in the group,
+ * which brings them back together where control flow joins up again. A
+ * group whose lanes have drifted too far apart to share much work gets
+ * finished one lane at a time on RALInterpreter. */
+class RALLockstep
+{
+public:
+  static const int LANE_WIDTH = 8;
+
+  RALLockstep(RALProgram *program, int lanes,
+              int memorySize = DEFAULT_LANE_MEMORY_SIZE);
+  ~RALLockstep();
+
+  /* Inputs go in by poking a lane's initial memory before run() */
+  void setWord(int lane, int address, int value);
+  int getWord(int lane, int address);
+
+  void run();
+
+  RALStatus getStatus(int lane);
+  long long getSteps(int lane);
+  vector<int> getMemory(int lane);
+
+  int getLanes() { return lanes_; };
+  /* How many lanes had to be finished on the scalar interpreter */
+  int getScalarLanes() { return scalarLanes_; };
+
+  /* Whether the vector loop is running with AVX2 here */
+  static bool isAVX2();
+
+private:
+  struct LaneGroup
+  {
+    vector<int> memory;
+    int pc[LANE_WIDTH];
+    int acc[LANE_WIDTH];
+    RALStatus status[LANE_WIDTH];
+    long long steps[LANE_WIDTH];
+  };
+
+  void runScalar(LaneGroup *g, int lane);
+
+  RALProgram *program_;
+  int lanes_;
+  int size_;
+  int scalarLanes_;
+  vector<LaneGroup*> groups_;
+};
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ * file:  ranges.cpp
+ *
+ * Description: Interval arithmetic and the joins and widening the range
+ * analysis needs.
+ */
+#include <algorithm>
+#include "ranges.h"
+
+using namespace std;
+
+/* Anything outside what an int holds means the real thing wrapped */
+static Interval clamp(long long lo, long long hi)
+{
+  if(lo < INT_MIN || hi > INT_MAX)
+    return Interval();
+
+  return Interval(lo, hi);
+}
+
+Interval join(const Interval &a, const Interval &b)
+{
+  if(a.isEmpty())
+    return b;
+  if(b.isEmpty())
+    return a;
+
+  return Interval(min(a.lo, b.lo), max(a.hi, b.hi));
+}
+
+Interval meet(const Interval &a, const Interval &b)
+{
+  return Interval(max(a.lo, b.lo), min(a.hi, b.hi));
+}
+
+Interval widen(const Interval &before, const Interval &after)
+{
+  if(before.isEmpty())
+    return after;
+  if(after.isEmpty())
+    return before;
+
+  return Interval(after.lo < before.lo ? INT_MIN : before.lo,
+                  after.hi > before.hi ? INT_MAX : before.hi);
+}
+
+Interval operator+(const Interval &a, const Interval &b)
+{
+  if(a.isEmpty() || b.isEmpty())
+    return Interval::empty();
+
+  return clamp(a.lo + b.lo, a.hi + b.hi);
+}
+
+Interval operator-(const Interval &a, const Interval &b)
+{
+  if(a.isEmpty() || b.isEmpty())
+    return Interval::empty();
+
+  return clamp(a.lo - b.hi, a.hi - b.lo);
+}
+
+Interval operator*(const Interval &a, const Interval &b)
+{
+  if(a.isEmpty() || b.isEmpty())
+    return Interval::empty();
+
+  /* Both sides are ints, so none of these can overflow 64 bits */
+  long long p[4] = { a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi };
+  return clamp(*min_element(p, p + 4), *max_element(p, p + 4));
+}
+
+Interval Ranges::get(Symbol name) const
+{
+  return variables.get(name);
+}
+
+void Ranges::set(Symbol name, const Interval &value)
+{
+  if(value.isTop())
+    variables.erase(name);
+  else
+    variables[name] = value;
+}
+
+bool Ranges::operator==(const Ranges &r) const
+{
+  if(reachable != r.reachable)
+    return false;
+  if(!reachable)
+    return true;
+
+  return variables == r.variables;
+}
+
+/* Only names bound on both sides stay bound. Both sides are in order of
+ * symbol, so one pass down the two of them side by side finds those. */
+Ranges join(const Ranges &a, const Ranges &b)
+{
+  if(!a.reachable)
+    return b;
+  if(!b.reachable)
+    return a;
+
+  Ranges r;
+  SparseSymbolMap<Interval>::const_iterator i = a.variables.begin(),
+                                            j = b.variables.begin();
+  while(i != a.variables.end() && j != b.variables.end())
+  {
+    if(i->first < j->first)
+      i++;
+    else if(j->first < i->first)
+      j++;
+    else
+    {
+      Interval x = join(i->second, j->second);
+      if(!x.isTop())
+        r.variables.append(i->first, x);
+      i++;
+      j++;
+    }
+  }
+
+  return r;
+}
+
+Ranges widen(const Ranges &before, const Ranges &after)
+{
+  if(!before.reachable)
+    return after;
+  if(!after.reachable)
+    return before;
+
+  Ranges r;
+  SparseSymbolMap<Interval>::const_iterator i = before.variables.begin(),
+                                            j = after.variables.begin();
+  while(i != before.variables.end() && j != after.variables.end())
+  {
+    if(i->first < j->first)
+      i++;
+    else if(j->first < i->first)
+      j++;
+    else
+    {
+      Interval x = widen(i->second, j->second);
+      if(!x.isTop())
+        r.variables.append(i->first, x);
+      i++;
+      j++;
+    }
+  }
+
+  return r;
+}
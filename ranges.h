@@ -0,0 +1,72 @@
+#ifndef __RANGES_H__
+#define __RANGES_H__
+/*
+ * file:  ranges.h
+ *
+ * Description: Intervals of values a variable or expression can take, for
+ * the range analysis the compiler runs over each procedure before it
+ * compiles it. Arithmetic wraps around at 32 bits at run time, so anything
+ * that might wrap is given up on and could be anything at all.
+ */
+#include <climits>
+#include "symbols.h"
+
+using namespace std;
+
+/* [lo, hi], empty when lo > hi; the bounds are kept in 64 bits so the
+ * arithmetic can tell when the real thing would have wrapped */
+struct Interval
+{
+  /* Anything at all */
+  Interval() { lo = INT_MIN; hi = INT_MAX; };
+  Interval(long long lo, long long hi) { this->lo = lo; this->hi = hi; };
+
+  static Interval empty() { return Interval(1, 0); };
+
+  bool isEmpty() const { return lo > hi; };
+  bool isTop() const { return lo <= INT_MIN && hi >= INT_MAX; };
+  bool isConstant() const { return lo == hi; };
+
+  bool operator==(const Interval &i) const
+    { return isEmpty() ? i.isEmpty() : lo == i.lo && hi == i.hi; };
+
+  long long lo;
+  long long hi;
+};
+
+typedef struct Interval Interval;
+
+Interval join(const Interval &a, const Interval &b);
+Interval meet(const Interval &a, const Interval &b);
+/* Any bound that's still moving goes all the way, so loops settle */
+Interval widen(const Interval &before, const Interval &after);
+
+Interval operator+(const Interval &a, const Interval &b);
+Interval operator-(const Interval &a, const Interval &b);
+Interval operator*(const Interval &a, const Interval &b);
+
+/* What's known about every variable at one point in a procedure. A name
+ * that isn't bound could be anything; code that can't be reached at all
+ * knows nothing and needs nothing. Only the names a procedure assigns ever
+ * get bound, so copying and joining these costs what the procedure has
+ * rather than what the whole program has. */
+struct Ranges
+{
+  Ranges() { reachable = true; };
+
+  Interval get(Symbol name) const;
+  /* Binding something to top is the same as forgetting it */
+  void set(Symbol name, const Interval &value);
+
+  bool operator==(const Ranges &r) const;
+
+  bool reachable;
+  SparseSymbolMap<Interval> variables;
+};
+
+typedef struct Ranges Ranges;
+
+Ranges join(const Ranges &a, const Ranges &b);
+Ranges widen(const Ranges &before, const Ranges &after);
+
+#endif
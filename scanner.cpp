@@ -0,0 +1,319 @@
+/*
+ * file:  scanner.cpp
+ *
+ * Description: The mapped-file lexer. On x86-64 long runs are measured
+ * sixteen bytes at a time with SSE2, which every such processor has; the
+ * last few bytes of the file, and everything anywhere else, go a byte at
+ * a time. AVX2's 32 bytes were tried and came out slower: hardly a run is
+ * that long, and the AVX2 code can't be inlined into code that has to run
+ * without it.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "scanner.h"
+#include "symbols.h"
+
+using namespace std;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SCANNER_SIMD
+#include <immintrin.h>
+#endif
+
+const char *const Scanner::KEYWORDS[KEYWORD_COUNT] =
+  { "define", "if", "then", "else", "fi", "while", "do", "od", "proc",
+    "end" };
+
+/* The keywords are all told apart by their first and last letters and
+ * their length: this puts each in its own slot, and anything else that
+ * lands on one only has to be compared with that keyword */
+static inline unsigned keywordSlot(unsigned char first, unsigned char last,
+                                   size_t length)
+{
+  return (first * 10 + last * 5 + length) & 15;
+}
+
+static const signed char KEYWORD_SLOTS[16] =
+  { -1, -1, 2, 8, 5, 6, -1, 0, -1, 9, 1, 4, 7, -1, -1, 3 };
+
+/* Most runs - a name, the space between tokens - are over within a few
+ * bytes, sooner than a vector can be loaded and tested, so the first few
+ * bytes of a run are always looked at one at a time */
+const size_t SHORT_RUN = 8;
+
+static inline bool isSpace(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n';
+}
+
+static size_t spanSpace(const char *data, size_t at, size_t size)
+{
+  while(at < size && isSpace(data[at]))
+    at++;
+  return at;
+}
+
+static size_t spanRange(const char *data, size_t at, size_t size,
+                        char low, char high)
+{
+  while(at < size && data[at] >= low && data[at] <= high)
+    at++;
+  return at;
+}
+
+#ifdef SCANNER_SIMD
+
+/* Each bit of the masks below is set for a byte that ends the run. A
+ * range test is one signed compare once the range is shifted down to
+ * start at -128. */
+
+static size_t spanSpace16(const char *data, size_t at, size_t size)
+{
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i newline = _mm_set1_epi8('\n');
+
+  for(; at + 16 <= size; at += 16)
+  {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)(data + at));
+    __m128i in = _mm_or_si128(_mm_cmpeq_epi8(bytes, space),
+                 _mm_or_si128(_mm_cmpeq_epi8(bytes, tab),
+                              _mm_cmpeq_epi8(bytes, newline)));
+    unsigned out = ~_mm_movemask_epi8(in) & 0xffff;
+    if(out != 0)
+      return at + __builtin_ctz(out);
+  }
+
+  return spanSpace(data, at, size);
+}
+
+static size_t spanRange16(const char *data, size_t at, size_t size,
+                          char low, char high)
+{
+  const __m128i shift = _mm_set1_epi8((char)(0x80 - low));
+  const __m128i limit = _mm_set1_epi8((char)(-128 + (high - low) + 1));
+
+  for(; at + 16 <= size; at += 16)
+  {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)(data + at));
+    __m128i in = _mm_cmplt_epi8(_mm_add_epi8(bytes, shift), limit);
+    unsigned out = ~_mm_movemask_epi8(in) & 0xffff;
+    if(out != 0)
+      return at + __builtin_ctz(out);
+  }
+
+  return spanRange(data, at, size, low, high);
+}
+
+#endif
+
+Scanner::Scanner()
+{
+  data_ = NULL;
+  size_ = 0;
+  at_ = 0;
+}
+
+Scanner::~Scanner()
+{
+  close();
+}
+
+void Scanner::close()
+{
+  if(data_ != NULL && buffer_.empty())
+    munmap((void*)data_, size_);
+  buffer_.clear();
+  data_ = NULL;
+  size_ = 0;
+  at_ = 0;
+}
+
+bool Scanner::open(const char *file)
+{
+  int fd = ::open(file, O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) != 0)
+  {
+    cout << "Error:  can't read " << file << ": " << strerror(errno) << endl;
+    if(fd >= 0)
+      ::close(fd);
+    return false;
+  }
+
+  /* There's nothing to map in an empty file, and mmap won't try */
+  void *data = NULL;
+  if(st.st_size > 0)
+  {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED)
+    {
+      cout << "Error:  can't map " << file << ": " << strerror(errno) << endl;
+      ::close(fd);
+      return false;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+  }
+  ::close(fd);
+
+  close();
+  data_ = (const char*)data;
+  size_ = data == NULL ? 0 : st.st_size;
+  return true;
+}
+
+bool Scanner::read(int fd)
+{
+  string buffer;
+  char block[1 << 16];
+  ssize_t n;
+  while((n = ::read(fd, block, sizeof(block))) != 0)
+  {
+    if(n < 0)
+    {
+      cout << "Error:  can't read the program: " << strerror(errno) << endl;
+      return false;
+    }
+    buffer.append(block, n);
+  }
+
+  close();
+  buffer_.swap(buffer);
+  data_ = buffer_.empty() ? NULL : buffer_.data();
+  size_ = buffer_.size();
+  return true;
+}
+
+size_t Scanner::skipSpace(size_t at) const
+{
+  size_t stop = min(at + SHORT_RUN, size_);
+  at = spanSpace(data_, at, stop);
+  if(at < stop || at == size_)
+    return at;
+
+#ifdef SCANNER_SIMD
+  return spanSpace16(data_, at, size_);
+#else
+  return spanSpace(data_, at, size_);
+#endif
+}
+
+size_t Scanner::skipRun(size_t at, char low, char high) const
+{
+  size_t stop = min(at + SHORT_RUN, size_);
+  at = spanRange(data_, at, stop, low, high);
+  if(at < stop || at == size_)
+    return at;
+
+#ifdef SCANNER_SIMD
+  return spanRange16(data_, at, size_, low, high);
+#else
+  return spanRange(data_, at, size_, low, high);
+#endif
+}
+
+int Scanner::findKeyword(size_t at, size_t length) const
+{
+  const char *text = data_ + at;
+  int k = KEYWORD_SLOTS[keywordSlot(text[0], text[length - 1], length)];
+  if(k < 0 || strncmp(KEYWORDS[k], text, length) != 0 ||
+     KEYWORDS[k][length] != '\0')
+    return -1;
+  return k;
+}
+
+/* Flex's longest match is what makes "define" a keyword and "defined" a
+ * name, so a whole run of letters is looked up, not a prefix of one */
+Token Scanner::next()
+{
+  at_ = skipSpace(at_);
+
+  Token t;
+  t.offset = at_;
+  t.keyword = -1;
+
+  size_t end;
+  if(at_ >= size_)
+  {
+    t.kind = Token::END_OF_INPUT;
+    end = at_;
+  }
+  else if(data_[at_] >= 'a' && data_[at_] <= 'z')
+  {
+    end = skipRun(at_, 'a', 'z');
+    t.keyword = findKeyword(at_, end - at_);
+    t.kind = t.keyword < 0 ? Token::NAME : Token::KEYWORD;
+  }
+  else if(data_[at_] >= '0' && data_[at_] <= '9')
+  {
+    end = skipRun(at_, '0', '9');
+    t.kind = Token::NUMERAL;
+  }
+  else if(data_[at_] == ':' && at_ + 1 < size_ && data_[at_ + 1] == '=')
+  {
+    end = at_ + 2;
+    t.kind = Token::ASSIGN;
+  }
+  else
+  {
+    end = at_ + 1;
+    t.kind = Token::OTHER;
+  }
+
+  t.length = end - at_;
+  at_ = end;
+  return t;
+}
+
+Lexeme Scanner::lex()
+{
+  Token t = next();
+
+  Lexeme l;
+  l.kind = t.kind;
+  switch(t.kind)
+  {
+    case Token::NAME:
+      l.value = intern(getText(t), t.length);
+      break;
+    case Token::NUMERAL:
+      l.value = getNumber(t);
+      break;
+    case Token::KEYWORD:
+      l.value = t.keyword;
+      break;
+    case Token::OTHER:
+      l.value = getChar(t);
+      break;
+    default:
+      l.value = 0;
+  }
+
+  return l;
+}
+
+/* atoi is strtol cut down to an int, and strtol sticks at LONG_MAX once
+ * the number is too big for it */
+int Scanner::getNumber(const Token &t) const
+{
+  unsigned long value = 0;
+  for(size_t i = 0; i < t.length; i++)
+  {
+    unsigned long digit = data_[t.offset + i] - '0';
+    if(value > (LONG_MAX - digit) / 10)
+    {
+      value = LONG_MAX;
+      break;
+    }
+    value = value * 10 + digit;
+  }
+
+  return (int)(long)value;
+}
@@ -0,0 +1,94 @@
+#ifndef __SCANNER_H__
+#define __SCANNER_H__
+/*
+ * file:  scanner.h
+ *
+ * Description: A lexer for programs read from a file, in place of flex.
+ * The file is mapped into memory rather than read, and a token is handed
+ * out as where it is in the mapping, so nothing is copied on the way to
+ * the parser - an identifier goes straight from the mapping into intern().
+ * Whitespace and the runs of letters and digits that make up names and
+ * numbers are measured sixteen bytes at a time once they're long enough to
+ * be worth it, and the keywords are told apart from names with a perfect
+ * hash.
+ *
+ * It lexes exactly what programext.l does, token for token.
+ */
+#include <cstddef>
+#include <string>
+
+using namespace std;
+
+struct Token
+{
+  enum Kind
+  {
+    END_OF_INPUT,
+    NAME,      /* [a-z]+ that isn't a keyword */
+    NUMERAL,   /* [0-9]+ */
+    KEYWORD,   /* keyword says which, as an index into Scanner::KEYWORDS */
+    ASSIGN,    /* := */
+    OTHER      /* any other single character */
+  };
+
+  Kind kind;
+  size_t offset;
+  size_t length;
+  int keyword;
+};
+
+/* A token with its text already turned into what the parser wants */
+struct Lexeme
+{
+  Token::Kind kind;
+  /* The symbol for a NAME, the value of a NUMERAL, the index of a
+   * KEYWORD or an OTHER's character */
+  int value;
+};
+
+class Scanner
+{
+ public:
+  Scanner();
+  ~Scanner();
+
+  /* Maps file in, or says why it can't and returns false */
+  bool open(const char *file);
+  /* Reads everything there is on fd into memory of our own instead, for
+   * input that can't be mapped */
+  bool read(int fd);
+
+  Token next();
+  /* The next token with its name interned or its number worked out */
+  Lexeme lex();
+
+  /* Where t's characters are. They aren't NUL terminated. */
+  const char *getText(const Token &t) const { return data_ + t.offset; };
+  /* A NUMERAL's value, the same as atoi would make it */
+  int getNumber(const Token &t) const;
+  /* An OTHER's character */
+  int getChar(const Token &t) const { return data_[t.offset]; };
+
+  /* define, if, then, else, fi, while, do, od, proc, end */
+  static const int KEYWORD_COUNT = 10;
+  static const char *const KEYWORDS[KEYWORD_COUNT];
+
+ private:
+  /* Where the run of whitespace, or of characters from low to high, that
+   * starts at at ends */
+  size_t skipSpace(size_t at) const;
+  size_t skipRun(size_t at, char low, char high) const;
+
+  /* Which keyword [at, at + length) is, or -1 if it's a name */
+  int findKeyword(size_t at, size_t length) const;
+
+  void close();
+
+  const char *data_;
+  size_t size_;
+  size_t at_;
+  /* What read() read; data_ is only mapped when this is empty */
+  string buffer_;
+};
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef __SPSCQUEUE_H__
+#define __SPSCQUEUE_H__
+/*
+ * file:  spscqueue.h
+ *
+ * Description: A bounded queue for handing things from one thread to
+ * exactly one other. Items are built and read in place in a ring of slots.
+ * Each end only ever writes its own index and reads the other's, and an
+ * index is published only after the slot it gives up has been written or
+ * read, so moving an item takes no lock.
+ *
+ * An end that finds the queue full or empty spins for a little while
+ * before going to sleep, and the other end only takes the lock to wake it
+ * up when somebody is actually asleep.
+ */
+#include <vector>
+#include <pthread.h>
+
+using namespace std;
+
+/* How many times an end looks again before it sleeps */
+const int SPSC_SPINS = 1 << 10;
+
+template <class T>
+class SPSCQueue
+{
+ public:
+  /* Holds capacity items at once, rounded up to a power of two */
+  SPSCQueue(int capacity)
+  {
+    int size = 1;
+    while(size < capacity)
+      size <<= 1;
+    slots_.resize(size);
+    mask_ = size - 1;
+
+    head_ = 0;
+    tail_ = 0;
+    sleeping_ = 0;
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&wake_, NULL);
+  };
+
+  ~SPSCQueue()
+  {
+    pthread_mutex_destroy(&lock_);
+    pthread_cond_destroy(&wake_);
+  };
+
+  /* The producer's end: the slot for the next item, once there is room,
+   * which push() then hands over. The slot holds whatever was last in
+   * it, so anything it owns can be reused. */
+  T &reserve()
+  {
+    unsigned tail = tail_;
+    wait(&head_, tail - mask_ - 1);
+    return slots_[tail & mask_];
+  };
+
+  void push()
+  {
+    __atomic_store_n(&tail_, tail_ + 1, __ATOMIC_SEQ_CST);
+    wakeUp();
+  };
+
+  /* The consumer's end: the oldest item, once there is one, which pop()
+   * then gives back */
+  T &front()
+  {
+    unsigned head = head_;
+    wait(&tail_, head);
+    return slots_[head & mask_];
+  };
+
+  void pop()
+  {
+    __atomic_store_n(&head_, head_ + 1, __ATOMIC_SEQ_CST);
+    wakeUp();
+  };
+
+ private:
+  /* Until the other end's index has moved off busy */
+  void wait(unsigned *other, unsigned busy)
+  {
+    for(int i = 0; i < SPSC_SPINS; i++)
+      if(__atomic_load_n(other, __ATOMIC_ACQUIRE) != busy)
+        return;
+
+    /* Saying we're asleep before looking one last time means the other
+     * end either sees that and wakes us, or has already moved. It's a
+     * count, not a flag: the other end can be on its way to sleep before
+     * this one is all the way awake. */
+    pthread_mutex_lock(&lock_);
+    __atomic_add_fetch(&sleeping_, 1, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(other, __ATOMIC_SEQ_CST) == busy)
+      pthread_cond_wait(&wake_, &lock_);
+    __atomic_sub_fetch(&sleeping_, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&lock_);
+  };
+
+  void wakeUp()
+  {
+    if(__atomic_load_n(&sleeping_, __ATOMIC_SEQ_CST) > 0)
+    {
+      pthread_mutex_lock(&lock_);
+      pthread_cond_broadcast(&wake_);
+      pthread_mutex_unlock(&lock_);
+    }
+  };
+
+  vector<T> slots_;
+  unsigned mask_;
+
+  /* Apart, so the two ends aren't forever taking a cache line off each
+   * other */
+  char pad0_[64];
+  unsigned head_;
+  char pad1_[64];
+  unsigned tail_;
+  char pad2_[64];
+
+  int sleeping_;
+  pthread_mutex_t lock_;
+  pthread_cond_t wake_;
+};
+
+#endif
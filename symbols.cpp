@@ -0,0 +1,125 @@
+/*
+ * file:  symbols.cpp
+ *
+ * Description: The interning table behind symbols.h - a hash table of
+ * names chained through one vector, with the names themselves kept in
+ * symbol order so symbolName() is just an index.
+ *
+ * The names go in blocks that never move once they're made, found through
+ * a directory that's never resized, so looking a name up never reads
+ * anything intern() might be moving at the same time.
+ */
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "symbols.h"
+
+using namespace std;
+
+const int NAME_BLOCK_BITS = 12;
+const int NAME_BLOCK = 1 << NAME_BLOCK_BITS;
+/* Room for a quarter of a billion names */
+const int MAX_NAME_BLOCKS = 1 << 16;
+
+struct SymbolTable
+{
+  SymbolTable()
+  {
+    count = 0;
+    memset(blocks, 0, sizeof(blocks));
+    buckets.resize(256, -1);
+
+    /* These have to come out as MAIN_SYMBOL and RETURN_SYMBOL */
+    add("", 0, hash("", 0));
+    add("return", 6, hash("return", 6));
+  };
+
+  static unsigned hash(const char *name, size_t length)
+  {
+    /* FNV-1a */
+    unsigned h = 2166136261u;
+    for(size_t i = 0; i < length; i++)
+      h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h;
+  };
+
+  const string &name(Symbol s)
+  {
+    return blocks[s >> NAME_BLOCK_BITS][s & (NAME_BLOCK - 1)];
+  };
+
+  Symbol add(const char *name, size_t length, unsigned h)
+  {
+    Symbol s = count;
+    if(s % NAME_BLOCK == 0)
+    {
+      if(s / NAME_BLOCK >= MAX_NAME_BLOCKS)
+      {
+        cout << "Error:  too many names" << endl;
+        exit(1);
+      }
+      blocks[s / NAME_BLOCK] = new string[NAME_BLOCK];
+    }
+    blocks[s / NAME_BLOCK][s % NAME_BLOCK].assign(name, length);
+    count++;
+
+    hashes.push_back(h);
+    next.push_back(buckets[h & (buckets.size() - 1)]);
+    buckets[h & (buckets.size() - 1)] = s;
+
+    /* Keep the chains short by doubling once we're at one name a bucket */
+    if(count > (int)buckets.size())
+    {
+      buckets.assign(buckets.size() * 2, -1);
+      for(Symbol i = 0; i < count; i++)
+      {
+        next[i] = buckets[hashes[i] & (buckets.size() - 1)];
+        buckets[hashes[i] & (buckets.size() - 1)] = i;
+      }
+    }
+
+    return s;
+  };
+
+  string *blocks[MAX_NAME_BLOCKS];
+  int count;
+  vector<unsigned> hashes;
+  vector<Symbol> next;
+  vector<Symbol> buckets;
+};
+
+/* Built on first use, since the lexer may get to us before static
+ * initialisation of this file has */
+static SymbolTable &table()
+{
+  static SymbolTable t;
+  return t;
+}
+
+Symbol intern(const char *name)
+{
+  return intern(name, strlen(name));
+}
+
+Symbol intern(const char *name, size_t length)
+{
+  SymbolTable &t = table();
+  unsigned h = SymbolTable::hash(name, length);
+
+  for(Symbol s = t.buckets[h & (t.buckets.size() - 1)]; s != -1; s = t.next[s])
+    if(t.hashes[s] == h && t.name(s).size() == length &&
+       memcmp(t.name(s).data(), name, length) == 0)
+      return s;
+
+  return t.add(name, length, h);
+}
+
+const string &symbolName(Symbol s)
+{
+  return table().name(s);
+}
+
+int symbolCount()
+{
+  return table().count;
+}
@@ -0,0 +1,203 @@
+#ifndef __SYMBOLS_H__
+#define __SYMBOLS_H__
+/*
+ * file:  symbols.h
+ *
+ * Description: The table of interned identifiers. The lexer hands every
+ * identifier to intern() and from then on a name is just a small integer,
+ * so the symbol tables in the interpreter and compiler can be arrays
+ * indexed by it instead of maps keyed by strings.
+ *
+ * The first part is plain C so the flex-generated lexer can use it.
+ */
+
+typedef int Symbol;
+
+/* Pre-seeded so nobody has to look them up: the blank name the main
+ * function is compiled under, and the variable procedures return through */
+#define MAIN_SYMBOL 0
+#define RETURN_SYMBOL 1
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+Symbol intern(const char *name);
+
+#ifdef __cplusplus
+}
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+using namespace std;
+
+/* The same, for a name that isn't NUL terminated: the scanner's come
+ * straight out of the file */
+Symbol intern(const char *name, size_t length);
+
+/* Only one thread may intern() at a time, but any thread may ask for the
+ * name of a symbol that reached it through something that synchronizes
+ * with that one, even while it's interning more */
+const string &symbolName(Symbol s);
+int symbolCount();
+
+/* A table from symbols to values. Since symbols are dense it's just a
+ * vector, with a flag for whether each symbol has been bound at all. */
+template <class T>
+class SymbolMap
+{
+ public:
+  SymbolMap() {};
+
+  bool contains(Symbol s) const
+  {
+    return s >= 0 && s < (int)bound_.size() && bound_[s];
+  };
+
+  /* Like map::operator[], binds the symbol if it wasn't already */
+  T &operator[](Symbol s)
+  {
+    if(s >= (int)values_.size())
+    {
+      values_.resize(s + 1, T());
+      bound_.resize(s + 1, false);
+    }
+    bound_[s] = true;
+    return values_[s];
+  };
+
+  /* The value bound to s, or T() when there isn't one */
+  T get(Symbol s) const
+  {
+    return contains(s) ? values_[s] : T();
+  };
+
+  void erase(Symbol s)
+  {
+    if(contains(s))
+    {
+      bound_[s] = false;
+      values_[s] = T();
+    }
+  };
+
+  void clear() { values_.clear(); bound_.clear(); };
+
+  /* Every bound symbol, in order of name so that anything we print or
+   * lay out from it comes out the same as it always has */
+  vector<Symbol> keys() const
+  {
+    vector<Symbol> k;
+    for(int s = 0; s < (int)bound_.size(); s++)
+      if(bound_[s])
+        k.push_back(s);
+    sort(k.begin(), k.end(), byName);
+    return k;
+  };
+
+ private:
+  static bool byName(Symbol a, Symbol b)
+  {
+    return symbolName(a) < symbolName(b);
+  };
+
+  vector<T> values_;
+  vector<bool> bound_;
+};
+
+/* The same interface for a table that only ever holds a few symbols, like
+ * the variables of one procedure: the bindings are kept as pairs in order
+ * of symbol, so the table costs what it holds rather than one slot for
+ * every name in the program. Walking it goes in order of symbol. */
+template <class T>
+class SparseSymbolMap
+{
+ public:
+  typedef pair<Symbol, T> Binding;
+  typedef typename vector<Binding>::const_iterator const_iterator;
+
+  SparseSymbolMap() {};
+
+  bool contains(Symbol s) const
+  {
+    const_iterator it = find(s);
+    return it != bindings_.end() && it->first == s;
+  };
+
+  /* Like map::operator[], binds the symbol if it wasn't already */
+  T &operator[](Symbol s)
+  {
+    typename vector<Binding>::iterator it =
+      lower_bound(bindings_.begin(), bindings_.end(), s, before);
+    if(it == bindings_.end() || it->first != s)
+      it = bindings_.insert(it, Binding(s, T()));
+    return it->second;
+  };
+
+  /* The value bound to s, or T() when there isn't one */
+  T get(Symbol s) const
+  {
+    const_iterator it = find(s);
+    return it != bindings_.end() && it->first == s ? it->second : T();
+  };
+
+  void erase(Symbol s)
+  {
+    typename vector<Binding>::iterator it =
+      lower_bound(bindings_.begin(), bindings_.end(), s, before);
+    if(it != bindings_.end() && it->first == s)
+      bindings_.erase(it);
+  };
+
+  void clear() { bindings_.clear(); };
+
+  /* Binds s at the end; s has to come after every symbol already bound */
+  void append(Symbol s, const T &value)
+  {
+    bindings_.push_back(Binding(s, value));
+  };
+
+  const_iterator begin() const { return bindings_.begin(); };
+  const_iterator end() const { return bindings_.end(); };
+
+  bool operator==(const SparseSymbolMap &m) const
+  {
+    return bindings_ == m.bindings_;
+  };
+
+  /* Every bound symbol, in order of name, like SymbolMap::keys() */
+  vector<Symbol> keys() const
+  {
+    vector<Symbol> k;
+    for(const_iterator it = bindings_.begin(); it != bindings_.end(); it++)
+      k.push_back(it->first);
+    sort(k.begin(), k.end(), byName);
+    return k;
+  };
+
+ private:
+  static bool before(const Binding &b, Symbol s)
+  {
+    return b.first < s;
+  };
+
+  static bool byName(Symbol a, Symbol b)
+  {
+    return symbolName(a) < symbolName(b);
+  };
+
+  const_iterator find(Symbol s) const
+  {
+    return lower_bound(bindings_.begin(), bindings_.end(), s, before);
+  };
+
+  vector<Binding> bindings_;
+};
+
+#endif
+
+#endif